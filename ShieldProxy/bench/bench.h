@@ -0,0 +1,13 @@
+#pragma once
+
+#include "../shieldrelay.h"
+
+// Everything the relay sends through platform_send_batch() ends up counted here
+// instead of on the network
+extern unsigned long long bench_sent_datagrams;
+extern unsigned long long bench_sent_bytes;
+
+// Calls to malloc(), calloc() and realloc() since the process started
+extern volatile unsigned long long bench_allocations;
+
+unsigned long long bench_time_ns(void);
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include "bench.h"
+
+#include <time.h>
+
+// The platform layer for offline benchmarks. Sends are swallowed by the sink, so
+// nothing needs a NIC, root or a real Shield.
+
+unsigned long long bench_sent_datagrams;
+unsigned long long bench_sent_bytes;
+volatile unsigned long long bench_allocations;
+
+// glibc's own allocator, which the counting versions below hand off to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	bench_allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	bench_allocations++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	bench_allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+unsigned long long bench_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int platform_init(void)
+{
+	return 0;
+}
+
+void platform_cleanup(void)
+{
+}
+
+int platform_last_error(void)
+{
+	return errno;
+}
+
+int platform_error_is_transient(int error)
+{
+	return 1;
+}
+
+struct thread_stub_tuple {
+	thread_start_function thread_start;
+	void* thread_parameter;
+};
+
+static void *thread_stub(void *param)
+{
+	struct thread_stub_tuple tuple = *(struct thread_stub_tuple *) param;
+
+	free(param);
+	tuple.thread_start(tuple.thread_parameter);
+	return NULL;
+}
+
+int platform_start_thread(thread_start_function thread_start, void* thread_parameter, PLATFORM_THREAD *thread)
+{
+	struct thread_stub_tuple *tuple;
+	pthread_t local_thread;
+
+	tuple = (struct thread_stub_tuple *) malloc(sizeof(*tuple));
+	if (tuple == NULL)
+		return -1;
+
+	tuple->thread_start = thread_start;
+	tuple->thread_parameter = thread_parameter;
+	if (pthread_create(thread != NULL ? thread : &local_thread, NULL, thread_stub, tuple) != 0)
+	{
+		free(tuple);
+		return -1;
+	}
+
+	if (thread == NULL)
+		pthread_detach(local_thread);
+
+	return 0;
+}
+
+void platform_join_thread(PLATFORM_THREAD thread)
+{
+	pthread_join(thread, NULL);
+}
+
+int platform_iface_ip_table(unsigned int *ip_table, unsigned int *ip_table_len)
+{
+	*ip_table_len = 0;
+	return 0;
+}
+
+int platform_notify_iface_change(reconfigure_callback_function callback)
+{
+	return 0;
+}
+
+unsigned long long platform_time_us(void)
+{
+	return bench_time_ns() / 1000;
+}
+
+unsigned long long platform_wall_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void platform_sleep_ms(unsigned int ms)
+{
+	usleep(ms * 1000);
+}
+
+// The sink
+int platform_send_batch(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+	{
+		bench_sent_bytes += datagrams[i].length;
+	}
+	bench_sent_datagrams += count;
+
+	return (int) count;
+}
+
+int platform_set_traffic_class(SOCKET s, int dscp, int priority)
+{
+	return 0;
+}
+
+// Segmented sends land in the same sink, counted as the datagrams they'd become
+int platform_enable_segmentation(SOCKET s)
+{
+	return 0;
+}
+
+int platform_send_segmented(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	return platform_send_batch(s, datagrams, count);
+}
+
+int platform_recv_batch(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int platform_enable_timestamps(SOCKET s)
+{
+	return -1;
+}
+
+void platform_event_init(PLATFORM_EVENT *event)
+{
+	sem_init(event, 0, 0);
+}
+
+void platform_event_destroy(PLATFORM_EVENT *event)
+{
+	sem_destroy(event);
+}
+
+void platform_event_set(PLATFORM_EVENT *event)
+{
+	sem_post(event);
+}
+
+void platform_event_wait(PLATFORM_EVENT *event)
+{
+	while (sem_wait(event) != 0 && errno == EINTR);
+}
+
+void *platform_alloc_pool(size_t size, int huge_pages)
+{
+	return calloc(1, size);
+}
+
+void platform_free_pool(void *pool, size_t size)
+{
+	free(pool);
+}
+
+void platform_mutex_init(PLATFORM_MUTEX *mutex)
+{
+	pthread_mutex_init(mutex, NULL);
+}
+
+void platform_mutex_acquire(PLATFORM_MUTEX *mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+void platform_mutex_release(PLATFORM_MUTEX *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
\ No newline at end of file
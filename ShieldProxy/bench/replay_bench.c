@@ -0,0 +1,373 @@
+#include "bench.h"
+
+// The real capture path, including its private interface context
+#include "../pcap.c"
+
+// Defaults for the synthetic mix
+#define BENCH_PACKETS 100000
+#define BENCH_SHIELDS 4
+#define BENCH_ROUNDS 20
+
+// Captured packets handed to the handler between flushes, like one pcap_dispatch()
+#define BENCH_DISPATCH_SIZE 64
+
+// What each Shield gets per video frame in the synthetic mix
+#define BENCH_VIDEO_PACKETS 12
+#define BENCH_VIDEO_SIZE 1400
+#define BENCH_AUDIO_SIZE 220
+#define BENCH_CONTROL_SIZE 80
+
+#define BENCH_PC_ADDR 0x0A000001 // 10.0.0.1
+#define BENCH_SHIELD_ADDR 0x0A000064 // 10.0.0.100 and up
+#define BENCH_OTHER_ADDR 0x0A0000C8 // 10.0.0.200
+#define BENCH_SHIELD_PORT 40000
+
+struct bench_packet {
+	struct pcap_pkthdr header;
+	u_char *data;
+};
+
+struct bench_trace {
+	struct bench_packet *packets;
+	unsigned int count;
+	unsigned int allocated;
+};
+
+static struct interface_context bench_context;
+
+static int add_packet(struct bench_trace *trace, const struct pcap_pkthdr *header, const u_char *data)
+{
+	struct bench_packet *packets;
+	unsigned int allocated;
+
+	if (trace->count == trace->allocated)
+	{
+		allocated = trace->allocated != 0 ? trace->allocated * 2 : 1024;
+		packets = (struct bench_packet *) realloc(trace->packets, allocated * sizeof(*packets));
+		if (packets == NULL)
+		{
+			printf("Failed to allocate trace\n");
+			return -1;
+		}
+
+		trace->packets = packets;
+		trace->allocated = allocated;
+	}
+
+	trace->packets[trace->count].header = *header;
+	trace->packets[trace->count].data = (u_char *) malloc(header->caplen);
+	if (trace->packets[trace->count].data == NULL)
+	{
+		printf("Failed to allocate packet\n");
+		return -1;
+	}
+
+	memcpy(trace->packets[trace->count].data, data, header->caplen);
+	trace->count++;
+	return 0;
+}
+
+// Builds an Ethernet frame holding a UDP datagram. Addresses are in host byte order.
+static int add_datagram(struct bench_trace *trace, unsigned int src_addr, unsigned short src_port,
+	unsigned int dst_addr, unsigned short dst_port, unsigned int payload_length)
+{
+	u_char frame[ETHERNET_HEADER_SIZE + sizeof(struct ipv4_header) + sizeof(struct udpv4_header) + BENCH_VIDEO_SIZE];
+	struct pcap_pkthdr header;
+	struct ipv4_header *ip_hdr;
+	struct udpv4_header *udp_hdr;
+	unsigned long long now;
+
+	memset(frame, 0, sizeof(frame));
+	frame[12] = 0x08; // IPv4
+
+	ip_hdr = (struct ipv4_header *) (frame + ETHERNET_HEADER_SIZE);
+	ip_hdr->ver_ihl = 0x45;
+	ip_hdr->total_length = htons((unsigned short) (sizeof(*ip_hdr) + sizeof(*udp_hdr) + payload_length));
+	ip_hdr->ttl = 64;
+	ip_hdr->protocol = IPPROTO_UDP;
+	ip_hdr->src_addr = htonl(src_addr);
+	ip_hdr->dst_addr = htonl(dst_addr);
+
+	udp_hdr = (struct udpv4_header *) (ip_hdr + 1);
+	udp_hdr->src_port = htons(src_port);
+	udp_hdr->dst_port = htons(dst_port);
+	udp_hdr->length = htons((unsigned short) (sizeof(*udp_hdr) + payload_length));
+
+	// Stamped like a live capture so the latency histograms are exercised too
+	now = platform_wall_time_us();
+	header.ts.tv_sec = (long) (now / 1000000);
+	header.ts.tv_usec = (long) (now % 1000000);
+	header.caplen = header.len = ETHERNET_HEADER_SIZE + sizeof(*ip_hdr) + sizeof(*udp_hdr) + payload_length;
+
+	return add_packet(trace, &header, frame);
+}
+
+// Video bursts, audio and control to each Shield, the Shields' own traffic, and
+// some traffic for another host that the handler has to throw away
+static int build_synthetic(struct bench_trace *trace, unsigned int packets, unsigned int shields)
+{
+	unsigned short video, control, audio;
+	unsigned int shield, i;
+	int err;
+
+	video = proxy_config.udp_ports.values[0] + (unsigned short) proxy_config.port_offset;
+	control = proxy_config.udp_ports.values[1] + (unsigned short) proxy_config.port_offset;
+	audio = proxy_config.udp_ports.values[2] + (unsigned short) proxy_config.port_offset;
+
+	err = 0;
+	while (trace->count < packets && err == 0)
+	{
+		for (shield = 0; shield < shields && err == 0; shield++)
+		{
+			// The Shield talks to us from its own ports, which sets up its flows
+			for (i = 0; i < 3; i++)
+			{
+				err |= add_datagram(trace, BENCH_SHIELD_ADDR + shield, (unsigned short) (BENCH_SHIELD_PORT + i),
+					BENCH_PC_ADDR, i == 0 ? video : (i == 1 ? control : audio), BENCH_CONTROL_SIZE);
+			}
+
+			for (i = 0; i < BENCH_VIDEO_PACKETS; i++)
+			{
+				err |= add_datagram(trace, BENCH_PC_ADDR, video, BENCH_SHIELD_ADDR + shield, video, BENCH_VIDEO_SIZE);
+			}
+
+			err |= add_datagram(trace, BENCH_PC_ADDR, audio, BENCH_SHIELD_ADDR + shield, audio, BENCH_AUDIO_SIZE);
+			err |= add_datagram(trace, BENCH_PC_ADDR, control, BENCH_SHIELD_ADDR + shield, control, BENCH_CONTROL_SIZE);
+			err |= add_datagram(trace, BENCH_OTHER_ADDR, video, BENCH_OTHER_ADDR + 1, video, BENCH_VIDEO_SIZE);
+		}
+	}
+
+	return err;
+}
+
+// Guesses the streaming PC as the destination of the first datagram a Shield sent
+// to one of our ports from some other port
+static unsigned int guess_pc_address(struct bench_trace *trace)
+{
+	struct ipv4_header *ip_hdr;
+	struct udpv4_header *udp_hdr;
+	unsigned int i;
+	int port;
+
+	for (i = 0; i < trace->count; i++)
+	{
+		if (trace->packets[i].header.caplen < ETHERNET_HEADER_SIZE + sizeof(*ip_hdr) + sizeof(*udp_hdr))
+			continue;
+
+		ip_hdr = (struct ipv4_header *) (trace->packets[i].data + ETHERNET_HEADER_SIZE);
+		if (ip_hdr->protocol != IPPROTO_UDP)
+			continue;
+
+		udp_hdr = (struct udpv4_header *) ((u_char *) ip_hdr + ((ip_hdr->ver_ihl & 0xF) * 4));
+		port = UDPRELAY_PORT_INDEX(udp_hdr->dst_port);
+		if (port >= 0 && udp_hdr->src_port != udp_ports[port])
+			return ip_hdr->dst_addr;
+	}
+
+	return 0;
+}
+
+static int load_savefile(struct bench_trace *trace, const char *path)
+{
+	char errstr[PCAP_ERRBUF_SIZE];
+	struct pcap_pkthdr *header;
+	const u_char *data;
+	pcap_t *pcap_handle;
+	int err;
+
+	pcap_handle = pcap_open_offline(path, errstr);
+	if (pcap_handle == NULL)
+	{
+		printf("Failed to open %s (%s)\n", path, errstr);
+		return -1;
+	}
+
+	if (pcap_datalink(pcap_handle) != DLT_EN10MB)
+	{
+		printf("%s isn't an Ethernet capture\n", path);
+		pcap_close(pcap_handle);
+		return -1;
+	}
+
+	while ((err = pcap_next_ex(pcap_handle, &header, &data)) >= 0)
+	{
+		if (err == 1 && add_packet(trace, header, data) != 0)
+		{
+			pcap_close(pcap_handle);
+			return -1;
+		}
+	}
+
+	pcap_close(pcap_handle);
+
+	if (trace->count == 0)
+	{
+		printf("%s has no packets\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Sets the relay up like udprelay_register() would, minus the sockets
+static int setup_context(unsigned int pc_addr, int stable_buffers, unsigned int tx_slots)
+{
+	struct udprelay_port_context *port_context;
+	unsigned int i;
+
+	bench_context.name = "bench";
+	bench_context.iface_address.s_addr = pc_addr;
+	bench_context.relay_context.stable_buffers = stable_buffers;
+
+	if (reassembly_init(&bench_context.reassembly, proxy_config.reassembly_slots) != 0)
+		return -1;
+
+	// The send thread is started like the real one, just before the replay
+	if (txring_init(&bench_context.tx, tx_slots, 0) != 0)
+		return -1;
+	if (tx_slots != 0)
+		bench_context.relay_context.stable_buffers = 1;
+
+	for (i = 0; i < udp_port_count; i++)
+	{
+		port_context = &bench_context.relay_context.ports[i];
+		port_context->socket = -1;
+		port_context->dst_port = udp_ports[i];
+		flowtable_init(&port_context->flows);
+		latency_init(&port_context->latency);
+		port_context->segment_max = proxy_config.udp_gso ? UDPRELAY_SLOT_SIZE : 0;
+
+		port_context->batch.slots = (char *) malloc(UDPRELAY_BATCH_MAX * UDPRELAY_SLOT_SIZE);
+		if (port_context->batch.slots == NULL)
+		{
+			printf("Failed to allocate UDP batch\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void print_usage(const char *program)
+{
+	printf("Usage: %s [-n packets] [-s shields] [-r rounds] [-a pc-address] [-t] [-q slots] [savefile]\n\n", program);
+	printf("  -n  Packets in the synthetic mix (default %d)\n", BENCH_PACKETS);
+	printf("  -s  Shields streaming in the synthetic mix (default %d)\n", BENCH_SHIELDS);
+	printf("  -r  Times the packets are replayed (default %d)\n", BENCH_ROUNDS);
+	printf("  -a  Address of the streaming PC in the savefile (guessed if left out)\n");
+	printf("  -t  Treat capture buffers as stable, like the TPACKET ring\n");
+	printf("  -q  Send from a separate thread through a ring of this many slots\n");
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench_trace trace;
+	const char *savefile;
+	unsigned int packets, shields, rounds, pc_addr, tx_slots, round, i;
+	unsigned long long start, elapsed, allocations, handled;
+	int stable_buffers, arg;
+
+	packets = BENCH_PACKETS;
+	shields = BENCH_SHIELDS;
+	rounds = BENCH_ROUNDS;
+	pc_addr = 0;
+	stable_buffers = 0;
+	tx_slots = 0;
+	savefile = NULL;
+
+	for (arg = 1; arg < argc; arg++)
+	{
+		if (strcmp(argv[arg], "-t") == 0)
+			stable_buffers = 1;
+		else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc)
+			packets = strtoul(argv[++arg], NULL, 0);
+		else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc)
+			shields = strtoul(argv[++arg], NULL, 0);
+		else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc)
+			rounds = strtoul(argv[++arg], NULL, 0);
+		else if (strcmp(argv[arg], "-a") == 0 && arg + 1 < argc)
+			pc_addr = inet_addr(argv[++arg]);
+		else if (strcmp(argv[arg], "-q") == 0 && arg + 1 < argc)
+			tx_slots = strtoul(argv[++arg], NULL, 0);
+		else if (argv[arg][0] != '-' && savefile == NULL)
+			savefile = argv[arg];
+		else
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (packets == 0 || shields == 0 || shields > FLOW_TABLE_MAX_USED || rounds == 0)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if (udprelay_init_ports() != 0)
+		return 1;
+
+	memset(&trace, 0, sizeof(trace));
+	if (savefile != NULL)
+	{
+		if (load_savefile(&trace, savefile) != 0)
+			return 1;
+
+		if (pc_addr == 0)
+			pc_addr = guess_pc_address(&trace);
+		if (pc_addr == 0)
+		{
+			printf("No Shield traffic to find the streaming PC from, pass -a\n");
+			return 1;
+		}
+	}
+	else
+	{
+		if (build_synthetic(&trace, packets, shields) != 0)
+			return 1;
+
+		pc_addr = htonl(BENCH_PC_ADDR);
+	}
+
+	if (setup_context(pc_addr, stable_buffers, tx_slots) != 0)
+		return 1;
+
+	// Only the replay itself is measured
+	allocations = bench_allocations;
+	start = bench_time_ns();
+
+	if (tx_slots != 0 && platform_start_thread(pcap_sender_thread, &bench_context, &bench_context.sender_thread) != 0)
+		return 1;
+
+	for (round = 0; round < rounds; round++)
+	{
+		for (i = 0; i < trace.count; i++)
+		{
+			packet_handler((u_char *) &bench_context, &trace.packets[i].header, trace.packets[i].data);
+			if ((i + 1) % BENCH_DISPATCH_SIZE == 0)
+				capture_batch_done((u_char *) &bench_context);
+		}
+		capture_batch_done((u_char *) &bench_context);
+	}
+
+	// Everything queued has been sent once the thread is gone
+	if (tx_slots != 0)
+		stop_sender(&bench_context);
+
+	elapsed = bench_time_ns() - start;
+	allocations = bench_allocations - allocations;
+	handled = (unsigned long long) trace.count * rounds;
+	if (elapsed == 0)
+		elapsed = 1;
+
+	printf("Replayed %u packets %u times in %.1f ms\n", trace.count, rounds, elapsed / 1000000.0);
+	printf("  %.0f packets/s\n", handled * 1000000000.0 / elapsed);
+	printf("  %.1f ns/packet\n", (double) elapsed / handled);
+	printf("  %llu filtered, %llu forwarded (%llu bytes)\n",
+		bench_context.stats.filtered_packets, bench_sent_datagrams, bench_sent_bytes);
+	printf("  %llu allocations (%.3f per packet)\n", allocations, (double) allocations / handled);
+	if (tx_slots != 0)
+		printf("  %llu queued, %llu dropped by the send ring\n", bench_context.tx.queued, bench_context.tx.dropped);
+
+	return 0;
+}
\ No newline at end of file
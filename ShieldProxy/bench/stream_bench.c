@@ -0,0 +1,608 @@
+#include "../shieldrelay.h"
+
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Streams a synthetic game through a real proxy between a fake GameStream host in
+// this namespace and a fake Shield in its own network namespace, then reports what
+// made it across. Needs root for the namespace.
+
+#define BENCH_NETNS "shieldbench"
+#define BENCH_HOST_IFACE "sbench-h"
+#define BENCH_SHIELD_IFACE "sbench-s"
+#define BENCH_HOST_ADDR "10.201.0.1"
+#define BENCH_SHIELD_ADDR "10.201.0.2"
+
+// The Shield talks to the proxy from its own ports, like it would from behind NAT
+#define BENCH_SHIELD_PORT 40000
+
+#define BENCH_DURATION_S 5
+#define BENCH_BITRATE_MBPS 20
+#define BENCH_FPS 60
+#define BENCH_VIDEO_SIZE 1400
+#define BENCH_AUDIO_INTERVAL_US 5000
+#define BENCH_AUDIO_SIZE 220
+#define BENCH_CONTROL_INTERVAL_US 50000
+#define BENCH_CONTROL_SIZE 80
+
+// How often the Shield reminds the proxy where it is
+#define BENCH_KEEPALIVE_INTERVAL_US 100000
+
+// Time the proxy gets to start up, and for the last packets to arrive
+#define BENCH_STARTUP_MS 1500
+#define BENCH_DRAIN_MS 500
+
+// Datagrams whose send time has been picked but that haven't gone out yet
+#define BENCH_PENDING_MAX 1024
+
+#define STREAM_VIDEO 0
+#define STREAM_CONTROL 1
+#define STREAM_AUDIO 2
+#define STREAM_COUNT 3
+
+static const char *stream_names[STREAM_COUNT] = { "video", "control", "audio" };
+
+// Leads every datagram the host sends
+struct bench_header {
+	unsigned int seq;
+	unsigned int stream;
+	unsigned long long send_ns;
+};
+
+// Filled in by the Shield, in memory shared with it
+struct stream_result {
+	unsigned long long sent;
+	unsigned long long injected_drops;
+	unsigned long long received;
+	unsigned long long bytes;
+	unsigned long long reordered;
+	unsigned int highest_seq;
+	unsigned long long first_ns, last_ns;
+
+	// Host to Shield delay of each datagram in nanoseconds
+	unsigned long long latency_capacity;
+	unsigned long long *latencies;
+};
+
+struct bench_shared {
+	volatile int stop;
+	struct stream_result streams[STREAM_COUNT];
+};
+
+struct pending_datagram {
+	unsigned long long send_ns;
+	unsigned int stream;
+	unsigned int seq;
+	unsigned int length;
+};
+
+struct bench_options {
+	unsigned int duration_s;
+	unsigned int bitrate_mbps;
+	unsigned int fps;
+	double loss_percent;
+	unsigned int jitter_us;
+};
+
+static struct bench_shared *shared;
+static pid_t proxy_pid, shield_pid;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until_ns(unsigned long long deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000;
+	ts.tv_nsec = deadline % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int run_command(const char *command)
+{
+	if (system(command) != 0)
+	{
+		printf("Failed to run: %s\n", command);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void teardown_netns(void)
+{
+	// Deleting the namespace takes the veth pair with it
+	if (system("ip netns del " BENCH_NETNS " 2>/dev/null") != 0)
+	{
+		// It wasn't there
+	}
+}
+
+static int setup_netns(void)
+{
+	teardown_netns();
+
+	if (run_command("ip netns add " BENCH_NETNS) != 0 ||
+		run_command("ip link add " BENCH_HOST_IFACE " type veth peer name " BENCH_SHIELD_IFACE) != 0 ||
+		run_command("ip link set " BENCH_SHIELD_IFACE " netns " BENCH_NETNS) != 0 ||
+		run_command("ip addr add " BENCH_HOST_ADDR "/24 dev " BENCH_HOST_IFACE) != 0 ||
+		run_command("ip link set " BENCH_HOST_IFACE " up") != 0 ||
+		run_command("ip netns exec " BENCH_NETNS " ip addr add " BENCH_SHIELD_ADDR "/24 dev " BENCH_SHIELD_IFACE) != 0 ||
+		run_command("ip netns exec " BENCH_NETNS " ip link set " BENCH_SHIELD_IFACE " up") != 0 ||
+		run_command("ip netns exec " BENCH_NETNS " ip link set lo up") != 0)
+	{
+		teardown_netns();
+		return -1;
+	}
+
+	return 0;
+}
+
+static int open_socket(const char *address, unsigned short port)
+{
+	struct sockaddr_in addr;
+	int s, opt;
+
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == -1)
+	{
+		printf("Failed to create socket (%d)\n", errno);
+		return -1;
+	}
+
+	// The host shares its ports with the proxy's forwarding sockets
+	opt = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(address);
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+	{
+		printf("Failed to bind %s:%u (%d)\n", address, port, errno);
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+static void receive_datagram(char *data, int length, unsigned long long received_ns)
+{
+	struct bench_header *header = (struct bench_header *) data;
+	struct stream_result *result;
+
+	if (length < (int) sizeof(*header) || header->stream >= STREAM_COUNT)
+		return;
+
+	result = &shared->streams[header->stream];
+	if (result->received == 0)
+		result->first_ns = received_ns;
+	result->last_ns = received_ns;
+
+	if (result->received != 0 && header->seq < result->highest_seq)
+		result->reordered++;
+	else
+		result->highest_seq = header->seq;
+
+	if (result->received < result->latency_capacity)
+		result->latencies[result->received] = received_ns - header->send_ns;
+
+	result->received++;
+	result->bytes += length;
+}
+
+// Runs in the Shield's namespace until the host is done
+static void shield_main(void)
+{
+	struct pollfd fds[STREAM_COUNT];
+	struct sockaddr_in host_addr;
+	unsigned long long next_keepalive, now;
+	char buffer[2048];
+	int netns_fd, length, i;
+
+	netns_fd = open("/var/run/netns/" BENCH_NETNS, O_RDONLY);
+	if (netns_fd == -1 || setns(netns_fd, CLONE_NEWNET) != 0)
+	{
+		printf("Failed to enter the Shield's namespace (%d)\n", errno);
+		_exit(1);
+	}
+	close(netns_fd);
+
+	for (i = 0; i < STREAM_COUNT; i++)
+	{
+		fds[i].fd = open_socket(BENCH_SHIELD_ADDR, (unsigned short) (BENCH_SHIELD_PORT + i));
+		fds[i].events = POLLIN;
+		if (fds[i].fd == -1)
+			_exit(1);
+	}
+
+	memset(&host_addr, 0, sizeof(host_addr));
+	host_addr.sin_family = AF_INET;
+	host_addr.sin_addr.s_addr = inet_addr(BENCH_HOST_ADDR);
+
+	next_keepalive = 0;
+	while (!shared->stop)
+	{
+		now = now_ns();
+		if (now >= next_keepalive)
+		{
+			// Each port is learned from what the Shield sends to it
+			for (i = 0; i < STREAM_COUNT; i++)
+			{
+				host_addr.sin_port = htons(proxy_config.udp_ports.values[i] + (unsigned short) proxy_config.port_offset);
+				sendto(fds[i].fd, "ping", 4, 0, (struct sockaddr *) &host_addr, sizeof(host_addr));
+			}
+			next_keepalive = now + BENCH_KEEPALIVE_INTERVAL_US * 1000ULL;
+		}
+
+		if (poll(fds, STREAM_COUNT, 10) <= 0)
+			continue;
+
+		for (i = 0; i < STREAM_COUNT; i++)
+		{
+			if (!(fds[i].revents & POLLIN))
+				continue;
+
+			while ((length = recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+			{
+				receive_datagram(buffer, length, now_ns());
+			}
+		}
+	}
+
+	_exit(0);
+}
+
+// Keeps the pending datagrams sorted by send time
+static void queue_datagram(struct pending_datagram *pending, unsigned int *count,
+	const struct bench_options *options, unsigned long long nominal_ns, unsigned int stream,
+	unsigned int *seq, unsigned int length)
+{
+	struct pending_datagram datagram;
+	unsigned int i;
+
+	datagram.stream = stream;
+	datagram.seq = seq[stream]++;
+	datagram.length = length;
+	datagram.send_ns = nominal_ns;
+
+	// Injected loss happens before the proxy ever sees it
+	if (options->loss_percent > 0 && rand() < options->loss_percent / 100.0 * RAND_MAX)
+	{
+		shared->streams[stream].injected_drops++;
+		return;
+	}
+
+	// Jitter can push a datagram behind later ones, which reorders them
+	if (options->jitter_us != 0)
+		datagram.send_ns += (unsigned long long) (rand() % options->jitter_us) * 1000;
+
+	if (*count == BENCH_PENDING_MAX)
+	{
+		shared->streams[stream].injected_drops++;
+		return;
+	}
+
+	for (i = *count; i > 0 && pending[i - 1].send_ns > datagram.send_ns; i--)
+		pending[i] = pending[i - 1];
+	pending[i] = datagram;
+	(*count)++;
+}
+
+static void send_due(int *sockets, struct pending_datagram *pending, unsigned int *count, unsigned long long now)
+{
+	struct bench_header *header;
+	struct sockaddr_in shield_addr;
+	char buffer[BENCH_VIDEO_SIZE];
+	unsigned int sent;
+
+	memset(buffer, 0, sizeof(buffer));
+	header = (struct bench_header *) buffer;
+
+	memset(&shield_addr, 0, sizeof(shield_addr));
+	shield_addr.sin_family = AF_INET;
+	shield_addr.sin_addr.s_addr = inet_addr(BENCH_SHIELD_ADDR);
+
+	for (sent = 0; sent < *count && pending[sent].send_ns <= now; sent++)
+	{
+		// The host streams to the Shield's default port, and the proxy moves it
+		shield_addr.sin_port = htons(proxy_config.udp_ports.values[pending[sent].stream] + (unsigned short) proxy_config.port_offset);
+
+		header->seq = pending[sent].seq;
+		header->stream = pending[sent].stream;
+		header->send_ns = now_ns();
+		if (sendto(sockets[pending[sent].stream], buffer, pending[sent].length, 0,
+			(struct sockaddr *) &shield_addr, sizeof(shield_addr)) >= 0)
+		{
+			shared->streams[pending[sent].stream].sent++;
+		}
+	}
+
+	memmove(pending, pending + sent, (*count - sent) * sizeof(*pending));
+	*count -= sent;
+}
+
+// Streams for the configured duration from this namespace
+static int host_main(const struct bench_options *options)
+{
+	struct pending_datagram pending[BENCH_PENDING_MAX];
+	unsigned long long start, end, next_frame, next_audio, next_control, next, now;
+	unsigned int seq[STREAM_COUNT], pending_count, frame_packets, i;
+	int sockets[STREAM_COUNT];
+
+	for (i = 0; i < STREAM_COUNT; i++)
+	{
+		sockets[i] = open_socket(BENCH_HOST_ADDR, proxy_config.udp_ports.values[i] + (unsigned short) proxy_config.port_offset);
+		if (sockets[i] == -1)
+			return -1;
+		seq[i] = 0;
+	}
+
+	// Each frame's packets leave back to back, like an encoder flushing a frame
+	frame_packets = (unsigned int) ((unsigned long long) options->bitrate_mbps * 1000000 / 8 / options->fps / BENCH_VIDEO_SIZE);
+	if (frame_packets == 0)
+		frame_packets = 1;
+
+	pending_count = 0;
+	start = now_ns();
+	end = start + options->duration_s * 1000000000ULL;
+	next_frame = next_audio = next_control = start;
+
+	while (next_frame < end || pending_count != 0)
+	{
+		now = now_ns();
+
+		if (next_frame < end && now >= next_frame)
+		{
+			for (i = 0; i < frame_packets; i++)
+				queue_datagram(pending, &pending_count, options, next_frame, STREAM_VIDEO, seq, BENCH_VIDEO_SIZE);
+			next_frame += 1000000000ULL / options->fps;
+		}
+
+		if (next_audio < end && now >= next_audio)
+		{
+			queue_datagram(pending, &pending_count, options, next_audio, STREAM_AUDIO, seq, BENCH_AUDIO_SIZE);
+			next_audio += BENCH_AUDIO_INTERVAL_US * 1000ULL;
+		}
+
+		if (next_control < end && now >= next_control)
+		{
+			queue_datagram(pending, &pending_count, options, next_control, STREAM_CONTROL, seq, BENCH_CONTROL_SIZE);
+			next_control += BENCH_CONTROL_INTERVAL_US * 1000ULL;
+		}
+
+		send_due(sockets, pending, &pending_count, now);
+
+		// Sleep until something is due
+		next = next_frame;
+		if (next_audio < next)
+			next = next_audio;
+		if (next_control < next)
+			next = next_control;
+		if (pending_count != 0 && pending[0].send_ns < next)
+			next = pending[0].send_ns;
+		if (next > now)
+			sleep_until_ns(next);
+	}
+
+	for (i = 0; i < STREAM_COUNT; i++)
+		close(sockets[i]);
+
+	return 0;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double percentile_us(unsigned long long *sorted, unsigned long long count, double fraction)
+{
+	unsigned long long index;
+
+	if (count == 0)
+		return 0;
+
+	index = (unsigned long long) ceil(fraction * count);
+	if (index != 0)
+		index--;
+	return sorted[index] / 1000.0;
+}
+
+static void report(void)
+{
+	struct stream_result *result;
+	unsigned long long samples;
+	double seconds, loss;
+	int i;
+
+	printf("\n%-8s %9s %9s %8s %9s %10s %9s %9s %9s %9s\n", "stream", "sent", "received", "loss%",
+		"reordered", "Mbit/s", "p50 us", "p99 us", "p99.9 us", "max us");
+
+	for (i = 0; i < STREAM_COUNT; i++)
+	{
+		result = &shared->streams[i];
+
+		samples = result->received < result->latency_capacity ? result->received : result->latency_capacity;
+		qsort(result->latencies, (size_t) samples, sizeof(result->latencies[0]), compare_latency);
+
+		seconds = (result->last_ns - result->first_ns) / 1000000000.0;
+		loss = result->sent != 0 && result->received < result->sent ?
+			100.0 * (result->sent - result->received) / result->sent : 0;
+
+		printf("%-8s %9llu %9llu %8.2f %9llu %10.2f %9.1f %9.1f %9.1f %9.1f\n",
+			stream_names[i], result->sent, result->received, loss, result->reordered,
+			seconds > 0 ? result->bytes * 8 / seconds / 1000000 : 0,
+			percentile_us(result->latencies, samples, 0.5),
+			percentile_us(result->latencies, samples, 0.99),
+			percentile_us(result->latencies, samples, 0.999),
+			percentile_us(result->latencies, samples, 1.0));
+
+		if (result->injected_drops != 0)
+			printf("%-8s %llu datagrams dropped by injection before the proxy\n", "", result->injected_drops);
+	}
+}
+
+static int allocate_results(const struct bench_options *options)
+{
+	unsigned long long capacity[STREAM_COUNT];
+	size_t size;
+	char *memory;
+	int i;
+
+	// Room for every datagram each stream can send, plus a second of slack
+	capacity[STREAM_VIDEO] = (unsigned long long) (options->duration_s + 1) * options->bitrate_mbps * 1000000 / 8 / BENCH_VIDEO_SIZE + options->fps;
+	capacity[STREAM_AUDIO] = (options->duration_s + 1) * (1000000ULL / BENCH_AUDIO_INTERVAL_US);
+	capacity[STREAM_CONTROL] = (options->duration_s + 1) * (1000000ULL / BENCH_CONTROL_INTERVAL_US);
+
+	size = sizeof(*shared);
+	for (i = 0; i < STREAM_COUNT; i++)
+		size += capacity[i] * sizeof(unsigned long long);
+
+	memory = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+	{
+		printf("Failed to allocate results\n");
+		return -1;
+	}
+
+	shared = (struct bench_shared *) memory;
+	memory += sizeof(*shared);
+	for (i = 0; i < STREAM_COUNT; i++)
+	{
+		shared->streams[i].latency_capacity = capacity[i];
+		shared->streams[i].latencies = (unsigned long long *) memory;
+		memory += capacity[i] * sizeof(unsigned long long);
+	}
+
+	return 0;
+}
+
+static void print_usage(const char *program)
+{
+	printf("Usage: %s [--option=value]... -- shieldproxy [proxy options]...\n\n", program);
+	printf("  --duration      Seconds to stream for (default %d)\n", BENCH_DURATION_S);
+	printf("  --bitrate-mbps  Video bitrate (default %d)\n", BENCH_BITRATE_MBPS);
+	printf("  --fps           Video frames per second (default %d)\n", BENCH_FPS);
+	printf("  --loss          Percent of datagrams to drop before the proxy (default 0)\n");
+	printf("  --jitter-us     Most microseconds each datagram is randomly held back (default 0)\n");
+	printf("\nThe proxy options are passed through, but --udp-ports and --port-offset must match.\n");
+}
+
+static int parse_options(int argc, char *argv[], struct bench_options *options, int *proxy_arg)
+{
+	const char *arg, *value;
+	int i;
+
+	options->duration_s = BENCH_DURATION_S;
+	options->bitrate_mbps = BENCH_BITRATE_MBPS;
+	options->fps = BENCH_FPS;
+	options->loss_percent = 0;
+	options->jitter_us = 0;
+
+	for (i = 1; i < argc; i++)
+	{
+		arg = argv[i];
+		if (strcmp(arg, "--") == 0)
+		{
+			*proxy_arg = i + 1;
+			return *proxy_arg < argc ? 0 : -1;
+		}
+
+		value = strchr(arg, '=');
+		if (value == NULL)
+			return -1;
+		value++;
+
+		if (strncmp(arg, "--duration=", 11) == 0)
+			options->duration_s = strtoul(value, NULL, 0);
+		else if (strncmp(arg, "--bitrate-mbps=", 15) == 0)
+			options->bitrate_mbps = strtoul(value, NULL, 0);
+		else if (strncmp(arg, "--fps=", 6) == 0)
+			options->fps = strtoul(value, NULL, 0);
+		else if (strncmp(arg, "--loss=", 7) == 0)
+			options->loss_percent = strtod(value, NULL);
+		else if (strncmp(arg, "--jitter-us=", 12) == 0)
+			options->jitter_us = strtoul(value, NULL, 0);
+		else
+			return -1;
+	}
+
+	return -1;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench_options options;
+	int proxy_arg, err;
+
+	if (parse_options(argc, argv, &options, &proxy_arg) != 0 ||
+		options.duration_s == 0 || options.fps == 0 || options.bitrate_mbps == 0)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	// Pick up the proxy's port settings so both ends agree with it
+	err = config_parse_args(argc - proxy_arg, argv + proxy_arg);
+	if (err != 0)
+		return 1;
+
+	if (proxy_config.udp_ports.count < STREAM_COUNT)
+	{
+		printf("The proxy must relay at least %d UDP ports\n", STREAM_COUNT);
+		return 1;
+	}
+
+	if (allocate_results(&options) != 0 || setup_netns() != 0)
+		return 1;
+
+	proxy_pid = fork();
+	if (proxy_pid == 0)
+	{
+		execv(argv[proxy_arg], argv + proxy_arg);
+		printf("Failed to start %s (%d)\n", argv[proxy_arg], errno);
+		_exit(1);
+	}
+
+	shield_pid = fork();
+	if (shield_pid == 0)
+		shield_main();
+
+	// The proxy has to find the interface and learn the Shield's ports first
+	sleep_until_ns(now_ns() + BENCH_STARTUP_MS * 1000000ULL);
+
+	printf("Streaming %u Mbit/s at %u fps for %u seconds\n", options.bitrate_mbps, options.fps, options.duration_s);
+	err = host_main(&options);
+
+	sleep_until_ns(now_ns() + BENCH_DRAIN_MS * 1000000ULL);
+	shared->stop = 1;
+	waitpid(shield_pid, NULL, 0);
+
+	kill(proxy_pid, SIGTERM);
+	waitpid(proxy_pid, NULL, 0);
+	teardown_netns();
+
+	if (err != 0)
+		return 1;
+
+	report();
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,289 @@
+#include "shieldrelay.h"
+
+#define CONFIG_TYPE_UINT 1
+#define CONFIG_TYPE_LIST 2
+#define CONFIG_TYPE_ADDRESS 3
+#define CONFIG_TYPE_STRING 4
+
+struct config_option {
+	const char *name;
+	int type;
+	void *value;
+	unsigned int min;
+	unsigned int max;
+	const char *description;
+};
+
+struct proxy_config proxy_config = {
+	CAPTURE_RING_DEFAULT,
+	CAPTURE_RING_BLOCK_SIZE,
+	CAPTURE_RING_BLOCK_COUNT,
+	CAPTURE_RING_RETIRE_MS,
+	CAPTURE_SNAPLEN,
+	CAPTURE_BUFFER_SIZE,
+	CAPTURE_BUFFER_MAX,
+	0,
+	1,
+	{ 0 },
+	0,
+	UDPRELAY_BATCH_MAX,
+	UDPRELAY_BATCH_DEADLINE_US,
+	1,
+	TXRING_SLOTS,
+	0,
+	{ SHIELD_UDP_PORTS, { SHIELD_UDP_VIDEO_PORT, SHIELD_UDP_CONTROL_PORT, SHIELD_UDP_AUDIO_PORT } },
+	0,
+	{ SHIELD_UDP_PRIORITY_PORTS, { SHIELD_UDP_CONTROL_PORT, SHIELD_UDP_AUDIO_PORT } },
+	1,
+	0,
+	0,
+	{ SHIELD_TCP_PORTS, { SHIELD_TCP_PORT_LIST } },
+	1,
+	0,
+	0,
+	REASSEMBLY_SLOTS,
+	REASSEMBLY_TIMEOUT_MS,
+	UDPRELAY_FLOW_IDLE_TIMEOUT,
+	STATS_PORT,
+	NULL,
+	0,
+	1,
+	1,
+	MDNS_RATE_LIMIT,
+	MDNS_CLIENT_TIMEOUT,
+};
+
+static const struct config_option options[] = {
+	{ "capture-ring", CONFIG_TYPE_UINT, &proxy_config.capture_ring, 0, 1,
+		"Capture with TPACKET_V3 rings instead of pcap (Linux only, 0 or 1)" },
+	{ "ring-block-size", CONFIG_TYPE_UINT, &proxy_config.ring_block_size, 4096, 1 << 30,
+		"Size of each capture ring block in bytes" },
+	{ "ring-block-count", CONFIG_TYPE_UINT, &proxy_config.ring_block_count, 2, 65536,
+		"Number of blocks in each capture ring" },
+	{ "ring-retire-ms", CONFIG_TYPE_UINT, &proxy_config.ring_retire_ms, 0, 1000,
+		"Milliseconds before a partially filled ring block is handed to us" },
+	{ "capture-snaplen", CONFIG_TYPE_UINT, &proxy_config.capture_snaplen, 128, 262144,
+		"Largest frame libpcap captures, longer ones are counted and dropped" },
+	{ "capture-buffer-size", CONFIG_TYPE_UINT, &proxy_config.capture_buffer_size, 65536, 1 << 30,
+		"Starting size of each libpcap capture buffer in bytes" },
+	{ "capture-buffer-max", CONFIG_TYPE_UINT, &proxy_config.capture_buffer_max, 65536, 1 << 30,
+		"Largest a libpcap capture buffer grows to while the kernel drops packets" },
+	{ "engine", CONFIG_TYPE_UINT, &proxy_config.engine, 0, 2,
+		"0 runs a thread per interface, 1 runs everything on one io_uring thread, 2 on epoll workers (Linux only)" },
+	{ "engine-workers", CONFIG_TYPE_UINT, &proxy_config.engine_workers, 1, ENGINE_MAX_WORKERS,
+		"Number of epoll engine worker threads" },
+	{ "engine-cpus", CONFIG_TYPE_LIST, &proxy_config.engine_cpus, 0, 1023,
+		"Comma separated CPUs to pin engine workers to, in worker order" },
+	{ "engine-fifo", CONFIG_TYPE_UINT, &proxy_config.engine_fifo, 0, 99,
+		"Run engine workers under SCHED_FIFO at this priority (0 leaves them alone)" },
+	{ "batch-size", CONFIG_TYPE_UINT, &proxy_config.batch_size, 1, UDPRELAY_BATCH_MAX,
+		"Most forwarded datagrams sent in one batch (1 disables batching)" },
+	{ "batch-deadline-us", CONFIG_TYPE_UINT, &proxy_config.batch_deadline_us, 0, 1000000,
+		"Microseconds a datagram may wait in a batch before it's sent" },
+	{ "udp-gso", CONFIG_TYPE_UINT, &proxy_config.udp_gso, 0, 1,
+		"Send runs of equal-sized datagrams as one super-packet with UDP segmentation offload (Linux only, 0 or 1)" },
+	{ "tx-ring-slots", CONFIG_TYPE_UINT, &proxy_config.tx_ring_slots, 0, TXRING_MAX_SLOTS,
+		"Captured datagrams that may wait for each interface's send thread, a power of two from 32 (0 sends from the capture thread, as --engine always does)" },
+	{ "tx-hugepages", CONFIG_TYPE_UINT, &proxy_config.tx_hugepages, 0, 1,
+		"Back each send ring's packet pool with huge pages (0 or 1)" },
+	{ "udp-ports", CONFIG_TYPE_LIST, &proxy_config.udp_ports, 1, 65535,
+		"Comma separated UDP ports to relay (default 47998,47999,48000)" },
+	{ "port-offset", CONFIG_TYPE_UINT, &proxy_config.port_offset, 0, 65535,
+		"Added to every relayed UDP and TCP port, for hosts with a shifted port base" },
+	{ "priority-ports", CONFIG_TYPE_LIST, &proxy_config.priority_ports, 1, 65535,
+		"Comma separated UDP ports sent ahead of the others (default 47999,48000)" },
+	{ "dscp", CONFIG_TYPE_UINT, &proxy_config.dscp, 0, 1,
+		"Mark relayed UDP traffic with DSCP and socket priorities for its class (0 or 1)" },
+	{ "target", CONFIG_TYPE_ADDRESS, &proxy_config.target, 0, 0,
+		"IPv4 address of the streaming PC when running on a relay host, enables the TCP relay (Linux only)" },
+	{ "socket-proxy", CONFIG_TYPE_UINT, &proxy_config.socket_proxy, 0, 1,
+		"Own the UDP ports and forward them to --target instead of capturing (Linux only, 0 or 1)" },
+	{ "tcp-ports", CONFIG_TYPE_LIST, &proxy_config.tcp_ports, 1, 65535,
+		"Comma separated TCP ports to relay (default 35043,47989,47991,47995,47996)" },
+	{ "tcp-nodelay", CONFIG_TYPE_UINT, &proxy_config.tcp_nodelay, 0, 1,
+		"Disable Nagle's algorithm on relayed TCP connections (0 or 1)" },
+	{ "tcp-buffer-size", CONFIG_TYPE_UINT, &proxy_config.tcp_buffer_size, 0, 1 << 30,
+		"Socket buffer size for relayed TCP connections (0 keeps the kernel's autotuning)" },
+	{ "tcp-pipe-size", CONFIG_TYPE_UINT, &proxy_config.tcp_pipe_size, 0, 1 << 30,
+		"Size of the pipes TCP data is spliced through (0 keeps the default)" },
+	{ "reassembly-slots", CONFIG_TYPE_UINT, &proxy_config.reassembly_slots, 0, 1024,
+		"Fragmented datagrams reassembled at once per interface, 64 KB each (0 disables reassembly)" },
+	{ "reassembly-timeout-ms", CONFIG_TYPE_UINT, &proxy_config.reassembly_timeout_ms, 1, 60000,
+		"Milliseconds a fragmented datagram may wait for the rest of its fragments" },
+	{ "flow-idle-timeout", CONFIG_TYPE_UINT, &proxy_config.flow_idle_timeout, 1, 86400,
+		"Seconds a Shield may stay quiet before we stop relaying to it" },
+	{ "stats-port", CONFIG_TYPE_UINT, &proxy_config.stats_port, 0, 65535,
+		"Serve Prometheus stats on this TCP port on 127.0.0.1 (0 leaves it off)" },
+	{ "stats-socket", CONFIG_TYPE_STRING, &proxy_config.stats_socket, 0, 0,
+		"Serve Prometheus stats on a Unix socket at this path (Linux only)" },
+	{ "latency-timestamps", CONFIG_TYPE_UINT, &proxy_config.latency_timestamps, 0, 1,
+		"Measure socket proxy latency from kernel receive timestamps (Linux only, 0 or 1)" },
+	{ "mdns-cache", CONFIG_TYPE_UINT, &proxy_config.mdns_cache, 0, 1,
+		"Answer GameStream discovery queries from the other relay with cached records (0 or 1)" },
+	{ "mdns-filter", CONFIG_TYPE_UINT, &proxy_config.mdns_filter, 0, 1,
+		"Drop unrelated, duplicate and already known MDNS traffic instead of relaying it (0 or 1)" },
+	{ "mdns-rate-limit", CONFIG_TYPE_UINT, &proxy_config.mdns_rate_limit, 0, 100000,
+		"MDNS packets per second relayed in each direction (0 for no limit)" },
+	{ "mdns-client-timeout", CONFIG_TYPE_UINT, &proxy_config.mdns_client_timeout, 1, 86400,
+		"Seconds a remote relay may stay quiet before it stops getting MDNS traffic from the LAN" },
+};
+
+#define OPTION_COUNT (sizeof(options) / sizeof(options[0]))
+
+static void print_usage(const char *program)
+{
+	unsigned int i;
+
+	printf("Usage: %s [--option=value]...\n\n", program);
+	for (i = 0; i < OPTION_COUNT; i++)
+	{
+		printf("  --%-20s %s\n", options[i].name, options[i].description);
+	}
+}
+
+static int set_option(const struct config_option *option, const char *value)
+{
+	struct config_list *list;
+	char *end;
+	unsigned long parsed;
+
+	switch (option->type)
+	{
+	case CONFIG_TYPE_UINT:
+		parsed = strtoul(value, &end, 0);
+		if (*value == 0 || *end != 0)
+		{
+			printf("Invalid value for --%s: %s\n", option->name, value);
+			return -1;
+		}
+		if (parsed < option->min || parsed > option->max)
+		{
+			printf("--%s must be between %u and %u\n", option->name, option->min, option->max);
+			return -1;
+		}
+		*(unsigned int *) option->value = (unsigned int) parsed;
+		return 0;
+
+	case CONFIG_TYPE_ADDRESS:
+		// The broadcast address is never a valid target, so INADDR_NONE only means failure
+		parsed = inet_addr(value);
+		if (parsed == INADDR_NONE)
+		{
+			printf("Invalid IPv4 address for --%s: %s\n", option->name, value);
+			return -1;
+		}
+		*(unsigned int *) option->value = (unsigned int) parsed;
+		return 0;
+
+	case CONFIG_TYPE_STRING:
+		// The command line outlives the config, so it's not copied
+		if (*value == 0)
+		{
+			printf("Missing value for --%s\n", option->name);
+			return -1;
+		}
+		*(const char **) option->value = value;
+		return 0;
+
+	case CONFIG_TYPE_LIST:
+		list = (struct config_list *) option->value;
+		list->count = 0;
+		for (;;)
+		{
+			parsed = strtoul(value, &end, 10);
+			if (end == value || (*end != ',' && *end != 0) ||
+				parsed < option->min || parsed > option->max)
+			{
+				printf("Invalid list for --%s\n", option->name);
+				return -1;
+			}
+
+			if (list->count == CONFIG_LIST_MAX)
+			{
+				printf("Too many values for --%s (at most %d)\n", option->name, CONFIG_LIST_MAX);
+				return -1;
+			}
+
+			list->values[list->count++] = (unsigned short) parsed;
+			if (*end == 0)
+				break;
+
+			value = end + 1;
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+int config_parse_args(int argc, char* argv[])
+{
+	const char *arg, *value;
+	size_t name_length;
+	unsigned int j;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		arg = argv[i];
+
+		if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+
+		if (strncmp(arg, "--", 2) != 0)
+		{
+			printf("Unexpected argument: %s\n", arg);
+			return -1;
+		}
+		arg += 2;
+
+		// Accept both --name=value and --name value
+		value = strchr(arg, '=');
+		if (value != NULL)
+		{
+			name_length = value - arg;
+			value++;
+		}
+		else
+		{
+			name_length = strlen(arg);
+			value = (i + 1 < argc) ? argv[++i] : NULL;
+		}
+
+		for (j = 0; j < OPTION_COUNT; j++)
+		{
+			if (strlen(options[j].name) == name_length &&
+				strncmp(options[j].name, arg, name_length) == 0)
+				break;
+		}
+
+		if (j == OPTION_COUNT)
+		{
+			printf("Unknown option: --%.*s\n", (int) name_length, arg);
+			return -1;
+		}
+
+		if (value == NULL)
+		{
+			printf("Missing value for --%s\n", options[j].name);
+			return -1;
+		}
+
+		if (set_option(&options[j], value) != 0)
+			return -1;
+	}
+
+	// Checked here rather than when each interface sets up its ring, so a bad size
+	// stops us at startup instead of leaving every interface without a relay
+	if (proxy_config.tx_ring_slots != 0 && (proxy_config.tx_ring_slots < TXRING_MIN_SLOTS ||
+		(proxy_config.tx_ring_slots & (proxy_config.tx_ring_slots - 1)) != 0))
+	{
+		printf("--tx-ring-slots must be 0 or a power of two from %d to %d\n", TXRING_MIN_SLOTS, TXRING_MAX_SLOTS);
+		return -1;
+	}
+
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#pragma once
+
+// Long enough for every relayed port
+#define CONFIG_LIST_MAX UDPRELAY_MAX_PORTS
+
+struct config_list {
+	unsigned int count;
+	unsigned short values[CONFIG_LIST_MAX];
+};
+
+// Runtime settings, defaulting to the compile-time config in shieldrelay.h
+struct proxy_config {
+	// Capture with TPACKET_V3 rings instead of libpcap (Linux only)
+	unsigned int capture_ring;
+	unsigned int ring_block_size;
+	unsigned int ring_block_count;
+	unsigned int ring_retire_ms;
+
+	// libpcap captures, whose buffers grow up to the max while the kernel drops packets
+	unsigned int capture_snaplen;
+	unsigned int capture_buffer_size;
+	unsigned int capture_buffer_max;
+
+	// How captures and the MDNS socket are serviced (Linux only, ENGINE_* in engine.h)
+	unsigned int engine;
+	unsigned int engine_workers;
+	struct config_list engine_cpus;
+	unsigned int engine_fifo;
+
+	// Forwarded datagrams are sent in batches of up to this many
+	unsigned int batch_size;
+	unsigned int batch_deadline_us;
+
+	// Send runs of equal-sized datagrams with UDP segmentation offload when the kernel has it
+	unsigned int udp_gso;
+
+	// Captured datagrams are sent from their own thread through a ring this big (0 sends
+	// on the capture thread), optionally backed by huge pages
+	unsigned int tx_ring_slots;
+	unsigned int tx_hugepages;
+
+	// UDP ports to relay, each shifted by the offset
+	struct config_list udp_ports;
+	unsigned int port_offset;
+
+	// Ports sent ahead of the rest, before the offset, and whether each class is
+	// marked with DSCP and a socket priority
+	struct config_list priority_ports;
+	unsigned int dscp;
+
+	// The streaming PC when relaying from another host, or 0
+	unsigned int target;
+
+	// Own the UDP ports and forward them to the target instead of capturing (Linux only)
+	unsigned int socket_proxy;
+
+	// TCP relay to the target (Linux only)
+	struct config_list tcp_ports;
+	unsigned int tcp_nodelay;
+	unsigned int tcp_buffer_size;
+	unsigned int tcp_pipe_size;
+
+	// Fragment reassembly on each captured interface (0 slots turns it off)
+	unsigned int reassembly_slots;
+	unsigned int reassembly_timeout_ms;
+
+	// Seconds before a quiet Shield's flows expire
+	unsigned int flow_idle_timeout;
+
+	// Where the stats are served, each left off if 0 or NULL
+	unsigned int stats_port;
+	const char *stats_socket;
+
+	// Time socket proxy datagrams from the kernel's receive stamp (Linux only)
+	unsigned int latency_timestamps;
+
+	// Answer the other relay's GameStream discovery queries from cached announcements
+	unsigned int mdns_cache;
+
+	// Drop MDNS traffic that doesn't help discovery, and cap what's relayed each way (0 for no cap)
+	unsigned int mdns_filter;
+	unsigned int mdns_rate_limit;
+
+	// Seconds a remote relay may go without sending anything before it stops getting the LAN's responses
+	unsigned int mdns_client_timeout;
+};
+
+extern struct proxy_config proxy_config;
+
+int config_parse_args(int argc, char* argv[]);
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include "engine.h"
+
+#include <sched.h>
+
+static const struct engine_backend *backend;
+
+int engine_init(void)
+{
+	switch (proxy_config.engine)
+	{
+	case ENGINE_URING:
+		backend = &uring_backend;
+		break;
+	case ENGINE_REACTOR:
+		backend = &reactor_backend;
+		break;
+	default:
+		return -1;
+	}
+
+	return backend->init();
+}
+
+struct engine_source *engine_add_poll(int fd, engine_ready_function ready, engine_done_function done, void *context)
+{
+	return backend->add_poll(fd, ready, done, context);
+}
+
+struct engine_source *engine_add_recv(int fd, engine_datagram_function received, engine_done_function done, void *context)
+{
+	return backend->add_recv(fd, received, done, context);
+}
+
+void engine_remove(struct engine_source *source)
+{
+	backend->remove(source);
+}
+
+int engine_run(void)
+{
+	return backend->run();
+}
+
+void engine_tune_thread(unsigned int index)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	unsigned int cpu;
+	int err;
+
+	// Workers beyond the end of the CPU list wrap around
+	if (proxy_config.engine_cpus.count != 0)
+	{
+		cpu = proxy_config.engine_cpus.values[index % proxy_config.engine_cpus.count];
+
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err != 0)
+		{
+			printf("Failed to pin engine worker %u to CPU %u (%d)\n", index, cpu, err);
+		}
+	}
+
+	// Real-time scheduling needs CAP_SYS_NICE or an RLIMIT_RTPRIO allowance
+	if (proxy_config.engine_fifo != 0)
+	{
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = (int) proxy_config.engine_fifo;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err != 0)
+		{
+			printf("Failed to give engine worker %u SCHED_FIFO priority %u (%d)\n", index, proxy_config.engine_fifo, err);
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "shieldrelay.h"
+
+// Event engines that run every capture and the MDNS socket on a fixed set of
+// threads instead of a thread per interface (Linux only)
+#define ENGINE_THREADS 0
+#define ENGINE_URING 1
+#define ENGINE_REACTOR 2
+
+// Most events or datagrams handled per wakeup
+#define ENGINE_BATCH_SIZE 64
+
+// Called on an engine thread when a polled descriptor is readable
+typedef void (*engine_ready_function)(void *context);
+
+// Called on an engine thread for each datagram received on a socket. The data
+// stays valid until the source's done function has been called.
+typedef void (*engine_datagram_function)(void *context, struct sockaddr_in *addr, char *data, unsigned int length);
+
+// Called once a batch of events for a source has been handled
+typedef void (*engine_done_function)(void *context);
+
+struct engine_source;
+
+int engine_init(void);
+
+// Sources can be added and removed from any thread. A source's functions are
+// never called again once engine_remove() returns.
+struct engine_source *engine_add_poll(int fd, engine_ready_function ready, engine_done_function done, void *context);
+struct engine_source *engine_add_recv(int fd, engine_datagram_function received, engine_done_function done, void *context);
+void engine_remove(struct engine_source *source);
+
+// Runs the engine on the calling thread, only returning on failure
+int engine_run(void);
+
+// Applies the configured CPU pinning and scheduling class to a worker thread
+void engine_tune_thread(unsigned int index);
+
+// Implemented by each engine
+struct engine_backend {
+	int (*init)(void);
+	struct engine_source *(*add_poll)(int fd, engine_ready_function ready, engine_done_function done, void *context);
+	struct engine_source *(*add_recv)(int fd, engine_datagram_function received, engine_done_function done, void *context);
+	void (*remove)(struct engine_source *source);
+	int (*run)(void);
+};
+
+extern const struct engine_backend uring_backend;
+extern const struct engine_backend reactor_backend;
\ No newline at end of file
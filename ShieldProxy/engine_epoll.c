@@ -0,0 +1,276 @@
+#include "engine.h"
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// Largest datagram a receive source takes
+#define REACTOR_BUFFER_SIZE 2048
+
+#define SOURCE_POLL 1
+#define SOURCE_RECV 2
+
+struct reactor_worker;
+
+struct engine_source {
+	int type;
+	int fd;
+	engine_ready_function ready;
+	engine_datagram_function received;
+	engine_done_function done;
+	void *context;
+	struct reactor_worker *worker;
+};
+
+// Each worker has its own epoll set, so a source is only ever handled by one thread
+struct reactor_worker {
+	unsigned int index;
+	int epoll_fd;
+	int wake_fd;
+
+	// Bumped after every batch of events, so a removed source is known to be unused
+	volatile unsigned int generation;
+
+	// Receive buffers, only valid until the source's done function returns
+	char *buffers;
+	struct sockaddr_in addrs[ENGINE_BATCH_SIZE];
+	struct iovec iovs[ENGINE_BATCH_SIZE];
+	struct mmsghdr msgs[ENGINE_BATCH_SIZE];
+};
+
+static struct reactor_worker workers[ENGINE_MAX_WORKERS];
+static unsigned int worker_count;
+static unsigned int next_worker;
+static PLATFORM_MUTEX worker_mutex;
+
+static void receive_all(struct reactor_worker *worker, struct engine_source *source)
+{
+	int count, i;
+
+	do
+	{
+		for (i = 0; i < ENGINE_BATCH_SIZE; i++)
+		{
+			worker->iovs[i].iov_base = worker->buffers + (i * REACTOR_BUFFER_SIZE);
+			worker->iovs[i].iov_len = REACTOR_BUFFER_SIZE;
+			worker->msgs[i].msg_hdr.msg_name = &worker->addrs[i];
+			worker->msgs[i].msg_hdr.msg_namelen = sizeof(worker->addrs[i]);
+			worker->msgs[i].msg_hdr.msg_iov = &worker->iovs[i];
+			worker->msgs[i].msg_hdr.msg_iovlen = 1;
+			worker->msgs[i].msg_hdr.msg_control = NULL;
+			worker->msgs[i].msg_hdr.msg_controllen = 0;
+			worker->msgs[i].msg_hdr.msg_flags = 0;
+		}
+
+		count = recvmmsg(source->fd, worker->msgs, ENGINE_BATCH_SIZE, MSG_DONTWAIT, NULL);
+		if (count < 0)
+		{
+			if (errno != EAGAIN && !platform_error_is_transient(errno))
+				printf("Engine receive failed (%d)\n", errno);
+			return;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			// Anything that didn't fit in a buffer is no use to us
+			if (worker->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+				continue;
+
+			source->received(source->context, &worker->addrs[i],
+				(char *) worker->iovs[i].iov_base, worker->msgs[i].msg_len);
+		}
+
+		// The buffers are reused for the next batch
+		if (source->done != NULL)
+			source->done(source->context);
+	} while (count == ENGINE_BATCH_SIZE);
+}
+
+static int worker_loop(struct reactor_worker *worker)
+{
+	struct epoll_event events[ENGINE_BATCH_SIZE];
+	struct engine_source *source;
+	unsigned long long value;
+	int count, i;
+
+	engine_tune_thread(worker->index);
+
+	for (;;)
+	{
+		count = epoll_wait(worker->epoll_fd, events, ENGINE_BATCH_SIZE, -1);
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			printf("Engine wait failed (%d)\n", errno);
+			return -1;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			source = (struct engine_source *) events[i].data.ptr;
+			if (source == NULL)
+			{
+				// Just a wakeup to bump the generation
+				while (read(worker->wake_fd, &value, sizeof(value)) > 0);
+				continue;
+			}
+
+			if (source->type == SOURCE_POLL)
+			{
+				source->ready(source->context);
+				if (source->done != NULL)
+					source->done(source->context);
+			}
+			else
+			{
+				receive_all(worker, source);
+			}
+		}
+
+		PLATFORM_ATOMIC_STORE_UINT(&worker->generation, worker->generation + 1);
+	}
+}
+
+static void worker_thread(void *param)
+{
+	worker_loop((struct reactor_worker *) param);
+}
+
+static struct engine_source *add_source(int type, int fd, engine_ready_function ready,
+	engine_datagram_function received, engine_done_function done, void *context)
+{
+	struct engine_source *source;
+	struct epoll_event event;
+
+	source = (struct engine_source *) calloc(1, sizeof(*source));
+	if (source == NULL)
+	{
+		printf("Failed to allocate engine source\n");
+		return NULL;
+	}
+
+	source->type = type;
+	source->fd = fd;
+	source->ready = ready;
+	source->received = received;
+	source->done = done;
+	source->context = context;
+
+	// Spread sources across the workers
+	platform_mutex_acquire(&worker_mutex);
+	source->worker = &workers[next_worker];
+	next_worker = (next_worker + 1) % worker_count;
+	platform_mutex_release(&worker_mutex);
+
+	// Level triggered, so anything a handler leaves behind comes back next time
+	event.events = EPOLLIN;
+	event.data.ptr = source;
+	if (epoll_ctl(source->worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+	{
+		printf("Failed to add engine source (%d)\n", errno);
+		free(source);
+		return NULL;
+	}
+
+	return source;
+}
+
+static struct engine_source *reactor_add_poll(int fd, engine_ready_function ready, engine_done_function done, void *context)
+{
+	return add_source(SOURCE_POLL, fd, ready, NULL, done, context);
+}
+
+static struct engine_source *reactor_add_recv(int fd, engine_datagram_function received, engine_done_function done, void *context)
+{
+	return add_source(SOURCE_RECV, fd, NULL, received, done, context);
+}
+
+static void reactor_remove(struct engine_source *source)
+{
+	struct reactor_worker *worker = source->worker;
+	unsigned long long value = 1;
+	unsigned int generation;
+
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+	// Events fetched before the delete may still be in flight, so wait for the
+	// worker to finish its current batch. Waking it makes sure it gets there.
+	generation = PLATFORM_ATOMIC_LOAD_UINT(&worker->generation);
+	if (write(worker->wake_fd, &value, sizeof(value)) < 0)
+	{
+		printf("Failed to wake engine (%d)\n", errno);
+	}
+
+	while (PLATFORM_ATOMIC_LOAD_UINT(&worker->generation) == generation)
+		platform_sleep_ms(1);
+
+	free(source);
+}
+
+static int reactor_init(void)
+{
+	struct reactor_worker *worker;
+	struct epoll_event event;
+	unsigned int i;
+
+	worker_count = proxy_config.engine_workers;
+
+	for (i = 0; i < worker_count; i++)
+	{
+		worker = &workers[i];
+		worker->index = i;
+
+		worker->buffers = (char *) malloc(ENGINE_BATCH_SIZE * REACTOR_BUFFER_SIZE);
+		if (worker->buffers == NULL)
+		{
+			printf("Failed to allocate engine buffers\n");
+			return -1;
+		}
+
+		worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (worker->epoll_fd == -1 || worker->wake_fd == -1)
+		{
+			printf("Failed to create engine worker (%d)\n", errno);
+			return -1;
+		}
+
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event) == -1)
+		{
+			printf("Failed to create engine worker (%d)\n", errno);
+			return -1;
+		}
+	}
+
+	platform_mutex_init(&worker_mutex);
+	return 0;
+}
+
+// The calling thread becomes the first worker
+static int reactor_run(void)
+{
+	unsigned int i;
+
+	for (i = 1; i < worker_count; i++)
+	{
+		if (platform_start_thread(worker_thread, &workers[i], NULL) != 0)
+		{
+			printf("Failed to start engine worker\n");
+			return -1;
+		}
+	}
+
+	return worker_loop(&workers[0]);
+}
+
+const struct engine_backend reactor_backend = {
+	reactor_init,
+	reactor_add_poll,
+	reactor_add_recv,
+	reactor_remove,
+	reactor_run,
+};
\ No newline at end of file
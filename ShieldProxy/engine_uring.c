@@ -0,0 +1,617 @@
+#include "engine.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+// Submission queue size, completions get twice as many
+#define URING_ENTRIES 256
+
+// Provided receive buffers, big enough for the recvmsg header, address and an MTU sized datagram
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_SIZE 2048
+#define URING_BUFFER_GROUP 0
+
+#define SOURCE_POLL 1
+#define SOURCE_RECV 2
+
+#define SOURCE_LIVE 0
+#define SOURCE_REMOVING 1
+#define SOURCE_DEAD 2
+
+#define COMMAND_ADD 1
+#define COMMAND_REMOVE 2
+
+struct engine_source {
+	int type;
+	int fd;
+	engine_ready_function ready;
+	engine_datagram_function received;
+	engine_done_function done;
+	void *context;
+
+	// Only touched by the engine thread
+	int armed;
+	int failed;
+	int active;
+	struct engine_source *next_active;
+	struct engine_source *next_dead;
+	struct msghdr msg;
+
+	// Pending add or remove, protected by the command mutex
+	int command;
+	struct engine_source *next_command;
+
+	volatile unsigned int state;
+};
+
+static int ring_fd = -1;
+
+// Submission queue
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int sq_entries, sq_local_tail, sq_pending;
+static struct io_uring_sqe *sqes;
+
+// Completion queue
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+// Receive buffers the kernel picks from for multishot receives
+static struct io_uring_buf_ring *buf_ring;
+static char *buffers;
+static unsigned short buf_tail;
+
+// Wakes the engine when sources are added or removed
+static int event_fd = -1;
+static struct engine_source event_source;
+static PLATFORM_MUTEX command_mutex;
+static struct engine_source *command_head, *command_tail;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Hands queued submissions to the kernel, optionally waiting for a completion
+static int submit(unsigned int wait)
+{
+	int ret;
+
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+	for (;;)
+	{
+		ret = uring_enter(sq_pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+		if (ret >= 0)
+		{
+			sq_pending -= (unsigned int) ret < sq_pending ? (unsigned int) ret : sq_pending;
+			return 0;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		// The completion queue is backed up, it'll be reaped before we come back
+		if (errno == EAGAIN || errno == EBUSY)
+			return 0;
+
+		printf("io_uring_enter failed (%d)\n", errno);
+		return -1;
+	}
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	// Push what we have if the queue is full
+	if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+	{
+		if (submit(0) != 0 || sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+			return NULL;
+	}
+
+	sqe = &sqes[sq_local_tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_local_tail++;
+	sq_pending++;
+
+	return sqe;
+}
+
+// Starts the multishot request that feeds a source
+static int arm(struct engine_source *source)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	if (sqe == NULL)
+	{
+		printf("io_uring submission queue is full\n");
+		return -1;
+	}
+
+	sqe->fd = source->fd;
+	sqe->user_data = (unsigned long long)(uintptr_t) source;
+
+	if (source->type == SOURCE_POLL)
+	{
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+	}
+	else
+	{
+		// Each datagram lands in a provided buffer behind its header and source address
+		memset(&source->msg, 0, sizeof(source->msg));
+		source->msg.msg_namelen = sizeof(struct sockaddr_in);
+
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->addr = (unsigned long long)(uintptr_t) &source->msg;
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+	}
+
+	source->armed = 1;
+	return 0;
+}
+
+static void cancel(struct engine_source *source)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	if (sqe == NULL)
+	{
+		printf("io_uring submission queue is full\n");
+		return;
+	}
+
+	// The cancellation's own completion carries no source
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (unsigned long long)(uintptr_t) source;
+	sqe->user_data = 0;
+}
+
+// Buffers are only handed back to the kernel once the batch they were in is done
+static void recycle_buffer(unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &buf_ring->bufs[buf_tail & (URING_BUFFER_COUNT - 1)];
+	buf->addr = (unsigned long long)(uintptr_t)(buffers + (bid * URING_BUFFER_SIZE));
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	buf_tail++;
+}
+
+static void handle_datagram(struct engine_source *source, unsigned short bid, int length)
+{
+	struct io_uring_recvmsg_out *out;
+	char *payload;
+
+	out = (struct io_uring_recvmsg_out *)(buffers + (bid * URING_BUFFER_SIZE));
+	payload = (char *)(out + 1) + source->msg.msg_namelen + source->msg.msg_controllen;
+	if (payload > (char *) out + length || out->namelen < sizeof(struct sockaddr_in))
+		return;
+
+	// Anything that didn't fit in a buffer is no use to us
+	if (out->flags & MSG_TRUNC)
+		return;
+
+	source->received(source->context, (struct sockaddr_in *)(out + 1), payload, out->payloadlen);
+}
+
+static void process_commands(void)
+{
+	struct engine_source *source;
+
+	platform_mutex_acquire(&command_mutex);
+
+	while (command_head != NULL)
+	{
+		source = command_head;
+		command_head = source->next_command;
+
+		if (source->command == COMMAND_ADD)
+		{
+			arm(source);
+		}
+		else if (source->armed)
+		{
+			// It's dead once the request's final completion arrives
+			PLATFORM_ATOMIC_STORE_UINT(&source->state, SOURCE_REMOVING);
+			cancel(source);
+		}
+		else
+		{
+			PLATFORM_ATOMIC_STORE_UINT(&source->state, SOURCE_DEAD);
+		}
+
+		source->command = 0;
+	}
+	command_tail = NULL;
+
+	platform_mutex_release(&command_mutex);
+}
+
+static void queue_command(struct engine_source *source, int command)
+{
+	unsigned long long value = 1;
+
+	platform_mutex_acquire(&command_mutex);
+
+	if (source->command != 0)
+	{
+		// Still queued, so it was never armed
+		source->command = command;
+	}
+	else
+	{
+		source->command = command;
+		source->next_command = NULL;
+		if (command_tail != NULL)
+			command_tail->next_command = source;
+		else
+			command_head = source;
+		command_tail = source;
+	}
+
+	platform_mutex_release(&command_mutex);
+
+	if (write(event_fd, &value, sizeof(value)) < 0)
+	{
+		printf("Failed to wake engine (%d)\n", errno);
+	}
+}
+
+static struct engine_source *add_source(int type, int fd, engine_ready_function ready,
+	engine_datagram_function received, engine_done_function done, void *context)
+{
+	struct engine_source *source;
+
+	source = (struct engine_source *) calloc(1, sizeof(*source));
+	if (source == NULL)
+	{
+		printf("Failed to allocate engine source\n");
+		return NULL;
+	}
+
+	source->type = type;
+	source->fd = fd;
+	source->ready = ready;
+	source->received = received;
+	source->done = done;
+	source->context = context;
+	source->state = SOURCE_LIVE;
+
+	queue_command(source, COMMAND_ADD);
+	return source;
+}
+
+static struct engine_source *uring_add_poll(int fd, engine_ready_function ready, engine_done_function done, void *context)
+{
+	return add_source(SOURCE_POLL, fd, ready, NULL, done, context);
+}
+
+static struct engine_source *uring_add_recv(int fd, engine_datagram_function received, engine_done_function done, void *context)
+{
+	return add_source(SOURCE_RECV, fd, NULL, received, done, context);
+}
+
+static void uring_remove(struct engine_source *source)
+{
+	queue_command(source, COMMAND_REMOVE);
+
+	// Wait for the engine to be done with it
+	while (PLATFORM_ATOMIC_LOAD_UINT(&source->state) != SOURCE_DEAD)
+		platform_sleep_ms(1);
+
+	free(source);
+}
+
+// Multishot receives came after provided buffer rings, so a kernel can have one without the
+// other. It fails every such receive straight away, which is found out here by starting one
+// on a spare socket and cancelling it. Returns -1 if it isn't supported.
+static int probe_multishot_recv(void)
+{
+	struct engine_source probe;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail, seen;
+	int result;
+
+	memset(&probe, 0, sizeof(probe));
+	probe.type = SOURCE_RECV;
+	probe.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (probe.fd == -1)
+	{
+		printf("Failed to create io_uring probe socket (%d)\n", errno);
+		return -1;
+	}
+
+	// Nothing arrives on the socket, so the receive is still waiting unless it was refused
+	result = -1;
+	if (arm(&probe) == 0)
+	{
+		cancel(&probe);
+
+		seen = 0;
+		while (seen < 2 && submit(1) == 0)
+		{
+			head = *cq_head;
+			tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++)
+			{
+				cqe = &cqes[head & *cq_mask];
+				if (cqe->user_data == (unsigned long long)(uintptr_t) &probe)
+					result = cqe->res;
+				seen++;
+			}
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	close(probe.fd);
+
+	if (result != -ECANCELED)
+	{
+		printf("io_uring multishot receives are unavailable (%d)\n", result < 0 ? -result : result);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int uring_init(void)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	unsigned char *sq_ring, *cq_ring;
+	unsigned int sq_size, cq_size, i;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+	ring_fd = uring_setup(URING_ENTRIES, &params);
+	if (ring_fd < 0 && errno == EINVAL)
+	{
+		// Older kernels don't know the flags
+		memset(&params, 0, sizeof(params));
+		ring_fd = uring_setup(URING_ENTRIES, &params);
+	}
+	if (ring_fd < 0)
+	{
+		printf("io_uring is unavailable (%d)\n", errno);
+		return -1;
+	}
+
+	sq_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+	cq_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+	}
+
+	sq_ring = (unsigned char *) mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+	{
+		printf("Failed to map io_uring (%d)\n", errno);
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		cq_ring = sq_ring;
+	}
+	else
+	{
+		cq_ring = (unsigned char *) mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+		{
+			printf("Failed to map io_uring (%d)\n", errno);
+			return -1;
+		}
+	}
+
+	sqes = (struct io_uring_sqe *) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		printf("Failed to map io_uring (%d)\n", errno);
+		return -1;
+	}
+
+	sq_head = (unsigned int *)(sq_ring + params.sq_off.head);
+	sq_tail = (unsigned int *)(sq_ring + params.sq_off.tail);
+	sq_mask = (unsigned int *)(sq_ring + params.sq_off.ring_mask);
+	sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+	sq_entries = params.sq_entries;
+	sq_local_tail = *sq_tail;
+
+	cq_head = (unsigned int *)(cq_ring + params.cq_off.head);
+	cq_tail = (unsigned int *)(cq_ring + params.cq_off.tail);
+	cq_mask = (unsigned int *)(cq_ring + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+	// Every slot always points at the matching entry
+	for (i = 0; i < sq_entries; i++)
+		sq_array[i] = i;
+
+	// Register the receive buffer ring
+	buffers = (char *) malloc(URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	buf_ring = (struct io_uring_buf_ring *) mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers == NULL || buf_ring == MAP_FAILED)
+	{
+		printf("Failed to allocate io_uring buffers\n");
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long long)(uintptr_t) buf_ring;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		printf("Failed to register io_uring buffers (%d)\n", errno);
+		return -1;
+	}
+
+	buf_tail = 0;
+	for (i = 0; i < URING_BUFFER_COUNT; i++)
+		recycle_buffer((unsigned short) i);
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd == -1)
+	{
+		printf("Failed to create engine event (%d)\n", errno);
+		return -1;
+	}
+
+	event_source.type = SOURCE_POLL;
+	event_source.fd = event_fd;
+
+	if (probe_multishot_recv() != 0)
+		return -1;
+
+	platform_mutex_init(&command_mutex);
+	return 0;
+}
+
+static int uring_run(void)
+{
+	struct engine_source *source, *active, *dead;
+	struct io_uring_cqe *cqe;
+	unsigned long long value;
+	unsigned int head, tail;
+	int commands;
+
+	engine_tune_thread(0);
+
+	if (arm(&event_source) != 0)
+		return -1;
+
+	for (;;)
+	{
+		// One syscall submits everything queued last time around and waits for more
+		if (submit(1) != 0)
+			return -1;
+
+		active = NULL;
+		dead = NULL;
+		commands = 0;
+
+		head = *cq_head;
+		tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			cqe = &cqes[head & *cq_mask];
+
+			source = (struct engine_source *)(uintptr_t) cqe->user_data;
+			if (source == NULL)
+				continue;
+
+			if (source == &event_source)
+			{
+				while (read(event_fd, &value, sizeof(value)) > 0);
+				commands = 1;
+			}
+			else if (source->type == SOURCE_POLL)
+			{
+				if (cqe->res > 0)
+				{
+					source->ready(source->context);
+				}
+				else if (cqe->res < 0 && cqe->res != -ECANCELED)
+				{
+					printf("Engine poll failed (%d)\n", -cqe->res);
+				}
+			}
+			else
+			{
+				if (cqe->flags & IORING_CQE_F_BUFFER)
+				{
+					if (cqe->res > 0)
+						handle_datagram(source, (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT), cqe->res);
+					recycle_buffer((unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+				}
+				else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED &&
+					!platform_error_is_transient(-cqe->res))
+				{
+					// Starting it again would only fail the same way, as fast as we can submit
+					printf("Engine receive failed (%d), no longer receiving on the socket\n", -cqe->res);
+					source->failed = 1;
+				}
+			}
+
+			if (source != &event_source && !source->active)
+			{
+				source->active = 1;
+				source->next_active = active;
+				active = source;
+			}
+
+			// A multishot request ended, either because we cancelled it or it ran out of buffers
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+			{
+				source->armed = 0;
+				if (source->state == SOURCE_REMOVING)
+				{
+					source->next_dead = dead;
+					dead = source;
+				}
+				else if (!source->failed)
+				{
+					arm(source);
+				}
+			}
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		// Let each source finish its batch before its buffers are reused
+		for (source = active; source != NULL; source = source->next_active)
+		{
+			if (source->done != NULL)
+				source->done(source->context);
+			source->active = 0;
+		}
+		__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+
+		// Removed sources can be freed now
+		while (dead != NULL)
+		{
+			source = dead;
+			dead = source->next_dead;
+			PLATFORM_ATOMIC_STORE_UINT(&source->state, SOURCE_DEAD);
+		}
+
+		if (commands)
+			process_commands();
+	}
+}
+
+const struct engine_backend uring_backend = {
+	uring_init,
+	uring_add_poll,
+	uring_add_recv,
+	uring_remove,
+	uring_run,
+};
\ No newline at end of file
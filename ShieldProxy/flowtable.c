@@ -0,0 +1,164 @@
+#include "shieldrelay.h"
+
+static unsigned int flow_slot(unsigned int client_addr)
+{
+	return (client_addr * 2654435761U) >> (32 - FLOW_TABLE_BITS);
+}
+
+static void print_flow(const char *message, unsigned int client_addr, unsigned short src_port, unsigned short dst_port)
+{
+	struct in_addr addr;
+
+	addr.s_addr = client_addr;
+	printf("Shield %s %s: UDP %d -> %d\n", inet_ntoa(addr), message, ntohs(src_port), ntohs(dst_port));
+}
+
+void flowtable_init(struct udprelay_flow_table *table)
+{
+	memset(table, 0, sizeof(*table));
+}
+
+// Safe to call from any thread. The flow's key is checked again after reading the port,
+// so a slot that was expired and reused under us is never mistaken for our Shield.
+struct udprelay_flow *flowtable_lookup(struct udprelay_flow_table *table, unsigned int client_addr,
+	unsigned short *src_port)
+{
+	struct udprelay_flow *flow;
+	unsigned int slot, key, i;
+
+	slot = flow_slot(client_addr);
+	for (i = 0; i < FLOW_TABLE_SIZE; i++)
+	{
+		flow = &table->flows[slot];
+
+		key = PLATFORM_ATOMIC_LOAD_UINT(&flow->client_addr);
+		if (key == FLOW_KEY_EMPTY)
+		{
+			break;
+		}
+
+		if (key == client_addr)
+		{
+			*src_port = flow->src_port;
+			if (PLATFORM_ATOMIC_LOAD_UINT(&flow->client_addr) != client_addr)
+			{
+				break;
+			}
+
+			return flow;
+		}
+
+		slot = (slot + 1) % FLOW_TABLE_SIZE;
+	}
+
+	return NULL;
+}
+
+// Records that a Shield sent to us, adding its flow if it's new. Capture thread only.
+struct udprelay_flow *flowtable_update(struct udprelay_flow_table *table, unsigned int client_addr,
+	unsigned short src_port, unsigned short dst_port, unsigned long long now)
+{
+	struct udprelay_flow *flow, *removed;
+	unsigned int slot, key, i;
+
+	removed = NULL;
+	slot = flow_slot(client_addr);
+	for (i = 0; i < FLOW_TABLE_SIZE; i++)
+	{
+		flow = &table->flows[slot];
+
+		key = flow->client_addr;
+		if (key == client_addr)
+		{
+			// The Shield may move to a new port when its NAT mapping changes
+			if (flow->src_port != src_port)
+			{
+				print_flow("is communicating with us", client_addr, src_port, dst_port);
+				flow->src_port = src_port;
+				table->port_changes++;
+			}
+
+			flow->last_seen = now;
+			return flow;
+		}
+		else if (key == FLOW_KEY_REMOVED)
+		{
+			if (removed == NULL)
+				removed = flow;
+		}
+		else if (key == FLOW_KEY_EMPTY)
+		{
+			break;
+		}
+
+		slot = (slot + 1) % FLOW_TABLE_SIZE;
+	}
+
+	// Prefer reusing an expired slot so the probe chains stay short
+	if (removed != NULL)
+	{
+		flow = removed;
+	}
+	else if (i < FLOW_TABLE_SIZE && table->used < FLOW_TABLE_MAX_USED)
+	{
+		table->used++;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	flow->src_port = src_port;
+	flow->last_seen = now;
+	flow->rx_packets = 0;
+	flow->rx_bytes = 0;
+	flow->tx_packets = 0;
+	flow->tx_bytes = 0;
+
+	// Readers can find the flow from here on
+	PLATFORM_ATOMIC_STORE_UINT(&flow->client_addr, client_addr);
+
+	print_flow("is communicating with us", client_addr, src_port, dst_port);
+	return flow;
+}
+
+// Drops flows from Shields that have gone quiet. Capture thread only.
+void flowtable_expire(struct udprelay_flow_table *table, unsigned short dst_port,
+	unsigned long long now, unsigned long long idle_timeout)
+{
+	struct udprelay_flow *flow;
+	unsigned int slot, i;
+
+	for (i = 0; i < FLOW_TABLE_SIZE; i++)
+	{
+		flow = &table->flows[i];
+		if (flow->client_addr == FLOW_KEY_EMPTY || flow->client_addr == FLOW_KEY_REMOVED)
+			continue;
+
+		if (now - flow->last_seen < idle_timeout)
+			continue;
+
+		print_flow("stopped communicating with us", flow->client_addr, flow->src_port, dst_port);
+		printf("Relayed %llu packets (%llu bytes) to the Shield and %llu packets (%llu bytes) from it\n",
+			flow->tx_packets, flow->tx_bytes, flow->rx_packets, flow->rx_bytes);
+
+		// Left in place as a marker so probes for other flows continue past it
+		PLATFORM_ATOMIC_STORE_UINT(&flow->client_addr, FLOW_KEY_REMOVED);
+	}
+
+	// A marker right before an empty slot has nothing past it to lead probes to, so it can
+	// go back to being empty. Otherwise markers would use up the table until adds fail.
+	for (i = 0; i < FLOW_TABLE_SIZE; i++)
+	{
+		if (table->flows[i].client_addr != FLOW_KEY_EMPTY)
+			continue;
+
+		slot = (i + FLOW_TABLE_SIZE - 1) % FLOW_TABLE_SIZE;
+		while (table->flows[slot].client_addr == FLOW_KEY_REMOVED)
+		{
+			PLATFORM_ATOMIC_STORE_UINT(&table->flows[slot].client_addr, FLOW_KEY_EMPTY);
+			table->used--;
+			slot = (slot + FLOW_TABLE_SIZE - 1) % FLOW_TABLE_SIZE;
+		}
+	}
+}
\ No newline at end of file
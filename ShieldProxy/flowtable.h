@@ -0,0 +1,50 @@
+#pragma once
+
+// Slots in each port's flow table
+#define FLOW_TABLE_BITS 6
+#define FLOW_TABLE_SIZE (1 << FLOW_TABLE_BITS)
+
+// Most slots that may be claimed so probes always reach an empty one
+#define FLOW_TABLE_MAX_USED (FLOW_TABLE_SIZE * 3 / 4)
+
+// Keys that never belong to a Shield
+#define FLOW_KEY_EMPTY 0
+#define FLOW_KEY_REMOVED 0xFFFFFFFF
+
+// One Shield talking to us on one of the relayed ports
+struct udprelay_flow {
+	// The Shield's address, or one of the keys above
+	volatile unsigned int client_addr;
+
+	// Where the Shield last contacted us from, in network byte order
+	volatile unsigned short src_port;
+
+	// Updated by the capture path whenever the Shield sends to us
+	unsigned long long last_seen;
+	unsigned long long rx_packets;
+	unsigned long long rx_bytes;
+
+	// Updated by the forwarding path
+	unsigned long long tx_packets;
+	unsigned long long tx_bytes;
+};
+
+// Open addressed flows for a single port. Only the capture thread adds, updates or
+// expires flows, so lookups from any thread can go without a lock.
+struct udprelay_flow_table {
+	unsigned int used;
+	unsigned long long next_expiry;
+
+	// Times a known Shield moved to a new source port
+	unsigned long long port_changes;
+
+	struct udprelay_flow flows[FLOW_TABLE_SIZE];
+};
+
+void flowtable_init(struct udprelay_flow_table *table);
+struct udprelay_flow *flowtable_lookup(struct udprelay_flow_table *table, unsigned int client_addr,
+	unsigned short *src_port);
+struct udprelay_flow *flowtable_update(struct udprelay_flow_table *table, unsigned int client_addr,
+	unsigned short src_port, unsigned short dst_port, unsigned long long now);
+void flowtable_expire(struct udprelay_flow_table *table, unsigned short dst_port,
+	unsigned long long now, unsigned long long idle_timeout);
\ No newline at end of file
@@ -0,0 +1,107 @@
+#include "shieldrelay.h"
+
+struct latency_quantile {
+	double fraction;
+	const char *label;
+};
+
+static const struct latency_quantile quantiles[] = {
+	{ 0.5, "0.5" },
+	{ 0.9, "0.9" },
+	{ 0.99, "0.99" },
+	{ 0.999, "0.999" },
+	{ 1.0, "1" },
+};
+
+#define QUANTILE_COUNT (sizeof(quantiles) / sizeof(quantiles[0]))
+
+static unsigned int bucket_index(unsigned long long value)
+{
+	unsigned int top;
+
+	if (value < LATENCY_SUB_BUCKETS)
+		return (unsigned int) value;
+
+	if (value >= (1ULL << LATENCY_MAX_BITS))
+		return LATENCY_BUCKETS - 1;
+
+	// Find the top bit, then keep the sub-bucket bits below it
+	top = LATENCY_SUB_BUCKET_BITS;
+	while ((value >> (top + 1)) != 0)
+		top++;
+
+	return (top - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+		(unsigned int) (value >> (top - LATENCY_SUB_BUCKET_BITS)) - LATENCY_SUB_BUCKETS;
+}
+
+// The largest value that lands in a bucket
+static unsigned long long bucket_value(unsigned int index)
+{
+	unsigned int shift;
+	unsigned long long sub_bucket;
+
+	if (index < LATENCY_SUB_BUCKETS)
+		return index;
+
+	shift = index / LATENCY_SUB_BUCKETS - 1;
+	sub_bucket = LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS;
+	return ((sub_bucket + 1) << shift) - 1;
+}
+
+void latency_init(struct latency_histogram *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+}
+
+void latency_record(struct latency_histogram *histogram, unsigned long long value)
+{
+	histogram->buckets[bucket_index(value)]++;
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+unsigned long long latency_percentile(struct latency_histogram *histogram, double fraction)
+{
+	unsigned long long count, target, seen, value;
+	unsigned int i;
+
+	count = histogram->count;
+	if (count == 0)
+		return 0;
+
+	target = (unsigned long long) (fraction * count + 0.5);
+	if (target == 0)
+		target = 1;
+
+	seen = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += histogram->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	// A bucket's top can be past anything actually recorded
+	value = i < LATENCY_BUCKETS ? bucket_value(i) : histogram->max;
+	return value < histogram->max ? value : histogram->max;
+}
+
+void latency_write_samples(struct stats_buffer *buffer, const char *name, const char *iface,
+	unsigned int port, struct latency_histogram *histogram)
+{
+	char sum_name[128], count_name[128];
+	unsigned int i;
+
+	for (i = 0; i < QUANTILE_COUNT; i++)
+	{
+		stats_write_quantile(buffer, name, iface, port, quantiles[i].label,
+			latency_percentile(histogram, quantiles[i].fraction));
+	}
+
+	snprintf(sum_name, sizeof(sum_name), "%s_sum", name);
+	snprintf(count_name, sizeof(count_name), "%s_count", name);
+	stats_write_sample(buffer, sum_name, iface, port, histogram->sum);
+	stats_write_sample(buffer, count_name, iface, port, histogram->count);
+}
\ No newline at end of file
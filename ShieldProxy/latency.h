@@ -0,0 +1,30 @@
+#pragma once
+
+// Log-linear buckets in the style of HdrHistogram. Each power of two is split into
+// LATENCY_SUB_BUCKETS linear steps, so every recorded value is kept to within about
+// 3% no matter how large it is.
+#define LATENCY_SUB_BUCKET_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+// Values from 2^LATENCY_MAX_BITS microseconds (about 16 seconds) up all land in the last bucket
+#define LATENCY_MAX_BITS 24
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+// Only written by one thread, like the other counters. Readers may see a sample
+// in the buckets before it's in the count, which percentiles tolerate.
+struct latency_histogram {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long buckets[LATENCY_BUCKETS];
+};
+
+void latency_init(struct latency_histogram *histogram);
+void latency_record(struct latency_histogram *histogram, unsigned long long value);
+
+// Returns the smallest value that at least the given fraction of samples are at or below
+unsigned long long latency_percentile(struct latency_histogram *histogram, double fraction);
+
+// Writes the quantiles, sum and count of a histogram as a Prometheus summary
+void latency_write_samples(struct stats_buffer *buffer, const char *name, const char *iface,
+	unsigned int port, struct latency_histogram *histogram);
\ No newline at end of file
@@ -0,0 +1,790 @@
+#include "shieldrelay.h"
+
+#include <signal.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/net_tstamp.h>
+#include <netinet/udp.h>
+
+// Older headers don't know about UDP segmentation offload yet
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// Large enough for a full page of dump responses from the kernel
+#define NETLINK_BUFFER_SIZE 32768
+
+// Most messages we'll hand to the kernel in one sendmmsg() or recvmmsg() call
+#define SEND_BATCH_MAX 64
+
+// Room for the SCM_TIMESTAMPING software, legacy and hardware stamps
+#define TIMESTAMP_CONTROL_SIZE CMSG_SPACE(3 * sizeof(struct timespec))
+
+struct thread_stub_tuple {
+	thread_start_function thread_start;
+	void* thread_parameter;
+};
+
+struct link_state {
+	int index;
+	unsigned int flags;
+};
+
+struct link_table {
+	struct link_state *links;
+	unsigned int count;
+	unsigned int allocated;
+};
+
+struct addr_dump_context {
+	struct link_table *link_table;
+	unsigned int *ip_table;
+	unsigned int ip_table_len;
+	unsigned int count;
+};
+
+typedef int (*netlink_message_function)(struct nlmsghdr *msg, void *context);
+
+int notification_socket;
+reconfigure_callback_function notification_callback;
+
+int platform_init(void)
+{
+	notification_socket = -1;
+
+	// Failed sends on a closed connection must not kill the process
+	signal(SIGPIPE, SIG_IGN);
+
+	return 0;
+}
+
+void platform_mutex_init(PLATFORM_MUTEX *mutex)
+{
+	pthread_mutex_init(mutex, NULL);
+}
+
+void platform_mutex_acquire(PLATFORM_MUTEX *mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+void platform_mutex_release(PLATFORM_MUTEX *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+void platform_event_init(PLATFORM_EVENT *event)
+{
+	sem_init(event, 0, 0);
+}
+
+void platform_event_destroy(PLATFORM_EVENT *event)
+{
+	sem_destroy(event);
+}
+
+void platform_event_set(PLATFORM_EVENT *event)
+{
+	sem_post(event);
+}
+
+void platform_event_wait(PLATFORM_EVENT *event)
+{
+	while (sem_wait(event) != 0 && errno == EINTR);
+}
+
+void *platform_alloc_pool(size_t size, int huge_pages)
+{
+	void *pool;
+
+	if (huge_pages)
+	{
+		pool = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (pool != MAP_FAILED)
+			return pool;
+
+		// Usually nothing's reserved in /proc/sys/vm/nr_hugepages
+		printf("Huge pages aren't available (%d), using normal pages\n", errno);
+	}
+
+	pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	return pool != MAP_FAILED ? pool : NULL;
+}
+
+void platform_free_pool(void *pool, size_t size)
+{
+	munmap(pool, size);
+}
+
+void platform_cleanup(void)
+{
+	// Closing the socket ends the notification thread
+	if (notification_socket != -1)
+	{
+		close(notification_socket);
+		notification_socket = -1;
+	}
+}
+
+int platform_last_error(void)
+{
+	return errno;
+}
+
+void platform_sleep_ms(unsigned int ms)
+{
+	usleep(ms * 1000);
+}
+
+// Errors that only affect a single datagram, after which the socket is still usable
+int platform_error_is_transient(int error)
+{
+	switch (error)
+	{
+	case EINTR:
+	case EAGAIN:
+	case ENOBUFS:
+	case ENOMEM:
+	case EPERM:
+	case EMSGSIZE:
+	case ECONNREFUSED:
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+	case EHOSTDOWN:
+	case ENETDOWN:
+	case EADDRNOTAVAIL:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+unsigned long long platform_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned long long platform_wall_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int platform_enable_timestamps(SOCKET s)
+{
+	int flags;
+
+	flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	return setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+// Pulls the software receive stamp out of a message, or 0 if it has none
+static unsigned long long message_timestamp(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct timespec *ts;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+		{
+			ts = (struct timespec *) CMSG_DATA(cmsg);
+			return (unsigned long long) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+		}
+	}
+
+	return 0;
+}
+
+int platform_send_batch(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	struct mmsghdr msgs[SEND_BATCH_MAX];
+	struct iovec iovs[SEND_BATCH_MAX];
+	unsigned int i, chunk, total;
+	int sent;
+
+	total = 0;
+	while (total < count)
+	{
+		chunk = count - total;
+		if (chunk > SEND_BATCH_MAX)
+			chunk = SEND_BATCH_MAX;
+
+		memset(msgs, 0, chunk * sizeof(msgs[0]));
+		for (i = 0; i < chunk; i++)
+		{
+			iovs[i].iov_base = datagrams[total + i].data;
+			iovs[i].iov_len = datagrams[total + i].length;
+			msgs[i].msg_hdr.msg_name = datagrams[total + i].addr;
+			msgs[i].msg_hdr.msg_namelen = datagrams[total + i].addr != NULL ? sizeof(struct sockaddr_in) : 0;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		sent = sendmmsg(s, msgs, chunk, 0);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return total > 0 ? (int) total : -1;
+		}
+
+		total += sent;
+		if ((unsigned int) sent < chunk)
+			break;
+	}
+
+	return (int) total;
+}
+
+int platform_set_traffic_class(SOCKET s, int dscp, int priority)
+{
+	int tos;
+
+	// Setting the TOS also picks a priority from its legacy bits, so the priority goes second
+	tos = dscp << 2;
+	if (setsockopt(s, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) != 0)
+		return -1;
+
+	return setsockopt(s, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority));
+}
+
+int platform_enable_segmentation(SOCKET s)
+{
+	int segment_size;
+
+	// A size of 0 leaves plain sends alone, this only checks the kernel has it (4.18 and up)
+	segment_size = 0;
+	return setsockopt(s, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size));
+}
+
+int platform_send_segmented(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	struct iovec iovs[SEND_BATCH_MAX];
+	union {
+		char buffer[CMSG_SPACE(sizeof(unsigned short))];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	unsigned int i;
+	int sent;
+
+	if (count > SEND_BATCH_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	// The datagrams are gathered straight from the caller's buffers
+	for (i = 0; i < count; i++)
+	{
+		iovs[i].iov_base = datagrams[i].data;
+		iovs[i].iov_len = datagrams[i].length;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = datagrams[0].addr;
+	msg.msg_namelen = datagrams[0].addr != NULL ? sizeof(struct sockaddr_in) : 0;
+	msg.msg_iov = iovs;
+	msg.msg_iovlen = count;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+	*(unsigned short *) CMSG_DATA(cmsg) = (unsigned short) datagrams[0].length;
+
+	do
+	{
+		sent = sendmsg(s, &msg, 0);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent >= 0)
+		return (int) count;
+
+	// Segments too big for the MTU, or a device that can't checksum them
+	if (errno == EMSGSIZE || errno == EINVAL || errno == EIO)
+		return 0;
+
+	return -1;
+}
+
+int platform_recv_batch(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	struct mmsghdr msgs[SEND_BATCH_MAX];
+	struct iovec iovs[SEND_BATCH_MAX];
+	char controls[SEND_BATCH_MAX][TIMESTAMP_CONTROL_SIZE];
+	unsigned int i;
+	int received;
+
+	if (count > SEND_BATCH_MAX)
+		count = SEND_BATCH_MAX;
+
+	memset(msgs, 0, count * sizeof(msgs[0]));
+	for (i = 0; i < count; i++)
+	{
+		iovs[i].iov_base = datagrams[i].data;
+		iovs[i].iov_len = datagrams[i].length;
+		msgs[i].msg_hdr.msg_name = datagrams[i].addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = controls[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+	}
+
+	// Wait for the first datagram, then take whatever else is already queued
+	received = recvmmsg(s, msgs, count, MSG_WAITFORONE, NULL);
+	if (received < 0)
+		return -1;
+
+	for (i = 0; i < (unsigned int) received; i++)
+	{
+		datagrams[i].length = msgs[i].msg_len;
+		datagrams[i].timestamp = message_timestamp(&msgs[i].msg_hdr);
+		datagrams[i].truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+	}
+
+	return received;
+}
+
+// An interface is usable if it's up with a link, supports multicast and isn't loopback
+static int link_flags_usable(unsigned int flags)
+{
+	if ((flags & (IFF_UP | IFF_RUNNING)) != (IFF_UP | IFF_RUNNING))
+		return 0;
+
+	if (!(flags & IFF_MULTICAST))
+		return 0;
+
+	if (flags & IFF_LOOPBACK)
+		return 0;
+
+	return 1;
+}
+
+// Pulls the local IPv4 address out of an address message, returning 0 if there isn't one
+static unsigned int addr_message_address(struct nlmsghdr *msg)
+{
+	struct ifaddrmsg *ifa = (struct ifaddrmsg *) NLMSG_DATA(msg);
+	struct rtattr *rta;
+	int rta_len;
+	unsigned int local, address;
+
+	if (ifa->ifa_family != AF_INET)
+		return 0;
+
+	// IFA_ADDRESS is the peer on point-to-point links, so prefer IFA_LOCAL
+	local = address = 0;
+	rta_len = IFA_PAYLOAD(msg);
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, rta_len); rta = RTA_NEXT(rta, rta_len))
+	{
+		if (RTA_PAYLOAD(rta) < sizeof(unsigned int))
+			continue;
+
+		if (rta->rta_type == IFA_LOCAL)
+			memcpy(&local, RTA_DATA(rta), sizeof(local));
+		else if (rta->rta_type == IFA_ADDRESS)
+			memcpy(&address, RTA_DATA(rta), sizeof(address));
+	}
+
+	return local != 0 ? local : address;
+}
+
+static int netlink_open(unsigned int groups)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1)
+	{
+		printf("Failed to create netlink socket (%d)\n", errno);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = groups;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+	{
+		printf("Failed to bind netlink socket (%d)\n", errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Requests a full dump of the given type and hands each message to the callback
+static int netlink_dump(int fd, int type, netlink_message_function callback, void *context)
+{
+	struct {
+		struct nlmsghdr hdr;
+		struct rtgenmsg gen;
+	} request;
+	struct nlmsghdr *msg;
+	char *buffer;
+	ssize_t len;
+	int err;
+
+	memset(&request, 0, sizeof(request));
+	request.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(request.gen));
+	request.hdr.nlmsg_type = type;
+	request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.hdr.nlmsg_seq = type;
+	request.gen.rtgen_family = AF_UNSPEC;
+
+	if (send(fd, &request, request.hdr.nlmsg_len, 0) == -1)
+	{
+		printf("Failed to send netlink dump request (%d)\n", errno);
+		return -1;
+	}
+
+	buffer = (char *) malloc(NETLINK_BUFFER_SIZE);
+	if (buffer == NULL)
+	{
+		printf("Failed to allocate netlink buffer\n");
+		return -1;
+	}
+
+	for (;;)
+	{
+		len = recv(fd, buffer, NETLINK_BUFFER_SIZE, 0);
+		if (len <= 0)
+		{
+			if (len < 0 && errno == EINTR)
+				continue;
+
+			printf("Failed to receive netlink dump (%d)\n", errno);
+			err = -1;
+			break;
+		}
+
+		for (msg = (struct nlmsghdr *) buffer; NLMSG_OK(msg, (unsigned int) len); msg = NLMSG_NEXT(msg, len))
+		{
+			if (msg->nlmsg_seq != (unsigned int) type)
+				continue;
+
+			if (msg->nlmsg_type == NLMSG_DONE)
+			{
+				free(buffer);
+				return 0;
+			}
+
+			if (msg->nlmsg_type == NLMSG_ERROR)
+			{
+				printf("Netlink dump failed\n");
+				free(buffer);
+				return -1;
+			}
+
+			err = callback(msg, context);
+			if (err != 0)
+			{
+				free(buffer);
+				return err;
+			}
+		}
+	}
+
+	free(buffer);
+	return err;
+}
+
+static int link_dump_callback(struct nlmsghdr *msg, void *context)
+{
+	struct link_table *table = (struct link_table *) context;
+	struct ifinfomsg *ifi = (struct ifinfomsg *) NLMSG_DATA(msg);
+	struct link_state *links;
+
+	if (msg->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	// Grow the table as needed
+	if (table->count == table->allocated)
+	{
+		table->allocated = table->allocated ? table->allocated * 2 : 32;
+		links = (struct link_state *) realloc(table->links, table->allocated * sizeof(*links));
+		if (links == NULL)
+		{
+			printf("Failed to allocate link table\n");
+			return -1;
+		}
+
+		table->links = links;
+	}
+
+	table->links[table->count].index = ifi->ifi_index;
+	table->links[table->count].flags = ifi->ifi_flags;
+	table->count++;
+
+	return 0;
+}
+
+static int addr_dump_callback(struct nlmsghdr *msg, void *context)
+{
+	struct addr_dump_context *dump = (struct addr_dump_context *) context;
+	struct ifaddrmsg *ifa = (struct ifaddrmsg *) NLMSG_DATA(msg);
+	unsigned int address, i;
+
+	if (msg->nlmsg_type != RTM_NEWADDR || dump->count == dump->ip_table_len)
+		return 0;
+
+	address = addr_message_address(msg);
+	if (address == 0)
+		return 0;
+
+	// Check the state of the link that owns this address
+	for (i = 0; i < dump->link_table->count; i++)
+	{
+		if (dump->link_table->links[i].index == (int) ifa->ifa_index)
+			break;
+	}
+
+	if (i == dump->link_table->count || !link_flags_usable(dump->link_table->links[i].flags))
+		return 0;
+
+	dump->ip_table[dump->count++] = address;
+
+	return 0;
+}
+
+int platform_iface_ip_table(unsigned int *ip_table, unsigned int *ip_table_len)
+{
+	struct link_table link_table;
+	struct addr_dump_context dump;
+	int fd, err;
+
+	fd = netlink_open(0);
+	if (fd == -1)
+		return -1;
+
+	// One dump for the link states and one for the addresses, regardless of how
+	// many interfaces the machine has
+	memset(&link_table, 0, sizeof(link_table));
+	err = netlink_dump(fd, RTM_GETLINK, link_dump_callback, &link_table);
+	if (err != 0)
+	{
+		printf("Failed to get link table\n");
+		goto cleanup;
+	}
+
+	dump.link_table = &link_table;
+	dump.ip_table = ip_table;
+	dump.ip_table_len = *ip_table_len;
+	dump.count = 0;
+	err = netlink_dump(fd, RTM_GETADDR, addr_dump_callback, &dump);
+	if (err != 0)
+	{
+		printf("Failed to get address table\n");
+		goto cleanup;
+	}
+
+	*ip_table_len = dump.count;
+
+cleanup:
+	free(link_table.links);
+	close(fd);
+	return err;
+}
+
+// Checks a single link's flags when an address shows up on it
+static int iface_index_usable(unsigned int index)
+{
+	struct ifreq ifr;
+	int fd, usable;
+
+	memset(&ifr, 0, sizeof(ifr));
+	if (if_indextoname(index, ifr.ifr_name) == NULL)
+		return 0;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return 0;
+
+	usable = ioctl(fd, SIOCGIFFLAGS, &ifr) == 0 && link_flags_usable((unsigned short) ifr.ifr_flags);
+
+	close(fd);
+	return usable;
+}
+
+static void notification_dispatch(struct nlmsghdr *msg)
+{
+	struct ifaddrmsg *ifa;
+	struct ifinfomsg *ifi;
+	unsigned int address;
+
+	switch (msg->nlmsg_type)
+	{
+	case RTM_NEWADDR:
+		address = addr_message_address(msg);
+		ifa = (struct ifaddrmsg *) NLMSG_DATA(msg);
+		if (address != 0 && iface_index_usable(ifa->ifa_index))
+		{
+			notification_callback(PLATFORM_IFACE_ADDR_ADDED, address);
+		}
+		break;
+
+	case RTM_DELADDR:
+		address = addr_message_address(msg);
+		if (address != 0)
+		{
+			notification_callback(PLATFORM_IFACE_ADDR_REMOVED, address);
+		}
+		break;
+
+	case RTM_NEWLINK:
+		// Links going up or down change which addresses are usable. Brand new links
+		// report every flag as changed, but they have no addresses until they come up.
+		ifi = (struct ifinfomsg *) NLMSG_DATA(msg);
+		if ((ifi->ifi_change & (IFF_UP | IFF_RUNNING)) &&
+			((ifi->ifi_flags & IFF_UP) || ifi->ifi_change != ~0U))
+		{
+			notification_callback(PLATFORM_IFACE_CHANGED, 0);
+		}
+		break;
+	}
+}
+
+static void notification_thread(void *parameter)
+{
+	struct nlmsghdr *msg;
+	char *buffer;
+	ssize_t len;
+	int fd = (int)(long) parameter;
+
+	buffer = (char *) malloc(NETLINK_BUFFER_SIZE);
+	if (buffer == NULL)
+	{
+		printf("Failed to allocate netlink buffer\n");
+		return;
+	}
+
+	for (;;)
+	{
+		len = recv(fd, buffer, NETLINK_BUFFER_SIZE, 0);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// We lost events because the socket overflowed, so the
+			// only safe thing to do is requery everything
+			if (errno == ENOBUFS)
+			{
+				notification_callback(PLATFORM_IFACE_CHANGED, 0);
+				continue;
+			}
+
+			break;
+		}
+		else if (len == 0)
+		{
+			break;
+		}
+
+		for (msg = (struct nlmsghdr *) buffer; NLMSG_OK(msg, (unsigned int) len); msg = NLMSG_NEXT(msg, len))
+		{
+			notification_dispatch(msg);
+		}
+	}
+
+	free(buffer);
+}
+
+int platform_notify_iface_change(reconfigure_callback_function reconfig_callback)
+{
+	int err;
+
+	// Request messages when IPv4 addresses or link states change
+	notification_socket = netlink_open(RTMGRP_IPV4_IFADDR | RTMGRP_LINK);
+	if (notification_socket == -1)
+	{
+		printf("Failed to register interface change callback\n");
+		return -1;
+	}
+
+	notification_callback = reconfig_callback;
+
+	err = platform_start_thread(notification_thread, (void *)(long) notification_socket, NULL);
+	if (err != 0)
+	{
+		close(notification_socket);
+		notification_socket = -1;
+		return -1;
+	}
+
+	// The socket will be closed in platform_cleanup()
+
+	return 0;
+}
+
+static void* thread_stub(void *parameter)
+{
+	struct thread_stub_tuple *tuple = (struct thread_stub_tuple *) parameter;
+
+	tuple->thread_start(tuple->thread_parameter);
+
+	free(tuple);
+
+	return NULL;
+}
+
+int platform_start_thread(thread_start_function thread_start, void* thread_parameter, PLATFORM_THREAD *thread)
+{
+	pthread_t handle;
+	pthread_attr_t attr;
+	struct thread_stub_tuple *tuple;
+	int err;
+
+	tuple = (struct thread_stub_tuple *) malloc(sizeof(*tuple));
+	if (tuple == NULL)
+	{
+		printf("Failed to allocate tuple\n");
+		return -1;
+	}
+
+	tuple->thread_start = thread_start;
+	tuple->thread_parameter = thread_parameter;
+
+	// Threads nobody will join are detached so they clean up after themselves
+	pthread_attr_init(&attr);
+	if (thread == NULL)
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	err = pthread_create(&handle, &attr, thread_stub, tuple);
+	pthread_attr_destroy(&attr);
+	if (err != 0)
+	{
+		printf("Failed to create a new thread\n");
+		free(tuple);
+		return -1;
+	}
+
+	if (thread != NULL)
+		*thread = handle;
+
+	return 0;
+}
+
+void platform_join_thread(PLATFORM_THREAD thread)
+{
+	pthread_join(thread, NULL);
+}
\ No newline at end of file
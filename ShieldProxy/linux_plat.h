@@ -0,0 +1,32 @@
+#pragma once
+
+// sendmmsg(), recvmmsg() and friends
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PLATFORM_NAME "Linux"
+
+// Sockets are plain file descriptors here
+typedef int SOCKET;
+#define closesocket close
+
+#define PLATFORM_MUTEX pthread_mutex_t
+#define PLATFORM_THREAD pthread_t
+#define PLATFORM_EVENT sem_t
+
+// Sequentially consistent atomics
+#define PLATFORM_ATOMIC_LOAD_PTR(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define PLATFORM_ATOMIC_EXCHANGE_PTR(ptr, value) __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define PLATFORM_ATOMIC_LOAD_UINT(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define PLATFORM_ATOMIC_EXCHANGE_UINT(ptr, value) __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define PLATFORM_ATOMIC_STORE_UINT(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_SEQ_CST)
\ No newline at end of file
@@ -1,33 +1,56 @@
 #include "shieldrelay.h"
 
-int reconfigure(void)
+#if defined(__linux__)
+#include "engine.h"
+#endif
+
+void reconfigure(int event, unsigned int address)
 {
 	int err;
 
 	// Reconfigure the MDNS socket
-	err = reconfigure_mdns_socket();
+	err = reconfigure_mdns_socket(event, address);
 	if (err != 0)
 	{
 		printf("Failed to reconfigure MDNS socket\n");
-		return err;
+		return;
+	}
+
+	// Nothing is captured in socket proxy mode
+	if (proxy_config.socket_proxy)
+	{
+		return;
 	}
 
 	// Reconfigure the PCAP infrastructure
-	err = pcap_reconfigure();
+	err = pcap_reconfigure(event, address);
 	if (err != 0)
 	{
 		printf("Failed to reconfigure PCAP infrastructure\n");
-		return err;
+		return;
 	}
-
-	return 0;
 }
 
 int main(int argc, char* argv [])
 {
 	int err;
 
-	printf("Shield Streaming Proxy for Windows "VERSION_STR"\n\n");
+	printf("Shield Streaming Proxy for "PLATFORM_NAME" "VERSION_STR"\n\n");
+
+	// Apply any settings from the command line
+	err = config_parse_args(argc, argv);
+	if (err != 0)
+	{
+		return err > 0 ? 0 : err;
+	}
+
+	// Build the relayed port table from the config
+	err = udprelay_init_ports();
+	if (err != 0)
+	{
+		printf("Invalid UDP port configuration\n");
+		return err;
+	}
 
 	// Bring up the platform support code first
 	err = platform_init();
@@ -37,6 +60,20 @@ int main(int argc, char* argv [])
 		return err;
 	}
 
+#if defined(__linux__)
+	// The engine must be up before anything registers with it
+	if (proxy_config.engine != ENGINE_THREADS && engine_init() != 0)
+	{
+		printf("Falling back to a thread per interface\n");
+		proxy_config.engine = ENGINE_THREADS;
+	}
+
+	// The engine's workers send what they capture, pinned and scheduled as configured,
+	// instead of handing it to a send thread per interface
+	if (proxy_config.engine != ENGINE_THREADS)
+		proxy_config.tx_ring_slots = 0;
+#endif
+
 	// Setup the MDNS relay code
 	err = init_mdns_socket();
 	if (err != 0)
@@ -45,11 +82,49 @@ int main(int argc, char* argv [])
 		goto cleanup;
 	}
 
-	// Start handling incoming Shield communcations
-	err = pcap_init();
+#if defined(__linux__)
+	// Own the UDP ports instead of capturing if we were asked to
+	if (proxy_config.socket_proxy)
+	{
+		err = sockproxy_init();
+		if (err != 0)
+		{
+			printf("Failed to initialize socket proxy\n");
+			goto cleanup;
+		}
+	}
+	else
+#endif
+	{
+		// Start handling incoming Shield communcations
+		err = pcap_init();
+		if (err != 0)
+		{
+			printf("Failed to initialize pcap infrastructure\n");
+			goto cleanup;
+		}
+	}
+
+#if defined(__linux__)
+	// Relay the TCP ports if we were given somewhere to send them
+	err = tcprelay_init();
+	if (err != 0)
+	{
+		printf("Failed to initialize TCP relay\n");
+		goto cleanup;
+	}
+#else
+	if (proxy_config.target != 0 || proxy_config.socket_proxy)
+	{
+		printf("The TCP relay and socket proxy are only available on Linux\n");
+	}
+#endif
+
+	// Serve the traffic counters if a stats listener was configured
+	err = stats_init();
 	if (err != 0)
 	{
-		printf("Failed to initialize pcap infrastructure\n");
+		printf("Failed to initialize stats\n");
 		goto cleanup;
 	}
 
@@ -1,10 +1,169 @@
 #include "shieldrelay.h"
 
+#if defined(__linux__)
+#include "engine.h"
+#endif
+
+// Immutable copy of the interface IP table for the relay loop
+struct iface_snapshot {
+	unsigned int version;
+	unsigned int count;
+	unsigned int addresses[MAX_IP_COUNT];
+
+	// Open addressed set of the same addresses, 0 marks an empty slot
+	unsigned int hash_set[IFACE_HASH_SIZE];
+};
+
+// Only the relay loop counts these
+struct mdns_stats {
+	unsigned long long received_packets;
+	unsigned long long received_bytes;
+	unsigned long long to_lan_packets;
+	unsigned long long to_client_packets;
+	unsigned long long ignored_packets;
+	unsigned long long send_errors;
+	unsigned long long cache_answers;
+	unsigned long long cache_refreshes;
+	unsigned long long to_lan_rate_limited;
+	unsigned long long to_client_rate_limited;
+	unsigned long long clients_registered;
+	unsigned long long clients_expired;
+};
+
+static const struct stats_metric mdns_metrics[] = {
+	{ "shieldproxy_mdns_received_packets_total", "MDNS packets received by the relay",
+		offsetof(struct mdns_stats, received_packets) },
+	{ "shieldproxy_mdns_received_bytes_total", "MDNS bytes received by the relay",
+		offsetof(struct mdns_stats, received_bytes) },
+	{ "shieldproxy_mdns_to_lan_packets_total", "MDNS packets from the other relay sent to the LAN",
+		offsetof(struct mdns_stats, to_lan_packets) },
+	{ "shieldproxy_mdns_to_client_packets_total", "MDNS packets from the LAN sent to the other relay",
+		offsetof(struct mdns_stats, to_client_packets) },
+	{ "shieldproxy_mdns_ignored_packets_total", "MDNS packets that had nowhere to go",
+		offsetof(struct mdns_stats, ignored_packets) },
+	{ "shieldproxy_mdns_send_errors_total", "MDNS packets that failed to send",
+		offsetof(struct mdns_stats, send_errors) },
+	{ "shieldproxy_mdns_cache_answers_total", "MDNS queries from the other relay answered from the record cache",
+		offsetof(struct mdns_stats, cache_answers) },
+	{ "shieldproxy_mdns_cache_refreshes_total", "MDNS queries answered from the cache that also went to the LAN to refresh it",
+		offsetof(struct mdns_stats, cache_refreshes) },
+	{ "shieldproxy_mdns_to_lan_rate_limited_packets_total", "MDNS packets from the other relay dropped by the rate limit",
+		offsetof(struct mdns_stats, to_lan_rate_limited) },
+	{ "shieldproxy_mdns_to_client_rate_limited_packets_total", "MDNS packets for the other relay dropped by the rate limit",
+		offsetof(struct mdns_stats, to_client_rate_limited) },
+	{ "shieldproxy_mdns_clients_registered_total", "Remote relays that started receiving MDNS traffic from the LAN",
+		offsetof(struct mdns_stats, clients_registered) },
+	{ "shieldproxy_mdns_clients_expired_total", "Remote relays dropped for going quiet or to make room for another",
+		offsetof(struct mdns_stats, clients_expired) },
+};
+
+// Counted by the cache itself
+static const struct stats_metric mdns_cache_metrics[] = {
+	{ "shieldproxy_mdns_cache_learned_records_total", "GameStream records taken into the cache from LAN responses",
+		offsetof(struct mdns_cache, learned) },
+	{ "shieldproxy_mdns_cache_expired_records_total", "Cached GameStream records that expired",
+		offsetof(struct mdns_cache, expired) },
+	{ "shieldproxy_mdns_unrelated_packets_total", "MDNS packets from the LAN dropped for having nothing to do with GameStream",
+		offsetof(struct mdns_cache, unrelated) },
+	{ "shieldproxy_mdns_duplicate_queries_total", "MDNS queries from the other relay dropped as repeats of one just sent to the LAN",
+		offsetof(struct mdns_cache, duplicates) },
+	{ "shieldproxy_mdns_suppressed_answers_total", "MDNS responses not sent to a remote relay because it listed every answer as known",
+		offsetof(struct mdns_cache, suppressed) },
+	{ "shieldproxy_mdns_malformed_packets_total", "MDNS packets that couldn't be parsed",
+		offsetof(struct mdns_cache, malformed) },
+};
+
+static struct mdns_stats mdns_stats;
+static struct mdns_cache mdns_cache;
+
+// Token bucket for one direction, counted in millionths of a packet
+struct mdns_rate {
+	unsigned long long tokens;
+	unsigned long long refilled;
+};
+
+static struct mdns_rate lan_rate, client_rate;
+
 SOCKET mdns_socket;
+
+// The writer's copy of the table, only touched while holding the mutex
 unsigned int iface_ip_table[MAX_IP_COUNT];
 unsigned int iface_table_len;
 PLATFORM_MUTEX iface_table_mutex;
 
+// What the relay loop reads. Snapshots are replaced, never modified.
+struct iface_snapshot *current_snapshot;
+unsigned int snapshot_version;
+
+// Odd while the relay loop may be holding a snapshot, bumped on every transition
+unsigned int reader_epoch;
+
+static unsigned int iface_hash_slot(unsigned int address)
+{
+	return (address * 2654435761U) >> (32 - IFACE_HASH_BITS);
+}
+
+static int snapshot_contains(struct iface_snapshot *snapshot, unsigned int address)
+{
+	unsigned int slot;
+
+	for (slot = iface_hash_slot(address); snapshot->hash_set[slot] != 0; slot = (slot + 1) % IFACE_HASH_SIZE)
+	{
+		if (snapshot->hash_set[slot] == address)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Waits until the relay loop can no longer be using a snapshot that was just replaced
+static void wait_for_reader(void)
+{
+	unsigned int epoch;
+
+	epoch = PLATFORM_ATOMIC_LOAD_UINT(&reader_epoch);
+	if ((epoch & 1) == 0)
+		return;
+
+	while (PLATFORM_ATOMIC_LOAD_UINT(&reader_epoch) == epoch)
+		platform_sleep_ms(1);
+}
+
+// Publishes the writer's table to the relay loop. Must be called with the mutex held.
+static int publish_snapshot(void)
+{
+	struct iface_snapshot *snapshot, *old_snapshot;
+	unsigned int i, slot;
+
+	snapshot = (struct iface_snapshot *) calloc(1, sizeof(*snapshot));
+	if (snapshot == NULL)
+	{
+		printf("Failed to allocate interface snapshot\n");
+		return -1;
+	}
+
+	snapshot->version = ++snapshot_version;
+	snapshot->count = iface_table_len;
+	for (i = 0; i < iface_table_len; i++)
+	{
+		snapshot->addresses[i] = iface_ip_table[i];
+
+		for (slot = iface_hash_slot(iface_ip_table[i]); snapshot->hash_set[slot] != 0; slot = (slot + 1) % IFACE_HASH_SIZE);
+		snapshot->hash_set[slot] = iface_ip_table[i];
+	}
+
+	old_snapshot = (struct iface_snapshot *) PLATFORM_ATOMIC_EXCHANGE_PTR(&current_snapshot, snapshot);
+
+	// The old one can go once the relay loop has moved past it
+	if (old_snapshot != NULL)
+	{
+		wait_for_reader();
+		free(old_snapshot);
+	}
+
+	return 0;
+}
+
 int join_multicast_group(void)
 {
 	int err;
@@ -14,16 +173,16 @@ int join_multicast_group(void)
 	// Join the multicast group for all interfaces
 	for (i = 0; i < iface_table_len; i++)
 	{
-		mreq.imr_multiaddr.S_un.S_addr = htonl(MDNS_ADDR);
-		mreq.imr_interface.S_un.S_addr = iface_ip_table[i];
+		mreq.imr_multiaddr.s_addr = htonl(MDNS_ADDR);
+		mreq.imr_interface.s_addr = iface_ip_table[i];
 
 		// Join the MDNS multicast group
 		err = setsockopt(mdns_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*) &mreq, sizeof(mreq));
 		if (err != 0)
 		{
+			// Another address on the same interface may have joined already
 			printf("Failed to join multicast group (Error: %d)\n", platform_last_error());
-			closesocket(mdns_socket);
-			return -1;
+			continue;
 		}
 
 		printf("Joined MDNS multicast group with interface %s\n", inet_ntoa(mreq.imr_interface));
@@ -41,8 +200,8 @@ int leave_multicast_group(void)
 	// Leave the multicast group for each interface, ignoring errors due to an already non-registered interface
 	for (i = 0; i < iface_table_len; i++)
 	{
-		mreq.imr_multiaddr.S_un.S_addr = htonl(MDNS_ADDR);
-		mreq.imr_interface.S_un.S_addr = iface_ip_table[i];
+		mreq.imr_multiaddr.s_addr = htonl(MDNS_ADDR);
+		mreq.imr_interface.s_addr = iface_ip_table[i];
 
 		// Bye...
 		err = setsockopt(mdns_socket, IPPROTO_IP, IP_DROP_MEMBERSHIP, (const char*) &mreq, sizeof(mreq));
@@ -71,17 +230,113 @@ int refresh_ip_table(void)
 		printf("Failed to get interface IP table\n");
 		return -1;
 	}
-	else
+
+	// Hand the new table to the relay loop
+	err = publish_snapshot();
+
+	platform_mutex_release(&iface_table_mutex);
+
+	return err;
+}
+
+int add_iface_address(unsigned int address)
+{
+	int err;
+	struct ip_mreq mreq;
+	unsigned int i;
+
+	platform_mutex_acquire(&iface_table_mutex);
+
+	// Nothing to do if we already know about this address
+	for (i = 0; i < iface_table_len; i++)
+	{
+		if (iface_ip_table[i] == address)
+		{
+			platform_mutex_release(&iface_table_mutex);
+			return 0;
+		}
+	}
+
+	if (iface_table_len == MAX_IP_COUNT)
+	{
+		platform_mutex_release(&iface_table_mutex);
+		printf("Interface IP table is full\n");
+		return 0;
+	}
+
+	iface_ip_table[iface_table_len++] = address;
+	publish_snapshot();
+
+	platform_mutex_release(&iface_table_mutex);
+
+	// Join the MDNS multicast group on just this interface
+	mreq.imr_multiaddr.s_addr = htonl(MDNS_ADDR);
+	mreq.imr_interface.s_addr = address;
+	err = setsockopt(mdns_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*) &mreq, sizeof(mreq));
+	if (err != 0)
+	{
+		printf("Failed to join multicast group (Error: %d)\n", platform_last_error());
+		return 0;
+	}
+
+	printf("Joined MDNS multicast group with interface %s\n", inet_ntoa(mreq.imr_interface));
+
+	return 0;
+}
+
+int remove_iface_address(unsigned int address)
+{
+	int err;
+	struct ip_mreq mreq;
+	unsigned int i;
+
+	platform_mutex_acquire(&iface_table_mutex);
+
+	for (i = 0; i < iface_table_len; i++)
+	{
+		if (iface_ip_table[i] == address)
+			break;
+	}
+
+	// We never joined with this address
+	if (i == iface_table_len)
 	{
 		platform_mutex_release(&iface_table_mutex);
 		return 0;
 	}
+
+	// Move the last entry into the hole
+	iface_ip_table[i] = iface_ip_table[--iface_table_len];
+	publish_snapshot();
+
+	platform_mutex_release(&iface_table_mutex);
+
+	// This can fail if the interface is already gone, which is fine
+	mreq.imr_multiaddr.s_addr = htonl(MDNS_ADDR);
+	mreq.imr_interface.s_addr = address;
+	err = setsockopt(mdns_socket, IPPROTO_IP, IP_DROP_MEMBERSHIP, (const char*) &mreq, sizeof(mreq));
+	if (err == 0)
+	{
+		printf("Left the multicast group on interface %s\n", inet_ntoa(mreq.imr_interface));
+	}
+
+	return 0;
 }
 
-int reconfigure_mdns_socket(void)
+int reconfigure_mdns_socket(int event, unsigned int address)
 {
 	int err;
 
+	// Address changes can be applied without touching the other interfaces
+	if (event == PLATFORM_IFACE_ADDR_ADDED)
+	{
+		return add_iface_address(address);
+	}
+	else if (event == PLATFORM_IFACE_ADDR_REMOVED)
+	{
+		return remove_iface_address(address);
+	}
+
 	// Unregister and reregister for MDNS multicast group membership. Doing this
 	// will start giving us MDNS traffic on the new interface.
 
@@ -129,7 +384,7 @@ int init_mdns_socket(void)
 	memset(&bindaddr, 0, sizeof(bindaddr));
 	bindaddr.sin_family = AF_INET;
 	bindaddr.sin_port = htons(MDNS_RELAY_PORT);
-	bindaddr.sin_addr.S_un.S_addr = htonl(INADDR_ANY);
+	bindaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
 	// Bind to the MDNS port on all interfaces
 	err = bind(mdns_socket, (struct sockaddr*)&bindaddr, sizeof(bindaddr));
@@ -143,6 +398,9 @@ int init_mdns_socket(void)
 	// Initialize IP table mutex
 	platform_mutex_init(&iface_table_mutex);
 
+	mdns_cache_init(&mdns_cache, (proxy_config.mdns_cache ? MDNS_CACHE_ANSWER : 0) |
+		(proxy_config.mdns_filter ? MDNS_CACHE_FILTER : 0));
+
 	// Load initial IP table
 	err = refresh_ip_table();
 	if (err != 0)
@@ -164,81 +422,392 @@ int init_mdns_socket(void)
 	return 0;
 }
 
-int relay_loop(void)
+// Sends a batch to one destination, returning -1 only if the socket is unusable
+static int send_batch(struct platform_datagram *datagrams, unsigned int count)
+{
+	unsigned int sent;
+	int err;
+
+	sent = 0;
+	while (sent < count)
+	{
+		err = platform_send_batch(mdns_socket, &datagrams[sent], count - sent);
+		if (err < 0)
+		{
+			err = platform_last_error();
+			printf("Failed to send packet (Error: %d)\n", err);
+			mdns_stats.send_errors++;
+			if (!platform_error_is_transient(err))
+				return -1;
+
+			// Drop the datagram that failed and keep going with the rest
+			sent++;
+		}
+		else
+		{
+			sent += err;
+		}
+	}
+
+	return 0;
+}
+
+// A remote relay that has contacted us. Anything it sends counts as a keepalive.
+struct mdns_client {
+	struct sockaddr_in addr;
+	unsigned long long last_seen;
+};
+
+// Only the relay loop touches the registry, so it needs no lock
+static struct mdns_client mdns_clients[MDNS_MAX_CLIENTS];
+static unsigned int mdns_client_count;
+
+static void register_client(struct sockaddr_in *addr, unsigned long long now)
+{
+	unsigned int i, oldest;
+
+	for (i = 0; i < mdns_client_count; i++)
+	{
+		if (mdns_clients[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+			mdns_clients[i].addr.sin_port == addr->sin_port)
+		{
+			mdns_clients[i].last_seen = now;
+			return;
+		}
+	}
+
+	// When it's full, the client heard from longest ago makes way
+	if (mdns_client_count == MDNS_MAX_CLIENTS)
+	{
+		oldest = 0;
+		for (i = 1; i < mdns_client_count; i++)
+		{
+			if (mdns_clients[i].last_seen < mdns_clients[oldest].last_seen)
+				oldest = i;
+		}
+
+		printf("Too many MDNS relay clients, no longer relaying to %s:%d\n",
+			inet_ntoa(mdns_clients[oldest].addr.sin_addr), htons(mdns_clients[oldest].addr.sin_port));
+		mdns_stats.clients_expired++;
+		i = oldest;
+	}
+	else
+	{
+		i = mdns_client_count++;
+	}
+
+	mdns_clients[i].addr = *addr;
+	mdns_clients[i].last_seen = now;
+	mdns_stats.clients_registered++;
+	printf("Relaying MDNS traffic to %s:%d\n", inet_ntoa(addr->sin_addr), htons(addr->sin_port));
+}
+
+// Forgets the clients that haven't been heard from within the timeout
+static void expire_clients(unsigned long long now)
 {
-	char buffer[MDNS_MTU];
-	struct sockaddr_in src_addr, dst_addr, last_client_addr = { 0 };
-	int byte_count;
-	int src_length;
+	unsigned long long timeout;
 	unsigned int i;
-	struct mdns_header *header = (struct mdns_header*)buffer;
 
-	memset(&dst_addr, 0, sizeof(dst_addr));
-	dst_addr.sin_family = AF_INET;
-	dst_addr.sin_port = htons(MDNS_PORT);
-	dst_addr.sin_addr.S_un.S_addr = htonl(MDNS_ADDR);
+	timeout = (unsigned long long) proxy_config.mdns_client_timeout * 1000000;
+	i = 0;
+	while (i < mdns_client_count)
+	{
+		if (now - mdns_clients[i].last_seen < timeout)
+		{
+			i++;
+			continue;
+		}
+
+		printf("MDNS relay client %s:%d went quiet\n",
+			inet_ntoa(mdns_clients[i].addr.sin_addr), htons(mdns_clients[i].addr.sin_port));
+		mdns_stats.clients_expired++;
 
-	for (;;)
+		// Move the last entry into the hole
+		mdns_clients[i] = mdns_clients[--mdns_client_count];
+	}
+}
+
+// Datagrams sorted by destination against the interface snapshot, sent together.
+// The snapshot is held from batch_begin() until batch_end().
+struct mdns_batch {
+	struct iface_snapshot *snapshot;
+	unsigned int lan_count, client_count, reply_count;
+
+	// Every LAN packet goes to each client, so there's room for all of their copies
+	struct sockaddr_in client_addrs[MDNS_CLIENT_BATCH_SIZE];
+	struct platform_datagram to_lan[MDNS_BATCH_SIZE], to_client[MDNS_CLIENT_BATCH_SIZE];
+
+	// Responses built from the cache
+	unsigned char replies[MDNS_BATCH_SIZE][MDNS_MTU];
+};
+
+static struct sockaddr_in lan_addr;
+
+static void batch_begin(struct mdns_batch *batch)
+{
+	// Marking ourselves as a reader first keeps the snapshot alive until we're done
+	batch->lan_count = batch->client_count = batch->reply_count = 0;
+	PLATFORM_ATOMIC_STORE_UINT(&reader_epoch, reader_epoch + 1);
+	batch->snapshot = (struct iface_snapshot *) PLATFORM_ATOMIC_LOAD_PTR(&current_snapshot);
+}
+
+// One batched send per destination
+static int batch_send(struct mdns_batch *batch)
+{
+	int err;
+
+	err = 0;
+	if (batch->lan_count != 0 && send_batch(batch->to_lan, batch->lan_count) != 0)
+		err = -1;
+
+	if (batch->client_count != 0 && send_batch(batch->to_client, batch->client_count) != 0)
+		err = -1;
+
+	batch->lan_count = batch->client_count = batch->reply_count = 0;
+	return err;
+}
+
+static int batch_end(struct mdns_batch *batch)
+{
+	PLATFORM_ATOMIC_STORE_UINT(&reader_epoch, reader_epoch + 1);
+	return batch_send(batch);
+}
+
+// Keeps a noisy LAN or a misbehaving peer from flooding the other side
+static int rate_allow(struct mdns_rate *rate, unsigned long long now)
+{
+	unsigned long long elapsed;
+
+	if (proxy_config.mdns_rate_limit == 0)
+		return 1;
+
+	// Up to a second's worth can go out back to back
+	elapsed = now - rate->refilled;
+	if (elapsed > 1000000)
+		elapsed = 1000000;
+
+	rate->tokens += elapsed * proxy_config.mdns_rate_limit;
+	if (rate->tokens > (unsigned long long) proxy_config.mdns_rate_limit * 1000000)
+		rate->tokens = (unsigned long long) proxy_config.mdns_rate_limit * 1000000;
+	rate->refilled = now;
+
+	if (rate->tokens < 1000000)
+		return 0;
+
+	rate->tokens -= 1000000;
+	return 1;
+}
+
+static void queue_to_client(struct mdns_batch *batch, struct sockaddr_in *addr, char *data, unsigned int length)
+{
+	batch->client_addrs[batch->client_count] = *addr;
+	batch->to_client[batch->client_count].addr = &batch->client_addrs[batch->client_count];
+	batch->to_client[batch->client_count].data = data;
+	batch->to_client[batch->client_count].length = length;
+	batch->client_count++;
+}
+
+// The data must stay valid until the batch is sent
+static int batch_add(struct mdns_batch *batch, struct sockaddr_in *src_addr, char *data, unsigned int length)
+{
+	unsigned long long now;
+	unsigned int reply_length, i;
+	int forward;
+
+	if (length == 0)
+		return 0;
+
+	mdns_stats.received_packets++;
+	mdns_stats.received_bytes += length;
+	now = platform_time_us();
+
+	// Real MDNS is 5353 -> 5353
+	if (src_addr->sin_port == htons(MDNS_PORT))
 	{
-		// Read a MDNS packet
-		src_length = sizeof(src_addr);
-		byte_count = recvfrom(mdns_socket, buffer, sizeof(buffer), 0, (struct sockaddr*)&src_addr, &src_length);
-		if (byte_count <= 0)
+		// If it came in from the multicast group and it's not from a local
+		// source, it's other multicast traffic which we ignore
+		if (!snapshot_contains(batch->snapshot, src_addr->sin_addr.s_addr))
 		{
-			printf("Failed to receive packet (Error: %d)\n", platform_last_error());
-			return -1;
+			mdns_stats.ignored_packets++;
+			return 0;
 		}
 
-		// Real MDNS is 5353 -> 5353
-		if (src_addr.sin_port == htons(MDNS_PORT))
+		// Our own announcements are worth keeping even before the other relay shows up
+		if (!mdns_cache_from_lan(&mdns_cache, (unsigned char *) data, length, now))
+			return 0;
+
+		// We have nowhere to send it until a remote relay has contacted us
+		expire_clients(now);
+		if (mdns_client_count == 0)
 		{
-			// Acquire the mutex to protect the iface table
-			platform_mutex_acquire(&iface_table_mutex);
+			mdns_stats.ignored_packets++;
+			return 0;
+		}
 
-			// Check if the source is a local link
-			for (i = 0; i < iface_table_len; i++)
-			{
-				if (src_addr.sin_addr.S_un.S_addr == iface_ip_table[i])
-				{
-					// This needs to go to the client
-					dst_addr = last_client_addr;
-					break;
-				}
-			}
+		if (!rate_allow(&client_rate, now))
+		{
+			mdns_stats.to_client_rate_limited++;
+			return 0;
+		}
 
-			// If it came in from the multicast group
-			// and it's not from a local source, it's other
-			// multicast traffic which we ignore.
-			if (i == iface_table_len)
-			{
-				platform_mutex_release(&iface_table_mutex);
+		// Every client gets a copy, all sent together with the rest of the batch, unless it
+		// just listed every answer as known
+		for (i = 0; i < mdns_client_count; i++)
+		{
+			if (mdns_cache_client_knows(&mdns_cache, &mdns_clients[i].addr, (unsigned char *) data, length, now))
 				continue;
+
+			queue_to_client(batch, &mdns_clients[i].addr, data, length);
+			mdns_stats.to_client_packets++;
+		}
+	}
+	else
+	{
+		// This looks like it came from a remote relay, which wants the LAN's responses from now on
+		register_client(src_addr, now);
+
+		// Discovery we can answer goes straight back without a trip across the LAN
+		forward = mdns_cache_from_client(&mdns_cache, src_addr, (unsigned char *) data, length, now,
+			batch->replies[batch->reply_count], MDNS_MTU, &reply_length);
+		if (reply_length != 0)
+		{
+			if (rate_allow(&client_rate, now))
+			{
+				queue_to_client(batch, src_addr, (char *) batch->replies[batch->reply_count++], reply_length);
+				mdns_stats.cache_answers++;
+				if (forward)
+					mdns_stats.cache_refreshes++;
 			}
 			else
 			{
-				platform_mutex_release(&iface_table_mutex);
+				mdns_stats.to_client_rate_limited++;
 			}
 		}
-		else
-		{
-			// This looks like it came from the other relay
-			dst_addr.sin_addr.S_un.S_addr = htonl(MDNS_ADDR);
-			dst_addr.sin_port = htons(MDNS_PORT);
 
-			// Remember the source for next time
-			if (last_client_addr.sin_addr.S_un.S_addr != src_addr.sin_addr.S_un.S_addr ||
-				last_client_addr.sin_port != src_addr.sin_port)
+		// Otherwise it goes to the LAN, as does anything answered from records that are going stale
+		if (forward)
+		{
+			if (rate_allow(&lan_rate, now))
 			{
-				last_client_addr = src_addr;
-				printf("Relaying MDNS traffic to %s:%d\n", inet_ntoa(src_addr.sin_addr), htons(src_addr.sin_port));
+				batch->to_lan[batch->lan_count].addr = &lan_addr;
+				batch->to_lan[batch->lan_count].data = data;
+				batch->to_lan[batch->lan_count].length = length;
+				batch->lan_count++;
+				mdns_stats.to_lan_packets++;
+			}
+			else
+			{
+				mdns_stats.to_lan_rate_limited++;
 			}
 		}
+	}
 
-		byte_count = sendto(mdns_socket, buffer, byte_count, 0, (struct sockaddr*)&dst_addr, sizeof(dst_addr));
-		if (byte_count <= 0)
+	// Make room for the next one, which may go to every client
+	if (batch->lan_count == MDNS_BATCH_SIZE || batch->reply_count == MDNS_BATCH_SIZE ||
+		batch->client_count + MDNS_MAX_CLIENTS > MDNS_CLIENT_BATCH_SIZE)
+		return batch_send(batch);
+
+	return 0;
+}
+
+#if defined(__linux__)
+static struct mdns_batch engine_batch;
+static int engine_batch_open;
+
+static void engine_mdns_received(void *context, struct sockaddr_in *addr, char *data, unsigned int length)
+{
+	if (!engine_batch_open)
+	{
+		batch_begin(&engine_batch);
+		engine_batch_open = 1;
+	}
+
+	batch_add(&engine_batch, addr, data, length);
+}
+
+static void engine_mdns_done(void *context)
+{
+	if (engine_batch_open)
+	{
+		batch_end(&engine_batch);
+		engine_batch_open = 0;
+	}
+}
+#endif
+
+int relay_loop(void)
+{
+	char buffers[MDNS_BATCH_SIZE][MDNS_MTU];
+	struct sockaddr_in src_addrs[MDNS_BATCH_SIZE];
+	struct platform_datagram received[MDNS_BATCH_SIZE];
+	struct mdns_batch batch;
+	int count, err, i;
+
+	memset(&lan_addr, 0, sizeof(lan_addr));
+	lan_addr.sin_family = AF_INET;
+	lan_addr.sin_port = htons(MDNS_PORT);
+	lan_addr.sin_addr.s_addr = htonl(MDNS_ADDR);
+
+#if defined(__linux__)
+	// The engine takes over this thread and relays from its own buffers
+	if (proxy_config.engine != ENGINE_THREADS)
+	{
+		if (engine_add_recv(mdns_socket, engine_mdns_received, engine_mdns_done, NULL) == NULL)
+			return -1;
+
+		return engine_run();
+	}
+#endif
+
+	for (;;)
+	{
+		// Read as many MDNS packets as are waiting
+		for (i = 0; i < MDNS_BATCH_SIZE; i++)
 		{
-			printf("Failed to send packet (Error: %d)\n", platform_last_error());
+			received[i].addr = &src_addrs[i];
+			received[i].data = buffers[i];
+			received[i].length = MDNS_MTU;
+		}
+
+		count = platform_recv_batch(mdns_socket, received, MDNS_BATCH_SIZE);
+		if (count < 0)
+		{
+			err = platform_last_error();
+			if (platform_error_is_transient(err))
+				continue;
+
+			printf("Failed to receive packet (Error: %d)\n", err);
 			return -1;
 		}
+
+		// Sort the whole batch by destination against the current interface snapshot
+		batch_begin(&batch);
+		err = 0;
+		for (i = 0; i < count && err == 0; i++)
+		{
+			err = batch_add(&batch, &src_addrs[i], received[i].data, received[i].length);
+		}
+
+		if (batch_end(&batch) != 0 || err != 0)
+			return -1;
+	}
+}
+
+void mdns_write_stats(struct stats_buffer *buffer)
+{
+	unsigned int i;
+
+	for (i = 0; i < STATS_METRIC_COUNT(mdns_metrics); i++)
+	{
+		stats_write_header(buffer, &mdns_metrics[i]);
+		stats_write_sample(buffer, mdns_metrics[i].name, NULL, 0,
+			STATS_COUNTER(&mdns_stats, &mdns_metrics[i]));
+	}
+
+	for (i = 0; i < STATS_METRIC_COUNT(mdns_cache_metrics); i++)
+	{
+		stats_write_header(buffer, &mdns_cache_metrics[i]);
+		stats_write_sample(buffer, mdns_cache_metrics[i].name, NULL, 0,
+			STATS_COUNTER(&mdns_cache, &mdns_cache_metrics[i]));
 	}
 }
\ No newline at end of file
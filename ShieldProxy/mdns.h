@@ -4,8 +4,27 @@
 #define MDNS_ADDR 0xE00000FB // 224.0.0.251
 #define MDNS_MTU 1500
 
+// Most packets the relay loop handles per wakeup
+#define MDNS_BATCH_SIZE 32
+
+// Remote relays that get the LAN's responses at once, and the seconds one may go
+// quiet by default before it's forgotten
+#define MDNS_MAX_CLIENTS 16
+#define MDNS_CLIENT_TIMEOUT 600
+
+// Room for a whole batch of LAN packets to go to every client
+#define MDNS_CLIENT_BATCH_SIZE (MDNS_BATCH_SIZE * MDNS_MAX_CLIENTS)
+
+// Packets per second relayed each way by default
+#define MDNS_RATE_LIMIT 100
+
 #define MAX_IP_COUNT 32
 
+// Hash set of interface addresses, kept at most half full
+#define IFACE_HASH_BITS 6
+#define IFACE_HASH_SIZE (1 << IFACE_HASH_BITS)
+
 int init_mdns_socket(void);
 int relay_loop(void);
-int reconfigure_mdns_socket(void);
\ No newline at end of file
+int reconfigure_mdns_socket(int event, unsigned int address);
+void mdns_write_stats(struct stats_buffer *buffer);
\ No newline at end of file
@@ -0,0 +1,860 @@
+#include "shieldrelay.h"
+
+// Fields of the DNS header, by byte offset
+#define DNS_FLAGS 2
+#define DNS_QUESTION_COUNT 4
+#define DNS_ANSWER_COUNT 6
+#define DNS_AUTHORITY_COUNT 8
+#define DNS_ADDITIONAL_COUNT 10
+#define DNS_HEADER_SIZE 12
+
+#define DNS_FLAG_RESPONSE 0x8000
+#define DNS_FLAG_AUTHORITATIVE 0x0400
+#define DNS_RCODE_MASK 0x000F
+
+// Type, class, TTL and rdata length
+#define DNS_RECORD_FIXED_SIZE 10
+
+// Compression pointers are followed at most this many times per name, which stops loops
+#define DNS_MAX_POINTERS 16
+
+// Records in a cache flush set that are older than this are replaced by a new announcement
+#define MDNS_FLUSH_GRACE_US 1000000
+
+// A question as it sits in a message, with its name decompressed
+struct dns_question {
+	unsigned char name[DNS_NAME_MAX];
+	unsigned int name_length;
+	unsigned short type;
+	unsigned short rclass;
+};
+
+// A record as it sits in a message, with any names in it decompressed
+struct dns_record {
+	unsigned char name[DNS_NAME_MAX];
+	unsigned int name_length;
+	unsigned short type;
+	unsigned short rclass;
+	unsigned int ttl;
+	unsigned char rdata[MDNS_RDATA_MAX];
+	unsigned int rdata_length;
+};
+
+static unsigned short read_u16(const unsigned char *field)
+{
+	return (unsigned short) ((field[0] << 8) | field[1]);
+}
+
+static unsigned int read_u32(const unsigned char *field)
+{
+	return ((unsigned int) field[0] << 24) | (field[1] << 16) | (field[2] << 8) | field[3];
+}
+
+static void write_u16(unsigned char *field, unsigned int value)
+{
+	field[0] = (unsigned char) (value >> 8);
+	field[1] = (unsigned char) value;
+}
+
+static void write_u32(unsigned char *field, unsigned int value)
+{
+	field[0] = (unsigned char) (value >> 24);
+	field[1] = (unsigned char) (value >> 16);
+	field[2] = (unsigned char) (value >> 8);
+	field[3] = (unsigned char) value;
+}
+
+// Reads the name at *offset into name, uncompressed and with its terminating label.
+// *offset ends up past the name as it appears in the message. Returns 0, or -1 if the
+// name is malformed.
+static int read_name(const unsigned char *message, unsigned int length, unsigned int *offset,
+	unsigned char *name, unsigned int *name_length)
+{
+	unsigned int position, label, pointers;
+
+	position = *offset;
+	pointers = 0;
+	*name_length = 0;
+	for (;;)
+	{
+		if (position >= length)
+			return -1;
+
+		label = message[position];
+		if ((label & 0xC0) == 0xC0)
+		{
+			if (position + 1 >= length || ++pointers > DNS_MAX_POINTERS)
+				return -1;
+
+			// The name carries on wherever the pointer says, but the message carries on after it
+			if (pointers == 1)
+				*offset = position + 2;
+
+			position = ((label & 0x3F) << 8) | message[position + 1];
+			continue;
+		}
+
+		// The other label types never made it into use
+		if ((label & 0xC0) != 0)
+			return -1;
+
+		if (position + 1 + label > length || *name_length + 1 + label > DNS_NAME_MAX)
+			return -1;
+
+		memcpy(name + *name_length, message + position, 1 + label);
+		*name_length += 1 + label;
+		position += 1 + label;
+
+		if (label == 0)
+			break;
+	}
+
+	if (pointers == 0)
+		*offset = position;
+
+	return 0;
+}
+
+static unsigned char fold_case(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? (unsigned char) (c - 'A' + 'a') : c;
+}
+
+// Names compare without regard to ASCII case. Label lengths never reach the letters.
+static int name_equal(const unsigned char *a, unsigned int a_length, const unsigned char *b, unsigned int b_length)
+{
+	unsigned int i;
+
+	if (a_length != b_length)
+		return 0;
+
+	for (i = 0; i < a_length; i++)
+	{
+		if (fold_case(a[i]) != fold_case(b[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Whether the name is the GameStream service or one of its instances
+static int in_service(const unsigned char *name, unsigned int name_length)
+{
+	unsigned int position;
+
+	for (position = 0; position < name_length && name[position] != 0; position += 1 + name[position])
+	{
+		if (name_equal(name + position, name_length - position,
+			(const unsigned char *) MDNS_GAMESTREAM_SERVICE, sizeof(MDNS_GAMESTREAM_SERVICE)))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int read_question(const unsigned char *message, unsigned int length, unsigned int *offset,
+	struct dns_question *question)
+{
+	if (read_name(message, length, offset, question->name, &question->name_length) != 0 || *offset + 4 > length)
+		return -1;
+
+	question->type = read_u16(message + *offset);
+	question->rclass = read_u16(message + *offset + 2);
+	*offset += 4;
+	return 0;
+}
+
+// Reads the record at *offset, decompressing the names inside PTR and SRV rdata
+static int read_record(const unsigned char *message, unsigned int length, unsigned int *offset,
+	struct dns_record *record)
+{
+	unsigned int position, rdata_length, target_length;
+
+	if (read_name(message, length, offset, record->name, &record->name_length) != 0)
+		return -1;
+
+	position = *offset;
+	if (position + DNS_RECORD_FIXED_SIZE > length)
+		return -1;
+
+	record->type = read_u16(message + position);
+	record->rclass = read_u16(message + position + 2);
+	record->ttl = read_u32(message + position + 4);
+	rdata_length = read_u16(message + position + 8);
+	position += DNS_RECORD_FIXED_SIZE;
+	if (position + rdata_length > length)
+		return -1;
+
+	*offset = position + rdata_length;
+
+	switch (record->type)
+	{
+	case DNS_TYPE_PTR:
+		if (read_name(message, length, &position, record->rdata, &record->rdata_length) != 0)
+			return -1;
+		break;
+
+	case DNS_TYPE_SRV:
+		// Priority, weight and port come before the target
+		if (rdata_length < 7)
+			return -1;
+
+		memcpy(record->rdata, message + position, 6);
+		position += 6;
+		if (read_name(message, length, &position, record->rdata + 6, &target_length) != 0)
+			return -1;
+
+		record->rdata_length = 6 + target_length;
+		break;
+
+	default:
+		// Too big to keep, so make sure it's never cached
+		if (rdata_length > MDNS_RDATA_MAX)
+		{
+			record->type = 0;
+			record->rdata_length = 0;
+			break;
+		}
+
+		memcpy(record->rdata, message + position, rdata_length);
+		record->rdata_length = rdata_length;
+		break;
+	}
+
+	return 0;
+}
+
+static int record_live(const struct mdns_record *entry, unsigned long long now)
+{
+	return entry->in_use && now < entry->expires;
+}
+
+// The TTL counts down from when the record was announced, rounded up so it's never 0
+static unsigned int remaining_ttl(const struct mdns_record *entry, unsigned long long now)
+{
+	return (unsigned int) ((entry->expires - now + 999999) / 1000000);
+}
+
+static int record_matches(const struct mdns_record *entry, const struct dns_record *record)
+{
+	return entry->type == record->type && entry->rdata_length == record->rdata_length &&
+		name_equal(entry->name, entry->name_length, record->name, record->name_length) &&
+		memcmp(entry->rdata, record->rdata, record->rdata_length) == 0;
+}
+
+static void copy_record(struct mdns_record *entry, const struct dns_record *record)
+{
+	entry->in_use = 1;
+	entry->type = record->type;
+	memcpy(entry->name, record->name, record->name_length);
+	entry->name_length = record->name_length;
+	memcpy(entry->rdata, record->rdata, record->rdata_length);
+	entry->rdata_length = record->rdata_length;
+}
+
+static void cache_record(struct mdns_cache *cache, const struct dns_record *record, unsigned long long now)
+{
+	struct mdns_record *entry, *match, *free_entry, *oldest;
+	unsigned int i;
+	int unique;
+
+	// A goodbye only takes out the one record
+	unique = record->ttl != 0 && (record->rclass & DNS_CLASS_FLAG) != 0;
+
+	match = free_entry = oldest = NULL;
+	for (i = 0; i < MDNS_CACHE_SIZE; i++)
+	{
+		entry = &cache->records[i];
+		if (entry->in_use && now >= entry->expires)
+		{
+			cache->expired++;
+			entry->in_use = 0;
+		}
+
+		if (!entry->in_use)
+		{
+			if (free_entry == NULL)
+				free_entry = entry;
+			continue;
+		}
+
+		if (record_matches(entry, record))
+		{
+			match = entry;
+			continue;
+		}
+
+		if (unique && entry->type == record->type && now - entry->received > MDNS_FLUSH_GRACE_US &&
+			name_equal(entry->name, entry->name_length, record->name, record->name_length))
+		{
+			entry->in_use = 0;
+			if (free_entry == NULL)
+				free_entry = entry;
+			continue;
+		}
+
+		if (oldest == NULL || entry->expires < oldest->expires)
+			oldest = entry;
+	}
+
+	if (record->ttl == 0)
+	{
+		if (match != NULL)
+			match->in_use = 0;
+		return;
+	}
+
+	// When it's full, the record closest to expiring makes way
+	if (match == NULL)
+	{
+		match = free_entry != NULL ? free_entry : oldest;
+		copy_record(match, record);
+	}
+
+	// Queriers refresh at 80% of the TTL, and so do we
+	match->unique = unique;
+	match->ttl = record->ttl;
+	match->received = now;
+	match->expires = now + (unsigned long long) record->ttl * 1000000;
+	match->refresh = now + (unsigned long long) record->ttl * 800000;
+	cache->learned++;
+}
+
+// Keeps the service's records and the addresses announced along with them
+static void learn_record(struct mdns_cache *cache, const struct dns_record *record, unsigned long long now)
+{
+	if ((record->rclass & DNS_CLASS_MASK) != DNS_CLASS_IN)
+		return;
+
+	switch (record->type)
+	{
+	case DNS_TYPE_PTR:
+	case DNS_TYPE_SRV:
+	case DNS_TYPE_TXT:
+		if (in_service(record->name, record->name_length))
+			cache_record(cache, record, now);
+		break;
+
+	case DNS_TYPE_A:
+		cache_record(cache, record, now);
+		break;
+	}
+}
+
+static int same_client(const struct mdns_record *entry, const struct sockaddr_in *client)
+{
+	return entry->client_addr == client->sin_addr.s_addr && entry->client_port == client->sin_port;
+}
+
+// Known answers only hold for the responses to the query that listed them, and only
+// for the client that sent it
+static void remember_known(struct mdns_cache *cache, const struct sockaddr_in *client, const struct dns_record *record,
+	unsigned long long now)
+{
+	struct mdns_record *entry, *match, *free_entry, *oldest;
+	unsigned int i;
+
+	match = free_entry = oldest = NULL;
+	for (i = 0; i < MDNS_KNOWN_ANSWERS; i++)
+	{
+		entry = &cache->known[i];
+		if (!record_live(entry, now))
+		{
+			if (free_entry == NULL)
+				free_entry = entry;
+			continue;
+		}
+
+		if (same_client(entry, client) && record_matches(entry, record))
+		{
+			match = entry;
+			break;
+		}
+
+		if (oldest == NULL || entry->expires < oldest->expires)
+			oldest = entry;
+	}
+
+	if (match == NULL)
+	{
+		match = free_entry != NULL ? free_entry : oldest;
+		copy_record(match, record);
+	}
+
+	match->client_addr = client->sin_addr.s_addr;
+	match->client_port = client->sin_port;
+	match->ttl = record->ttl;
+	match->received = now;
+	match->expires = now + MDNS_KNOWN_WINDOW_US;
+}
+
+// Whether a client listed a record as known with at least half of this TTL left,
+// in which case a responder wouldn't send it to that client. Goodbyes always go through.
+static int record_known(struct mdns_cache *cache, const struct sockaddr_in *client, const unsigned char *name, unsigned int name_length,
+	unsigned short type, const unsigned char *rdata, unsigned int rdata_length, unsigned int ttl,
+	unsigned long long now)
+{
+	struct mdns_record *entry;
+	unsigned long long elapsed;
+	unsigned int i;
+
+	if (ttl == 0)
+		return 0;
+
+	for (i = 0; i < MDNS_KNOWN_ANSWERS; i++)
+	{
+		entry = &cache->known[i];
+		if (!record_live(entry, now) || !same_client(entry, client) || entry->type != type || entry->rdata_length != rdata_length ||
+			!name_equal(entry->name, entry->name_length, name, name_length) ||
+			memcmp(entry->rdata, rdata, rdata_length) != 0)
+		{
+			continue;
+		}
+
+		elapsed = (now - entry->received) / 1000000;
+		if (entry->ttl > elapsed && (entry->ttl - elapsed) * 2 >= ttl)
+			return 1;
+	}
+
+	return 0;
+}
+
+static struct mdns_question *find_question(struct mdns_cache *cache, const struct dns_question *question)
+{
+	struct mdns_question *entry;
+	unsigned int i;
+
+	for (i = 0; i < MDNS_RECENT_QUESTIONS; i++)
+	{
+		entry = &cache->questions[i];
+		if (entry->in_use && entry->type == question->type &&
+			name_equal(entry->name, entry->name_length, question->name, question->name_length))
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+// Questions only count as forwarded when the query listed no known answers, since then
+// the LAN's responses are complete and every client gets them
+static void note_questions(struct mdns_cache *cache, const struct dns_question *questions, unsigned int count,
+	unsigned long long now, int forwarded)
+{
+	struct mdns_question *entry, *oldest;
+	unsigned int i, j;
+
+	for (i = 0; i < count; i++)
+	{
+		entry = find_question(cache, &questions[i]);
+		if (entry == NULL)
+		{
+			// The question asked longest ago makes way
+			oldest = &cache->questions[0];
+			for (j = 0; j < MDNS_RECENT_QUESTIONS; j++)
+			{
+				if (!cache->questions[j].in_use)
+				{
+					oldest = &cache->questions[j];
+					break;
+				}
+
+				if (cache->questions[j].asked < oldest->asked)
+					oldest = &cache->questions[j];
+			}
+
+			entry = oldest;
+			entry->in_use = 1;
+			memcpy(entry->name, questions[i].name, questions[i].name_length);
+			entry->name_length = questions[i].name_length;
+			entry->type = questions[i].type;
+			entry->forwarded = 0;
+		}
+
+		entry->asked = now;
+		if (forwarded)
+			entry->forwarded = now;
+	}
+}
+
+// Whether every question already went to the LAN within the last second
+static int questions_forwarded(struct mdns_cache *cache, const struct dns_question *questions, unsigned int count,
+	unsigned long long now)
+{
+	struct mdns_question *entry;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+	{
+		entry = find_question(cache, &questions[i]);
+		if (entry == NULL || entry->forwarded == 0 || now - entry->forwarded >= MDNS_DUPLICATE_WINDOW_US)
+			return 0;
+	}
+
+	return 1;
+}
+
+// Whether a name has to do with GameStream: the service and its instances, the hosts they
+// point at, and anything a remote relay asked about lately
+static int name_relevant(struct mdns_cache *cache, const unsigned char *name, unsigned int name_length,
+	unsigned long long now)
+{
+	struct mdns_record *entry;
+	struct mdns_question *question;
+	unsigned int i;
+
+	if (in_service(name, name_length))
+		return 1;
+
+	for (i = 0; i < MDNS_CACHE_SIZE; i++)
+	{
+		entry = &cache->records[i];
+		if (record_live(entry, now) && entry->type == DNS_TYPE_SRV &&
+			name_equal(entry->rdata + 6, entry->rdata_length - 6, name, name_length))
+		{
+			return 1;
+		}
+	}
+
+	for (i = 0; i < MDNS_RECENT_QUESTIONS; i++)
+	{
+		question = &cache->questions[i];
+		if (question->in_use && now - question->asked < MDNS_ASKED_WINDOW_US &&
+			name_equal(question->name, question->name_length, name, name_length))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Malformed messages are passed along untouched unless we're filtering
+static int drop_malformed(struct mdns_cache *cache)
+{
+	cache->malformed++;
+	return !(cache->flags & MDNS_CACHE_FILTER);
+}
+
+void mdns_cache_init(struct mdns_cache *cache, unsigned int flags)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->flags = flags;
+}
+
+int mdns_cache_from_lan(struct mdns_cache *cache, const unsigned char *message, unsigned int length,
+	unsigned long long now)
+{
+	struct dns_question question;
+	struct dns_record record;
+	unsigned int offset, records_offset, flags, questions, records, i;
+	int relevant, successful;
+
+	if (length < DNS_HEADER_SIZE)
+		return drop_malformed(cache);
+
+	flags = read_u16(message + DNS_FLAGS);
+	questions = read_u16(message + DNS_QUESTION_COUNT);
+	records = read_u16(message + DNS_ANSWER_COUNT) + read_u16(message + DNS_AUTHORITY_COUNT) +
+		read_u16(message + DNS_ADDITIONAL_COUNT);
+
+	// Only successful responses carry records worth keeping
+	successful = (flags & (DNS_FLAG_RESPONSE | DNS_RCODE_MASK)) == DNS_FLAG_RESPONSE;
+
+	// Look over the whole message first, so the host addresses announced along with the service
+	// can be kept without keeping every address on the LAN
+	relevant = 0;
+	offset = DNS_HEADER_SIZE;
+	for (i = 0; i < questions; i++)
+	{
+		if (read_question(message, length, &offset, &question) != 0)
+			return drop_malformed(cache);
+
+		if (name_relevant(cache, question.name, question.name_length, now))
+			relevant = 1;
+	}
+
+	records_offset = offset;
+	for (i = 0; i < records; i++)
+	{
+		if (read_record(message, length, &offset, &record) != 0)
+			return drop_malformed(cache);
+
+		if (name_relevant(cache, record.name, record.name_length, now))
+			relevant = 1;
+	}
+
+	if (relevant && successful)
+	{
+		offset = records_offset;
+		for (i = 0; i < records; i++)
+		{
+			read_record(message, length, &offset, &record);
+			learn_record(cache, &record, now);
+		}
+	}
+
+	if (!(cache->flags & MDNS_CACHE_FILTER))
+		return 1;
+
+	if (!relevant)
+	{
+		cache->unrelated++;
+		return 0;
+	}
+
+	return 1;
+}
+
+int mdns_cache_client_knows(struct mdns_cache *cache, const struct sockaddr_in *client, const unsigned char *message,
+	unsigned int length, unsigned long long now)
+{
+	struct dns_question question;
+	struct dns_record record;
+	unsigned int offset, questions, answers, i;
+
+	if (!(cache->flags & MDNS_CACHE_FILTER) || length < DNS_HEADER_SIZE)
+		return 0;
+
+	// Only successful responses can be left out
+	answers = read_u16(message + DNS_ANSWER_COUNT);
+	if ((read_u16(message + DNS_FLAGS) & (DNS_FLAG_RESPONSE | DNS_RCODE_MASK)) != DNS_FLAG_RESPONSE || answers == 0)
+		return 0;
+
+	// Most of the time the client listed nothing, so don't bother parsing
+	for (i = 0; i < MDNS_KNOWN_ANSWERS; i++)
+	{
+		if (record_live(&cache->known[i], now) && same_client(&cache->known[i], client))
+			break;
+	}
+
+	if (i == MDNS_KNOWN_ANSWERS)
+		return 0;
+
+	questions = read_u16(message + DNS_QUESTION_COUNT);
+	offset = DNS_HEADER_SIZE;
+	for (i = 0; i < questions; i++)
+	{
+		if (read_question(message, length, &offset, &question) != 0)
+			return 0;
+	}
+
+	for (i = 0; i < answers; i++)
+	{
+		if (read_record(message, length, &offset, &record) != 0 ||
+			!record_known(cache, client, record.name, record.name_length, record.type,
+				record.rdata, record.rdata_length, record.ttl, now))
+		{
+			return 0;
+		}
+	}
+
+	cache->suppressed++;
+	return 1;
+}
+
+// Adds an entry to a response's record list once
+static void add_entry(struct mdns_record **entries, unsigned int *count, struct mdns_record *entry)
+{
+	unsigned int i;
+
+	for (i = 0; i < *count; i++)
+	{
+		if (entries[i] == entry)
+			return;
+	}
+
+	entries[(*count)++] = entry;
+}
+
+// Adds the live entries with this name and type, returning how many there were
+static unsigned int add_matching(struct mdns_cache *cache, struct mdns_record **entries, unsigned int *count,
+	const unsigned char *name, unsigned int name_length, unsigned short type, unsigned long long now)
+{
+	struct mdns_record *entry;
+	unsigned int i, matched;
+
+	matched = 0;
+	for (i = 0; i < MDNS_CACHE_SIZE; i++)
+	{
+		entry = &cache->records[i];
+		if (record_live(entry, now) && entry->type == type &&
+			name_equal(entry->name, entry->name_length, name, name_length))
+		{
+			add_entry(entries, count, entry);
+			matched++;
+		}
+	}
+
+	return matched;
+}
+
+static int write_record(unsigned char *response, unsigned int response_size, unsigned int *offset,
+	const struct mdns_record *entry, unsigned long long now)
+{
+	unsigned char *field;
+
+	if (*offset + entry->name_length + DNS_RECORD_FIXED_SIZE + entry->rdata_length > response_size)
+		return -1;
+
+	field = response + *offset;
+	memcpy(field, entry->name, entry->name_length);
+	field += entry->name_length;
+
+	write_u16(field, entry->type);
+	write_u16(field + 2, DNS_CLASS_IN | (entry->unique ? DNS_CLASS_FLAG : 0));
+	write_u32(field + 4, remaining_ttl(entry, now));
+	write_u16(field + 8, entry->rdata_length);
+	memcpy(field + DNS_RECORD_FIXED_SIZE, entry->rdata, entry->rdata_length);
+
+	*offset += entry->name_length + DNS_RECORD_FIXED_SIZE + entry->rdata_length;
+	return 0;
+}
+
+// Builds a response if every question has live records in the cache. Returns 1 if it could
+// be answered, even if the client already knew everything and there's nothing to send.
+static int answer_query(struct mdns_cache *cache, const struct sockaddr_in *client,
+	const struct dns_question *questions, unsigned int question_count,
+	unsigned long long now, unsigned char *response, unsigned int response_size, unsigned int *response_length,
+	int *refresh)
+{
+	struct mdns_record *entries[MDNS_CACHE_SIZE];
+	struct mdns_record *entry;
+	unsigned int offset, answer_count, entry_count, answers_written, additional_written, i;
+
+	*refresh = 0;
+	if (response_size < DNS_HEADER_SIZE)
+		return 0;
+
+	// Every question needs an answer, otherwise the LAN has to see the query
+	entry_count = 0;
+	for (i = 0; i < question_count; i++)
+	{
+		if ((questions[i].rclass & DNS_CLASS_MASK) != DNS_CLASS_IN ||
+			add_matching(cache, entries, &entry_count, questions[i].name, questions[i].name_length,
+				questions[i].type, now) == 0)
+		{
+			return 0;
+		}
+	}
+
+	answer_count = entry_count;
+	for (i = 0; i < answer_count; i++)
+	{
+		if (now >= entries[i]->refresh)
+			*refresh = 1;
+	}
+
+	// Send along what a responder would: the instance for a service, and the host for an instance
+	for (i = 0; i < entry_count; i++)
+	{
+		if (entries[i]->type == DNS_TYPE_PTR)
+		{
+			add_matching(cache, entries, &entry_count, entries[i]->rdata, entries[i]->rdata_length, DNS_TYPE_SRV, now);
+			add_matching(cache, entries, &entry_count, entries[i]->rdata, entries[i]->rdata_length, DNS_TYPE_TXT, now);
+		}
+		else if (entries[i]->type == DNS_TYPE_SRV)
+		{
+			add_matching(cache, entries, &entry_count, entries[i]->rdata + 6, entries[i]->rdata_length - 6, DNS_TYPE_A, now);
+		}
+	}
+
+	// Multicast responses have no ID and repeat no questions
+	memset(response, 0, DNS_HEADER_SIZE);
+	write_u16(response + DNS_FLAGS, DNS_FLAG_RESPONSE | DNS_FLAG_AUTHORITATIVE);
+
+	// Records the client listed as known are left out, as a responder would
+	offset = DNS_HEADER_SIZE;
+	answers_written = additional_written = 0;
+	for (i = 0; i < entry_count; i++)
+	{
+		entry = entries[i];
+		if (record_known(cache, client, entry->name, entry->name_length, entry->type, entry->rdata,
+			entry->rdata_length, remaining_ttl(entry, now), now))
+		{
+			continue;
+		}
+
+		if (write_record(response, response_size, &offset, entry, now) != 0)
+		{
+			// Additional records can be left out, but not answers
+			if (i < answer_count)
+				return 0;
+			break;
+		}
+
+		if (i < answer_count)
+			answers_written++;
+		else
+			additional_written++;
+	}
+
+	if (answers_written == 0)
+	{
+		cache->suppressed++;
+		*response_length = 0;
+		return 1;
+	}
+
+	write_u16(response + DNS_ANSWER_COUNT, answers_written);
+	write_u16(response + DNS_ADDITIONAL_COUNT, additional_written);
+	*response_length = offset;
+	return 1;
+}
+
+int mdns_cache_from_client(struct mdns_cache *cache, const struct sockaddr_in *client, const unsigned char *message,
+	unsigned int length, unsigned long long now, unsigned char *response, unsigned int response_size, unsigned int *response_length)
+{
+	struct dns_question questions[MDNS_QUESTION_MAX];
+	struct dns_record record;
+	unsigned int offset, question_count, answers, i;
+	int answered, refresh, forward;
+
+	*response_length = 0;
+	if (length < DNS_HEADER_SIZE)
+		return drop_malformed(cache);
+
+	question_count = read_u16(message + DNS_QUESTION_COUNT);
+	answers = read_u16(message + DNS_ANSWER_COUNT);
+
+	// Responses and probes from the other side are theirs to make, so they go out untouched
+	if ((read_u16(message + DNS_FLAGS) & DNS_FLAG_RESPONSE) != 0 || read_u16(message + DNS_AUTHORITY_COUNT) != 0 ||
+		question_count == 0 || question_count > MDNS_QUESTION_MAX)
+	{
+		return 1;
+	}
+
+	offset = DNS_HEADER_SIZE;
+	for (i = 0; i < question_count; i++)
+	{
+		if (read_question(message, length, &offset, &questions[i]) != 0)
+			return drop_malformed(cache);
+	}
+
+	// The known answers hold for whatever answers the query, the cache or the LAN
+	for (i = 0; i < answers; i++)
+	{
+		if (read_record(message, length, &offset, &record) != 0)
+			return drop_malformed(cache);
+
+		remember_known(cache, client, &record, now);
+	}
+
+	answered = (cache->flags & MDNS_CACHE_ANSWER) &&
+		answer_query(cache, client, questions, question_count, now, response, response_size, response_length, &refresh);
+	forward = !answered || refresh;
+
+	// Questions that all went to the LAN moments ago will be answered in full by the responses
+	// to that, which every client gets
+	if (forward && (cache->flags & MDNS_CACHE_FILTER) && questions_forwarded(cache, questions, question_count, now))
+	{
+		cache->duplicates++;
+		forward = 0;
+	}
+
+	note_questions(cache, questions, question_count, now, forward && answers == 0);
+	return forward;
+}
\ No newline at end of file
@@ -0,0 +1,117 @@
+#pragma once
+
+// DNS record types and classes the cache deals in
+#define DNS_TYPE_A 1
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_TXT 16
+#define DNS_TYPE_SRV 33
+#define DNS_CLASS_IN 1
+
+// The top bit of the class is cache flush in a record and unicast response in a question
+#define DNS_CLASS_MASK 0x7FFF
+#define DNS_CLASS_FLAG 0x8000
+
+// Longest name on the wire, uncompressed
+#define DNS_NAME_MAX 255
+
+// GameStream hosts announce one instance each, so this is plenty for a LAN of them
+#define MDNS_CACHE_SIZE 32
+#define MDNS_RDATA_MAX 512
+
+// The service the other relay's clients look for
+#define MDNS_GAMESTREAM_SERVICE "\011_nvstream\004_tcp\005local"
+
+// Questions the remote relays asked recently, and the answers each said it already knew
+#define MDNS_RECENT_QUESTIONS 32
+#define MDNS_KNOWN_ANSWERS 32
+
+// Queriers may not repeat a question within a second, so we don't either
+#define MDNS_DUPLICATE_WINDOW_US 1000000
+
+// How long LAN responses to the other relay's questions are expected, and how long
+// the answers it listed as known keep them from being relayed
+#define MDNS_ASKED_WINDOW_US 5000000
+#define MDNS_KNOWN_WINDOW_US 1000000
+
+// Most questions in a query we'll look at, anything longer is passed along as is
+#define MDNS_QUESTION_MAX 16
+
+// What the cache does besides keeping records
+#define MDNS_CACHE_ANSWER 1 // Answer queries from the other relay
+#define MDNS_CACHE_FILTER 2 // Drop unrelated, duplicate and already known traffic
+
+// A record from a GameStream announcement, or one a client listed as known,
+// with names kept uncompressed
+struct mdns_record {
+	int in_use;
+
+	unsigned char name[DNS_NAME_MAX];
+	unsigned int name_length;
+	unsigned short type;
+
+	// Sent with the cache flush bit, so there's only one set per name and type
+	int unique;
+
+	unsigned char rdata[MDNS_RDATA_MAX];
+	unsigned int rdata_length;
+
+	unsigned int ttl;
+	unsigned long long received;
+	unsigned long long expires;
+
+	// After this a query should still go to the LAN so the record gets refreshed
+	unsigned long long refresh;
+
+	// Which client listed it, for known answers
+	unsigned int client_addr;
+	unsigned short client_port;
+};
+
+// A question one of the remote relays asked
+struct mdns_question {
+	int in_use;
+
+	unsigned char name[DNS_NAME_MAX];
+	unsigned int name_length;
+	unsigned short type;
+
+	unsigned long long asked;
+
+	// When it last went to the LAN without known answers, or 0 if it hasn't
+	unsigned long long forwarded;
+};
+
+// Only the MDNS relay loop uses the cache, so it has no lock
+struct mdns_cache {
+	unsigned int flags;
+
+	struct mdns_record records[MDNS_CACHE_SIZE];
+	struct mdns_question questions[MDNS_RECENT_QUESTIONS];
+	struct mdns_record known[MDNS_KNOWN_ANSWERS];
+
+	unsigned long long learned;
+	unsigned long long expired;
+	unsigned long long unrelated;
+	unsigned long long duplicates;
+	unsigned long long suppressed;
+	unsigned long long malformed;
+};
+
+void mdns_cache_init(struct mdns_cache *cache, unsigned int flags);
+
+// Takes in the GameStream records from a message seen on the LAN. Returns 1 if it should
+// go to the remote relays, or 0 if it's unrelated to GameStream.
+int mdns_cache_from_lan(struct mdns_cache *cache, const unsigned char *message, unsigned int length,
+	unsigned long long now);
+
+// Whether a client listed every answer in a LAN response as known, so its copy can be left out
+int mdns_cache_client_knows(struct mdns_cache *cache, const struct sockaddr_in *client, const unsigned char *message,
+	unsigned int length, unsigned long long now);
+
+// Looks at a message from a remote relay. If every question in a query has live records in
+// the cache, a response is built from them, leaving out the answers the query listed as known,
+// and its length stored in response_length (0 if there's nothing to send). Returns 1 if the
+// message should go to the LAN: when the cache can't answer it and it isn't a repeat, or when
+// the records it was answered from are close to expiring.
+int mdns_cache_from_client(struct mdns_cache *cache, const struct sockaddr_in *client, const unsigned char *message,
+	unsigned int length, unsigned long long now, unsigned char *response, unsigned int response_size, unsigned int *response_length);
\ No newline at end of file
@@ -2,7 +2,14 @@
 
 #include "pcap.h"
 
+#if defined(__linux__)
+#include "tpacket.h"
+#include "engine.h"
+#endif
+
+#if WIN32
 #pragma comment(lib, "..\\WinPcap\\Lib\\wpcap.lib")
+#endif
 
 // The compiler must not optimize the alignment of these fields
 #pragma pack(push, 1)
@@ -31,14 +38,80 @@ struct udpv4_header {
 
 #pragma pack(pop)
 
+// Only the interface's capture thread counts these
+struct capture_stats {
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long filtered_packets;
+	unsigned long long truncated_packets;
+	unsigned long long kernel_drops;
+};
+
 struct interface_context {
+	struct interface_context *next;
+	char *name;
 	pcap_t *pcap_handle;
+#if defined(__linux__)
+	int use_ring;
+	struct tpacket_ring ring;
+
+	// Set when the capture runs on the engine instead of its own thread
+	struct engine_source *engine_source;
+#endif
+	PLATFORM_THREAD looper_thread;
+	int looper_running;
+
+	// libpcap's buffer size and the drops it had counted when we last looked. The
+	// capture thread asks the monitor to grow the buffer by setting grow_buffer.
+	unsigned int buffer_size;
+	unsigned int reported_drops;
+	unsigned long long next_drop_check;
+	volatile unsigned int grow_buffer;
+
+	// Datagrams from the PC wait here for the send thread, if it's used
+	struct txring tx;
+	PLATFORM_THREAD sender_thread;
+
 	struct in_addr iface_address;
+	unsigned int netmask;
 	struct udprelay_adapter_context relay_context;
+	struct reassembly_table reassembly;
+	struct capture_stats stats;
+};
+
+static const struct stats_metric capture_metrics[] = {
+	{ "shieldproxy_capture_packets_total", "Packets captured on an interface",
+		offsetof(struct interface_context, stats.packets) },
+	{ "shieldproxy_capture_bytes_total", "Bytes captured on an interface",
+		offsetof(struct interface_context, stats.bytes) },
+	{ "shieldproxy_capture_filtered_packets_total", "Captured packets that weren't Shield traffic for the interface",
+		offsetof(struct interface_context, stats.filtered_packets) },
+	{ "shieldproxy_capture_truncated_packets_total", "Captured packets cut short by the snaplen, which can't be relayed",
+		offsetof(struct interface_context, stats.truncated_packets) },
+	{ "shieldproxy_capture_kernel_drops_total", "Packets the kernel dropped because the capture buffer was full",
+		offsetof(struct interface_context, stats.kernel_drops) },
+	{ "shieldproxy_capture_fragments_total", "Captured IPv4 fragments",
+		offsetof(struct interface_context, reassembly.fragments) },
+	{ "shieldproxy_capture_reassembled_packets_total", "Datagrams put back together from fragments",
+		offsetof(struct interface_context, reassembly.reassembled) },
+	{ "shieldproxy_capture_reassembly_evictions_total", "Partly reassembled datagrams dropped to time out or make room",
+		offsetof(struct interface_context, reassembly.evictions) },
+	{ "shieldproxy_capture_tx_queued_packets_total", "Captured datagrams handed to the interface's send thread",
+		offsetof(struct interface_context, tx.queued) },
+	{ "shieldproxy_capture_tx_dropped_packets_total", "Captured datagrams dropped because the send thread had fallen behind",
+		offsetof(struct interface_context, tx.dropped) },
 };
 
-struct interface_context *interface_table;
-int dev_count;
+// Interfaces we're currently capturing on. The list is only changed while
+// holding the mutex, and each context stays put until its looper is joined.
+struct interface_context *interface_list;
+PLATFORM_MUTEX interface_list_mutex;
+
+// WinPcap gives friendly descriptions, but Linux devices often have none
+const char* device_display_name(pcap_if_t *dev)
+{
+	return dev->description != NULL ? dev->description : dev->name;
+}
 
 void packet_handler(u_char *param, const struct pcap_pkthdr *header, const u_char *pkt_data)
 {
@@ -46,6 +119,8 @@ void packet_handler(u_char *param, const struct pcap_pkthdr *header, const u_cha
 	struct ipv4_header *ip_hdr;
 	struct udpv4_header *udp_hdr;
 	u_char *data, *end;
+	unsigned int length, header_length, total_length;
+	unsigned long long capture_time;
 	int i;
 
 	end = (u_char*)(pkt_data + header->caplen);
@@ -53,144 +128,738 @@ void packet_handler(u_char *param, const struct pcap_pkthdr *header, const u_cha
 	// We get this pointer as a parameter in our callback per adapter
 	iface_context = (struct interface_context *)param;
 
+	iface_context->stats.packets++;
+	iface_context->stats.bytes += header->len;
+	length = header->len;
+
+	// Relaying part of a datagram would only corrupt the stream
+	if (header->caplen < header->len)
+	{
+		iface_context->stats.truncated_packets++;
+		return;
+	}
+
 	// This must be an IP packet since our filter requires it to pass, so we know there's
 	// an IPv4 header after the Ethernet header
 	ip_hdr = (struct ipv4_header *)(pkt_data + ETHERNET_HEADER_SIZE);
 	if ((u_char*) ip_hdr + sizeof(struct ipv4_header) >= end)
-		return;
+		goto filtered;
 
 	// Exclude packets that don't refer to this interface at all
-	if ((ip_hdr->src_addr != iface_context->iface_address.S_un.S_addr) &&
-		(ip_hdr->dst_addr != iface_context->iface_address.S_un.S_addr))
+	if ((ip_hdr->src_addr != iface_context->iface_address.s_addr) &&
+		(ip_hdr->dst_addr != iface_context->iface_address.s_addr))
 	{
-		return;
+		goto filtered;
+	}
+
+	// Put fragmented datagrams back together before looking at their ports
+	if (iface_context->reassembly.slot_count != 0 && (ntohs(ip_hdr->flags_fragoff) & 0x3FFF) != 0)
+	{
+		header_length = (ip_hdr->ver_ihl & 0xF) * 4;
+		total_length = ntohs(ip_hdr->total_length);
+		if (header_length < sizeof(struct ipv4_header) || total_length < header_length ||
+			(u_char*) ip_hdr + total_length > end)
+		{
+			goto filtered;
+		}
+
+		ip_hdr = (struct ipv4_header *) reassembly_add(&iface_context->reassembly,
+			(u_char*) ip_hdr, (u_char*) ip_hdr + header_length, total_length - header_length,
+			platform_time_us(), (unsigned long long) proxy_config.reassembly_timeout_ms * 1000, &length);
+		if (ip_hdr == NULL)
+		{
+			// Still waiting for the rest
+			return;
+		}
+
+		end = (u_char*) ip_hdr + length;
 	}
 
 	// We'll need to examine the UDP header
 	udp_hdr = (struct udpv4_header *)((u_char*) ip_hdr + ((ip_hdr->ver_ihl & 0xF) * 4));
 	if ((u_char*) udp_hdr + sizeof(struct udpv4_header) >= end)
-		return;
+		goto filtered;
 
-	for (i = 0; i < SHIELD_UDP_PORTS; i++)
+	// Both cases below are sent to one of our ports, so that finds the port in one lookup
+	i = UDPRELAY_PORT_INDEX(udp_hdr->dst_port);
+	if (i < 0)
 	{
-		//
-		// We have 2 cases to deal with here
-		// a) The packet is from the Shield to a port we're forwarding and from an arbitrary port
-		// b) The packet is from the computer from and to a port we're forwarding
-		//
+		// Not our port
+		goto filtered;
+	}
+
+	//
+	// We have 2 cases to deal with here
+	// a) The packet is from the Shield to a port we're forwarding and from an arbitrary port
+	// b) The packet is from the computer from and to a port we're forwarding
+	//
 
-		// A and B both exclude packets not destined for any port of ours
-		if (udp_hdr->dst_port != UDP_PORTS[i])
+	// We'll handle A first
+	if (udp_hdr->src_port != udp_ports[i])
+	{
+		// This packet shouldn't be from us
+		if (ip_hdr->src_addr == iface_context->iface_address.s_addr)
 		{
-			// Not this port
-			continue;
+			goto filtered;
 		}
 
-		// We'll handle A first
-		if (udp_hdr->src_port != UDP_PORTS[i])
+		// Tell the UDP relay about the new port that Shield is talking to us with
+		udprelay_reconfigure(&iface_context->relay_context, ip_hdr->src_addr,
+			udp_hdr->src_port, udp_hdr->dst_port, length);
+	}
+	// Now B
+	else
+	{
+		// This packet must be from us
+		if (ip_hdr->src_addr != iface_context->iface_address.s_addr)
 		{
-			// This packet shouldn't be from us
-			if (ip_hdr->src_addr == iface_context->iface_address.S_un.S_addr)
-			{
-				return;
-			}
+			goto filtered;
+		}
 
-			// Tell the UDP relay about the new port that Shield is talking to us with
-			udprelay_reconfigure(&iface_context->relay_context, udp_hdr->src_port, udp_hdr->dst_port);
+		data = (u_char*) udp_hdr + sizeof(*udp_hdr);
+		capture_time = (unsigned long long) header->ts.tv_sec * 1000000 + header->ts.tv_usec; // When it hit the wire
+
+		// Hand it to the send thread if there is one, which counts it if the ring's full
+		if (iface_context->tx.slot_count != 0)
+		{
+			txring_push(&iface_context->tx, ip_hdr->dst_addr, udp_hdr->dst_port,
+				(char*) data, (unsigned int) (end - data), capture_time);
+			return;
 		}
-		// Now B
-		else if (udp_hdr->src_port == UDP_PORTS[i])
+
+		// The UDP relay needs to forward this on the proper port
+		udprelay_forward(&iface_context->relay_context,
+			ip_hdr->dst_addr, // Send it to the same place as the original
+			udp_hdr->dst_port, // Send it to the port corresponding to the real destination
+			(char*) data, // The UDP datagram's data
+			(unsigned int) (end - data),
+			capture_time);
+	}
+
+	return;
+
+filtered:
+	iface_context->stats.filtered_packets++;
+}
+
+// Reads the kernel's drop counters about once a second. The capture handle isn't
+// safe to use from other threads, so this runs on the capture thread after a batch.
+void check_capture_drops(struct interface_context *iface_context)
+{
+	struct pcap_stat ps;
+	unsigned long long now;
+	unsigned int drops;
+
+	now = platform_time_us();
+	if (now < iface_context->next_drop_check)
+		return;
+	iface_context->next_drop_check = now + CAPTURE_DROP_CHECK_INTERVAL_US;
+
+#if defined(__linux__)
+	if (iface_context->use_ring)
+	{
+		if (tpacket_drops(&iface_context->ring, &drops) != 0)
+			return;
+	}
+	else
+#endif
+	{
+		if (iface_context->pcap_handle == NULL || pcap_stats(iface_context->pcap_handle, &ps) != 0)
+			return;
+
+		// These count from when the handle was opened
+		drops = ps.ps_drop + ps.ps_ifdrop - iface_context->reported_drops;
+		iface_context->reported_drops += drops;
+	}
+
+	if (drops == 0)
+		return;
+
+	iface_context->stats.kernel_drops += drops;
+
+	// A bigger buffer needs a new handle, which the monitor thread sets up. The ring is
+	// sized by its own options instead.
+	if (iface_context->pcap_handle != NULL && iface_context->buffer_size < proxy_config.capture_buffer_max)
+		PLATFORM_ATOMIC_STORE_UINT(&iface_context->grow_buffer, 1);
+}
+
+// Sends everything the relay queued while handling a batch of captured packets
+void capture_batch_done(u_char *param)
+{
+	struct interface_context *iface_context = (struct interface_context *)param;
+
+	check_capture_drops(iface_context);
+
+	// The send thread may be forwarding, but the flows are only changed from here
+	udprelay_expire(&iface_context->relay_context);
+
+	// The send thread gets one wakeup per batch, not per datagram
+	if (iface_context->tx.slot_count != 0)
+		txring_wake(&iface_context->tx);
+	else
+		udprelay_flush(&iface_context->relay_context);
+
+	// Reassembled datagrams may have been sent straight from their slabs, or copied to the ring
+	reassembly_release(&iface_context->reassembly);
+}
+
+// Forwards what the capture thread queued until the interface is stopped. The data
+// stays in the ring's pool until it's flushed, so the relay doesn't copy it again.
+void pcap_sender_thread(void* param)
+{
+	struct interface_context *iface_context = (struct interface_context *)param;
+	struct txring *ring = &iface_context->tx;
+	struct txring_entry *entry;
+	unsigned int count, i;
+	int traffic_class;
+
+	while ((count = txring_wait(ring)) != 0)
+	{
+		// Audio and control go out first, even if a video burst was captured ahead of them.
+		// Each port's datagrams stay in order.
+		for (traffic_class = UDPRELAY_CLASS_PRIORITY; traffic_class >= UDPRELAY_CLASS_BULK; traffic_class--)
 		{
-			// This packet must be from us
-			if (ip_hdr->src_addr != iface_context->iface_address.S_un.S_addr)
+			for (i = 0; i < count; i++)
 			{
-				return;
-			}
+				entry = txring_entry(ring, i);
+				if (UDPRELAY_PORT_CLASS(entry->dst_port) != traffic_class)
+					continue;
 
-			// The UDP relay needs to forward this on the proper port
-			data = (u_char*) udp_hdr + sizeof(*udp_hdr);
-			udprelay_forward(&iface_context->relay_context,
-				ip_hdr->dst_addr, // Send it to the same place as the original
-				udp_hdr->dst_port, // Send it to the port corresponding to the real destination
-				(char*) data, // The UDP datagram's data
-				header->caplen - (data - pkt_data));
+				udprelay_forward(&iface_context->relay_context, entry->dst_addr, entry->dst_port,
+					TXRING_DATA(ring, entry), entry->length, entry->capture_time);
+			}
 		}
+
+		udprelay_flush(&iface_context->relay_context);
+		txring_release(ring, count);
 	}
-	
+}
+
+void stop_sender(struct interface_context *iface_context)
+{
+	// Whatever's still queued is sent before the thread exits
+	txring_stop(&iface_context->tx);
+	platform_join_thread(iface_context->sender_thread);
 }
 
 void pcap_looper_thread(void* param)
 {
 	struct interface_context *iface_context = (struct interface_context *)param;
+	int err;
+
+#if defined(__linux__)
+	if (iface_context->use_ring)
+	{
+		// Walk the ring until we're stopped. Each block is flushed before it goes
+		// back to the kernel, so the relay can send straight out of the ring.
+		tpacket_loop(&iface_context->ring, packet_handler, capture_batch_done, (u_char*)iface_context);
+		return;
+	}
+#endif
+
+	// Start getting packets, flushing the relay after each buffer from the driver
+	do
+	{
+		err = pcap_dispatch(iface_context->pcap_handle, -1, packet_handler, (u_char*)iface_context);
+		capture_batch_done((u_char*)iface_context);
+	} while (err >= 0);
+}
+
+#if defined(__linux__)
+void engine_ring_ready(void *param)
+{
+	struct interface_context *iface_context = (struct interface_context *)param;
+
+	tpacket_dispatch(&iface_context->ring, packet_handler, capture_batch_done, (u_char*)iface_context);
+}
+
+void engine_pcap_ready(void *param)
+{
+	struct interface_context *iface_context = (struct interface_context *)param;
+
+	// The handle is non-blocking, so this only takes what's already buffered
+	pcap_dispatch(iface_context->pcap_handle, -1, packet_handler, (u_char*)iface_context);
+	capture_batch_done((u_char*)iface_context);
+}
+
+// Hands the capture to the engine instead of starting a looper thread
+int start_engine_capture(struct interface_context *iface_context)
+{
+	char errstr[PCAP_ERRBUF_SIZE];
+	int fd;
+
+	if (iface_context->use_ring)
+	{
+		iface_context->engine_source = engine_add_poll(iface_context->ring.fd,
+			engine_ring_ready, NULL, iface_context);
+	}
+	else
+	{
+		if (pcap_setnonblock(iface_context->pcap_handle, 1, errstr) != 0)
+		{
+			printf("Failed to make capture non-blocking (%s)\n", errstr);
+			return -1;
+		}
 
-	// Start getting packets
-	pcap_loop(iface_context->pcap_handle, 0, packet_handler, (u_char*)iface_context);
+		fd = pcap_get_selectable_fd(iface_context->pcap_handle);
+		if (fd == -1)
+		{
+			printf("Capture can't be polled\n");
+			return -1;
+		}
+
+		iface_context->engine_source = engine_add_poll(fd, engine_pcap_ready, NULL, iface_context);
+	}
+
+	return iface_context->engine_source != NULL ? 0 : -1;
+}
+#endif
+
+int start_pcap_looper(struct interface_context* iface_context)
+{
+	int err;
+
+#if defined(__linux__)
+	if (proxy_config.engine != ENGINE_THREADS)
+		err = start_engine_capture(iface_context);
+	else
+#endif
+		err = platform_start_thread(pcap_looper_thread, iface_context, &iface_context->looper_thread);
+
+	iface_context->looper_running = (err == 0);
+	return err;
 }
 
 void stop_pcap_looper(struct interface_context* iface_context)
 {
-	// If the device has no pcap active, there's nothing to do
-	if (iface_context->pcap_handle == NULL)
+	if (!iface_context->looper_running)
 		return;
+	iface_context->looper_running = 0;
 
-	// This breaks out of the pcap_loop() blocking call that we're
-	// inside in the looper thread for this interface
-	pcap_breakloop(iface_context->pcap_handle);
-	pcap_close(iface_context->pcap_handle);
+#if defined(__linux__)
+	if (iface_context->engine_source != NULL)
+	{
+		// Once this returns the engine won't touch the capture again
+		engine_remove(iface_context->engine_source);
+		iface_context->engine_source = NULL;
+		return;
+	}
+
+	if (iface_context->use_ring)
+	{
+		tpacket_breakloop(&iface_context->ring);
+	}
+	else
+#endif
+	{
+		// This breaks out of the pcap_dispatch() call that we're
+		// inside in the looper thread for this interface
+		pcap_breakloop(iface_context->pcap_handle);
+	}
+
+	// Wait for the looper to finish with the capture and relay
+	platform_join_thread(iface_context->looper_thread);
 }
 
-int pcap_deinit(void)
+// Compiles a capture filter, using a dead handle if there's no live one to compile against
+int compile_filter(pcap_t *pcap_handle, struct bpf_program *filter_code, const char *filter, unsigned int netmask)
 {
-	int i;
+	pcap_t *dead_handle;
+	int err;
 
-	for (i = 0; i < dev_count; i++)
+	dead_handle = NULL;
+	if (pcap_handle == NULL)
 	{
-		// Stop the looper for this interface
-		stop_pcap_looper(&interface_table[i]);
+		dead_handle = pcap_open_dead(DLT_EN10MB, proxy_config.capture_snaplen);
+		if (dead_handle == NULL)
+		{
+			printf("Failed to open filter compiler\n");
+			return -1;
+		}
+
+		pcap_handle = dead_handle;
+	}
+
+	err = pcap_compile(pcap_handle, filter_code, filter, 1, netmask);
+	if (err < 0)
+	{
+		printf("Failed to compile filter: %s\n", pcap_geterr(pcap_handle));
+	}
 
-		// Stop the pcap on this interface
-		udprelay_unregister(&interface_table[i].relay_context);
+	if (dead_handle != NULL)
+	{
+		pcap_close(dead_handle);
 	}
 
+	return err < 0 ? -1 : 0;
+}
+
+// Builds a filter that only passes traffic to or from this interface on one of our
+// ports, so the kernel drops everything else before it's copied to us
+int build_capture_filter(char *filter, size_t filter_size, struct in_addr iface_address)
+{
+	size_t length;
+	int i, err;
+
+	err = snprintf(filter, filter_size, "ip and udp and host %s and (", inet_ntoa(iface_address));
+	if (err < 0 || (size_t) err >= filter_size)
+		return -1;
+	length = err;
+
+	for (i = 0; i < (int) udp_port_count; i++)
+	{
+		// Both the Shield's packets and ours are sent to one of the relayed ports
+		err = snprintf(filter + length, filter_size - length, "%sdst port %d",
+			i == 0 ? "" : " or ", ntohs(udp_ports[i]));
+		if (err < 0 || (size_t) err >= filter_size - length)
+			return -1;
+		length += err;
+	}
+
+	// Only the first fragment has the ports, so the rest have to be let through too
+	if (proxy_config.reassembly_slots != 0)
+	{
+		err = snprintf(filter + length, filter_size - length, " or ip[6:2] & 0x1fff != 0");
+		if (err < 0 || (size_t) err >= filter_size - length)
+			return -1;
+		length += err;
+	}
+
+	if (length + 2 > filter_size)
+		return -1;
+	filter[length++] = ')';
+	filter[length] = 0;
+
 	return 0;
 }
 
-int pcap_reconfigure(void)
+// Compiles the filter for the interface's current address and ports
+int compile_capture_filter(struct interface_context *iface_context, struct bpf_program *filter_code)
+{
+	char filter[CAPTURE_FILTER_MAX];
+
+	if (build_capture_filter(filter, sizeof(filter), iface_context->iface_address) != 0)
+	{
+		printf("Capture filter is too long\n");
+		return -1;
+	}
+
+	return compile_filter(iface_context->pcap_handle, filter_code, filter, iface_context->netmask);
+}
+
+// Attaches the filter for the interface's address and ports to its capture. An address
+// change restarts the interface, so this runs again with the new address then.
+int update_capture_filter(struct interface_context *iface_context)
 {
+	struct bpf_program filter_code;
 	int err;
 
-	// This is a naive way of reconfiguring:
-	// just teardown and reinitialize the pcap infrastructure
+	err = compile_capture_filter(iface_context, &filter_code);
+	if (err < 0)
+		return -1;
 
-	err = pcap_deinit();
-	if (err != 0)
+#if defined(__linux__)
+	if (iface_context->use_ring)
 	{
-		printf("Failed to deinitialize pcap infrastructure\n");
+		err = tpacket_set_filter(&iface_context->ring, &filter_code);
+		pcap_freecode(&filter_code);
 		return err;
 	}
+#endif
 
-	err = pcap_init();
-	if (err != 0)
+	err = pcap_setfilter(iface_context->pcap_handle, &filter_code);
+	pcap_freecode(&filter_code);
+	if (err < 0)
 	{
-		printf("Failed to reinitialize pcap infrastructure\n");
-		return err;
+		printf("Failed to set filter\n");
+		return -1;
 	}
 
 	return 0;
 }
 
+// Opens a libpcap capture on the interface with its current buffer size. Returns 1
+// if the interface can't be used for capture but isn't an error.
+int open_pcap(struct interface_context *iface_context, const char *display_name)
+{
+	char errstr[PCAP_ERRBUF_SIZE];
+	pcap_t *pcap_handle;
+	int err;
 
-int pcap_init(void)
+	pcap_handle = pcap_create(iface_context->name, errstr);
+	if (pcap_handle == NULL)
+	{
+		printf("Unable to capture on interface: %s (%s)\n", display_name, errstr);
+		return 1;
+	}
+
+	// Packets are handed over as soon as they arrive instead of when the buffer fills
+	// or the timeout expires. The timeout only bounds how long a break takes.
+	pcap_set_snaplen(pcap_handle, proxy_config.capture_snaplen);
+	pcap_set_promisc(pcap_handle, 0);
+	pcap_set_timeout(pcap_handle, 1000);
+	pcap_set_buffer_size(pcap_handle, iface_context->buffer_size);
+#if !WIN32
+	pcap_set_immediate_mode(pcap_handle, 1);
+#endif
+
+	err = pcap_activate(pcap_handle);
+	if (err < 0)
+	{
+		printf("Unable to capture on interface: %s (%s)\n", display_name, pcap_geterr(pcap_handle));
+		pcap_close(pcap_handle);
+		return 1;
+	}
+
+#if WIN32
+	// WinPcap has no immediate mode, but copying every packet up straight away is the same
+	pcap_setmintocopy(pcap_handle, 0);
+#endif
+
+	iface_context->pcap_handle = pcap_handle;
+	iface_context->reported_drops = 0;
+
+	// We only handle Ethernet in this code, so exclude non-Ethernet interfaces
+	if (pcap_datalink(iface_context->pcap_handle) != DLT_EN10MB)
+	{
+		err = 1;
+		goto fail;
+	}
+
+	// Apply the filter for this interface
+	err = update_capture_filter(iface_context);
+	if (err < 0)
+	{
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	pcap_close(iface_context->pcap_handle);
+	iface_context->pcap_handle = NULL;
+	return err;
+}
+
+// Opens the capture for an interface with the filter applied. Returns 1 if the
+// interface can't be used for capture but isn't an error.
+int open_capture(struct interface_context *iface_context, pcap_if_t *dev)
+{
+	struct bpf_program filter_code;
+	int err;
+
+#if defined(__linux__)
+	if (proxy_config.capture_ring)
+	{
+		err = compile_capture_filter(iface_context, &filter_code);
+		if (err < 0)
+			return -1;
+
+		iface_context->use_ring = 1;
+		err = tpacket_open(&iface_context->ring,
+			dev->name,
+			proxy_config.ring_block_size,
+			proxy_config.ring_block_count,
+			proxy_config.ring_retire_ms,
+			&filter_code);
+		pcap_freecode(&filter_code);
+		if (err >= 0)
+			return err;
+
+		// The ring is only an optimization, so the interface is still worth capturing on
+		printf("Falling back to libpcap capture on interface: %s\n", device_display_name(dev));
+		iface_context->use_ring = 0;
+	}
+#endif
+
+	iface_context->buffer_size = proxy_config.capture_buffer_size;
+	return open_pcap(iface_context, device_display_name(dev));
+}
+
+void close_capture(struct interface_context *iface_context)
+{
+#if defined(__linux__)
+	if (iface_context->use_ring)
+	{
+		tpacket_close(&iface_context->ring);
+		return;
+	}
+#endif
+
+	if (iface_context->pcap_handle != NULL)
+	{
+		pcap_close(iface_context->pcap_handle);
+		iface_context->pcap_handle = NULL;
+	}
+}
+
+void free_interface(struct interface_context *iface_context)
+{
+	reassembly_destroy(&iface_context->reassembly);
+	txring_destroy(&iface_context->tx);
+	free(iface_context->name);
+	free(iface_context);
+}
+
+// Stops capturing and relaying on an interface. It must already be off the list.
+void stop_interface(struct interface_context *iface_context)
+{
+	stop_pcap_looper(iface_context);
+	if (iface_context->tx.slot_count != 0)
+		stop_sender(iface_context);
+	close_capture(iface_context);
+	udprelay_unregister(&iface_context->relay_context);
+
+	printf("Stopped listening on %s (%s)\n", iface_context->name, inet_ntoa(iface_context->iface_address));
+
+	free_interface(iface_context);
+}
+
+// Starts capturing and relaying on an interface. Returns NULL if the interface was skipped or failed.
+struct interface_context* start_interface(pcap_if_t *dev, struct in_addr iface_address, unsigned int netmask)
+{
+	struct interface_context *iface_context;
+	int err;
+
+	// Allocate a context that's initially zeroed
+	iface_context = (struct interface_context*)calloc(1, sizeof(*iface_context));
+	if (iface_context == NULL)
+	{
+		printf("Failed to allocate interface context\n");
+		return NULL;
+	}
+
+	iface_context->name = strdup(dev->name);
+	if (iface_context->name == NULL)
+	{
+		printf("Failed to allocate interface name\n");
+		free(iface_context);
+		return NULL;
+	}
+
+	iface_context->iface_address = iface_address;
+	iface_context->netmask = netmask;
+
+	err = reassembly_init(&iface_context->reassembly, proxy_config.reassembly_slots);
+	if (err == 0)
+		err = txring_init(&iface_context->tx, proxy_config.tx_ring_slots, proxy_config.tx_hugepages);
+	if (err != 0)
+	{
+		free_interface(iface_context);
+		return NULL;
+	}
+
+	// Open the capture with our filter applied
+	err = open_capture(iface_context, dev);
+	if (err != 0)
+	{
+		free_interface(iface_context);
+		return NULL;
+	}
+
+	// Notify the relay of the new interface
+	err = udprelay_register(&iface_context->relay_context, iface_address);
+	if (err < 0)
+	{
+		printf("Failed to register UDP relay\n");
+		goto fail;
+	}
+
+#if defined(__linux__)
+	// Ring frames stay put until the block is flushed and released
+	iface_context->relay_context.stable_buffers = iface_context->use_ring;
+#endif
+
+	// Sending from its own thread means a slow send can't hold up the capture
+	if (iface_context->tx.slot_count != 0)
+	{
+		// The ring's pool keeps the data put until the relay has flushed it
+		iface_context->relay_context.stable_buffers = 1;
+		err = platform_start_thread(pcap_sender_thread, iface_context, &iface_context->sender_thread);
+		if (err != 0)
+		{
+			printf("Unable to start send thread\n");
+			goto fail;
+		}
+	}
+
+	// Start the looper for this interface
+	err = start_pcap_looper(iface_context);
+	if (err != 0)
+	{
+		printf("Unable to start pcap looper\n");
+		if (iface_context->tx.slot_count != 0)
+			stop_sender(iface_context);
+		goto fail;
+	}
+
+	printf("Listening on %s (%s) for Shield traffic\n",
+		device_display_name(dev),
+		inet_ntoa(iface_address));
+
+	return iface_context;
+
+fail:
+	udprelay_unregister(&iface_context->relay_context);
+	close_capture(iface_context);
+	free_interface(iface_context);
+	return NULL;
+}
+
+// Finds the IPv4 address that we'd capture on for a device, returning 0 if it shouldn't be used
+int device_capture_address(pcap_if_t *dev, unsigned int *ip_table, unsigned int ip_table_len,
+	struct in_addr *iface_address, unsigned int *netmask)
+{
+	pcap_addr_t *cur_addr;
+	unsigned int j;
+
+	// Use the first valid IPv4 address
+	for (cur_addr = dev->addresses; cur_addr != NULL; cur_addr = cur_addr->next)
+	{
+		if (cur_addr->addr != NULL && cur_addr->addr->sa_family == AF_INET &&
+			((struct sockaddr_in *)cur_addr->addr)->sin_addr.s_addr != 0)
+		{
+			break;
+		}
+	}
+
+	// Skip interfaces without a valid IP address
+	if (cur_addr == NULL)
+		return 0;
+
+	*iface_address = ((struct sockaddr_in *)cur_addr->addr)->sin_addr;
+
+	// Check and make sure this is in our list from the OS API. If it's not,
+	// the interface is probably down.
+	for (j = 0; j < ip_table_len; j++)
+	{
+		if (iface_address->s_addr == ip_table[j])
+			break;
+	}
+
+	if (j == ip_table_len)
+		return 0;
+
+	if (cur_addr->netmask != NULL)
+		*netmask = ((struct sockaddr_in *)(cur_addr->netmask))->sin_addr.s_addr;
+	else
+		*netmask = PCAP_NETMASK_UNKNOWN;
+
+	return 1;
+}
+
+// Brings the interface list in line with the OS. Interfaces that didn't change
+// keep their capture, relay sockets and learned Shield ports.
+int sync_interfaces(void)
 {
 	int err;
 	char errstr[PCAP_ERRBUF_SIZE];
 	pcap_if_t *devices, *cur_dev;
-	int i;
-	unsigned int netmask;
-	struct bpf_program filter_code;
-	pcap_addr_t *cur_addr;
 	unsigned int ip_table[MAX_IP_COUNT];
-	unsigned int os_iftable_len, j;
+	unsigned int os_iftable_len;
+	struct interface_context *kept_list, *iface_context, **link;
+	struct in_addr iface_address;
+	unsigned int netmask;
 
 	// Get all IPs for local interfaces from the OS
 	os_iftable_len = MAX_IP_COUNT;
@@ -209,158 +878,214 @@ int pcap_init(void)
 		return err;
 	}
 
-	// Count them to allocate our interface table
-	dev_count = 0;
+	// Move each interface that's still valid from the live list to the kept list,
+	// starting any that are new or have a new address
+	kept_list = NULL;
 	for (cur_dev = devices; cur_dev != NULL; cur_dev = cur_dev->next)
-		dev_count++;
-
-	// Allocate an interface table that's initially zeroed
-	interface_table = (struct interface_context*)calloc(dev_count, sizeof(*interface_table));
-	if (interface_table == NULL)
 	{
-		printf("Failed to allocate interface table\n");
-		err = -1;
-		goto cleanup;
-	}
+		if (!device_capture_address(cur_dev, ip_table, os_iftable_len, &iface_address, &netmask))
+			continue;
 
-	// Open live pcaps for each interface
-	for (i = 0, cur_dev = devices; cur_dev != NULL; cur_dev = cur_dev->next, i++)
-	{
-		interface_table[i].pcap_handle = pcap_open_live(
-			cur_dev->name,
-			65536, // Packet max size
-			0, // Not promiscuous
-			1000, // Read timeout
-			errstr);
-		if (interface_table[i].pcap_handle == NULL)
+		for (link = &interface_list; *link != NULL; link = &(*link)->next)
 		{
-			printf("Unable to capture on interface: %s (%s)\n", cur_dev->description, errstr);
-			continue;
+			if (strcmp((*link)->name, cur_dev->name) == 0)
+				break;
 		}
 
-		// We only handle Ethernet in this code, so exclude non-Ethernet interfaces
-		if (pcap_datalink(interface_table[i].pcap_handle) != DLT_EN10MB)
+		iface_context = *link;
+		if (iface_context != NULL && iface_context->iface_address.s_addr == iface_address.s_addr)
 		{
-			goto skip_dev;
+			// Nothing changed, so leave it running
+			*link = iface_context->next;
 		}
-
-		//
-		// Save the IP address for later during packet processing
-		cur_addr = cur_dev->addresses;
-		while (cur_addr != NULL)
+		else
 		{
-			// Make sure it's an IPv4 address
-			if (cur_addr->addr->sa_family == AF_INET)
+			// The address changed, so the relay sockets need to be rebound
+			if (iface_context != NULL)
 			{
-				interface_table[i].iface_address = ((struct sockaddr_in *)cur_addr->addr)->sin_addr;
-				if (interface_table[i].iface_address.S_un.S_addr != 0)
-				{
-					// Found a valid IP address
-					break;
-				}
+				*link = iface_context->next;
+				stop_interface(iface_context);
 			}
 
-			cur_addr = cur_addr->next;
+			iface_context = start_interface(cur_dev, iface_address, netmask);
+			if (iface_context == NULL)
+				continue;
 		}
 
-		// Skip interfaces without a valid IP address
-		if (interface_table[i].iface_address.S_un.S_addr == 0)
-		{
-			goto skip_dev;
-		}
+		iface_context->next = kept_list;
+		kept_list = iface_context;
+	}
 
-		// Check and make sure this is in our list from the OS API
-		for (j = 0; j < os_iftable_len; j++)
-		{
-			if (interface_table[i].iface_address.S_un.S_addr == ip_table[j])
-				break;
-		}
+	pcap_freealldevs(devices);
 
-		// It's not in our list from the OS, which means it's probably down
-		if (j == os_iftable_len)
-		{
-			goto skip_dev;
-		}
+	// Anything left on the live list is gone or no longer usable
+	while (interface_list != NULL)
+	{
+		iface_context = interface_list;
+		interface_list = iface_context->next;
+		stop_interface(iface_context);
+	}
 
-		// Compile the filter
-		netmask = ((struct sockaddr_in *)(cur_dev->addresses->netmask))->sin_addr.S_un.S_addr;
-		err = pcap_compile(
-			interface_table[i].pcap_handle,
-			&filter_code,
-			"ip and udp",
-			1,
-			netmask);
-		if (err < 0)
-		{
-			printf("Failed to compile filter\n");
-			goto cleanup;
-		}
+	interface_list = kept_list;
 
-		// Set the filter and free the code
-		err = pcap_setfilter(interface_table[i].pcap_handle, &filter_code);
-		pcap_freecode(&filter_code);
-		if (err < 0)
-		{
-			printf("Failed to set filter\n");
-			goto cleanup;
-		}
+	return 0;
+}
 
-		// Notify the relay of the new interface
-		err = udprelay_register(
-			&interface_table[i].relay_context,
-			interface_table[i].iface_address);
-		if (err < 0)
-		{
-			printf("Failed to register UDP relay\n");
-			goto skip_dev;
-		}
+// Reopens a capture that's been dropping packets with twice the buffer. Returns -1
+// if the capture couldn't be reopened, leaving the interface without one.
+int grow_capture_buffer(struct interface_context *iface_context)
+{
+	unsigned int buffer_size;
 
-		printf("Listening on %s (%s) for Shield traffic\n",
-			cur_dev->description,
-			inet_ntoa(interface_table[i].iface_address));
+	buffer_size = iface_context->buffer_size * 2;
+	if (buffer_size > proxy_config.capture_buffer_max)
+		buffer_size = proxy_config.capture_buffer_max;
 
-		// Start the looper for this interface
-		err = platform_start_thread(pcap_looper_thread, &interface_table[i]);
-		if (err != 0)
-		{
-			printf("Unable to start pcap looper\n");
-			goto cleanup;
-		}
+	printf("Capture on %s is dropping packets, growing its buffer to %u KB\n",
+		iface_context->name, buffer_size / 1024);
+
+	// The relay, its sockets and the Shields' flows are left as they are
+	stop_pcap_looper(iface_context);
+	close_capture(iface_context);
 
-		// For the success case, go to the next iteration
-		continue;
+	iface_context->buffer_size = buffer_size;
+	PLATFORM_ATOMIC_STORE_UINT(&iface_context->grow_buffer, 0);
 
-	skip_dev:
-		// Close the device that we failed to capture on
-		pcap_close(interface_table[i].pcap_handle);
-		interface_table[i].pcap_handle = NULL;
-		err = 0;
+	if (open_pcap(iface_context, iface_context->name) != 0 || start_pcap_looper(iface_context) != 0)
+	{
+		printf("Failed to reopen capture on %s\n", iface_context->name);
+		close_capture(iface_context);
+		return -1;
 	}
 
-cleanup:
+	return 0;
+}
 
-	// Our device list is always OK to free here
-	pcap_freealldevs(devices);
+// Gives captures that have been dropping packets a bigger buffer
+void pcap_monitor_thread(void* param)
+{
+	struct interface_context *iface_context, **link;
 
-	// If we're here because something broke, we need to cleanup our table
-	if (err < 0)
+	for (;;)
 	{
-		if (interface_table != NULL)
+		platform_sleep_ms(CAPTURE_MONITOR_INTERVAL_MS);
+
+		platform_mutex_acquire(&interface_list_mutex);
+
+		link = &interface_list;
+		while (*link != NULL)
 		{
-			// Close each pcap handle that's still open
-			for (i = 0; i < dev_count; i++)
+			iface_context = *link;
+			if (PLATFORM_ATOMIC_LOAD_UINT(&iface_context->grow_buffer) &&
+				grow_capture_buffer(iface_context) != 0)
 			{
-				if (interface_table[i].pcap_handle != NULL)
-				{
-					pcap_close(interface_table[i].pcap_handle);
-				}
+				// Without a capture it's no use, until the next interface change brings it back
+				*link = iface_context->next;
+				stop_interface(iface_context);
+				continue;
 			}
 
-			// Free the interface table
-			free(interface_table);
-			interface_table = NULL;
+			link = &iface_context->next;
 		}
+
+		platform_mutex_release(&interface_list_mutex);
+	}
+}
+
+int pcap_init(void)
+{
+	interface_list = NULL;
+	platform_mutex_init(&interface_list_mutex);
+
+	if (platform_start_thread(pcap_monitor_thread, NULL, NULL) != 0)
+	{
+		printf("Failed to start capture monitor\n");
+		return -1;
+	}
+
+	return pcap_reconfigure(PLATFORM_IFACE_CHANGED, 0);
+}
+
+int pcap_reconfigure(int event, unsigned int address)
+{
+	struct interface_context *iface_context;
+	int err;
+
+	platform_mutex_acquire(&interface_list_mutex);
+
+	// Look for the address among the interfaces we're already using
+	for (iface_context = interface_list; iface_context != NULL; iface_context = iface_context->next)
+	{
+		if (iface_context->iface_address.s_addr == address)
+			break;
+	}
+
+	// Skip the device walk for changes that can't affect us. We don't capture
+	// on removed addresses that we weren't using, and added addresses that we're
+	// already using need no changes.
+	if ((event == PLATFORM_IFACE_ADDR_REMOVED && iface_context == NULL) ||
+		(event == PLATFORM_IFACE_ADDR_ADDED && iface_context != NULL))
+	{
+		platform_mutex_release(&interface_list_mutex);
+		return 0;
 	}
 
+	err = sync_interfaces();
+
+	platform_mutex_release(&interface_list_mutex);
+
 	return err;
+}
+
+void pcap_deinit(void)
+{
+	struct interface_context *iface_context;
+
+	platform_mutex_acquire(&interface_list_mutex);
+
+	while (interface_list != NULL)
+	{
+		iface_context = interface_list;
+		interface_list = iface_context->next;
+		stop_interface(iface_context);
+	}
+
+	platform_mutex_release(&interface_list_mutex);
+}
+
+void pcap_write_stats(struct stats_buffer *buffer)
+{
+	struct interface_context *iface_context;
+	unsigned int i;
+
+	// Holding the list keeps every context alive while we read its counters
+	platform_mutex_acquire(&interface_list_mutex);
+
+	for (i = 0; i < STATS_METRIC_COUNT(capture_metrics); i++)
+	{
+		stats_write_header(buffer, &capture_metrics[i]);
+		for (iface_context = interface_list; iface_context != NULL; iface_context = iface_context->next)
+		{
+			stats_write_sample(buffer, capture_metrics[i].name, iface_context->name, 0,
+				STATS_COUNTER(iface_context, &capture_metrics[i]));
+		}
+	}
+
+	for (i = 0; i < udprelay_metric_count; i++)
+	{
+		stats_write_header(buffer, &udprelay_metrics[i]);
+		for (iface_context = interface_list; iface_context != NULL; iface_context = iface_context->next)
+		{
+			udprelay_write_samples(buffer, &udprelay_metrics[i], iface_context->name,
+				&iface_context->relay_context);
+		}
+	}
+
+	stats_write_summary_header(buffer, &udprelay_latency_metric);
+	for (iface_context = interface_list; iface_context != NULL; iface_context = iface_context->next)
+	{
+		udprelay_write_latency(buffer, iface_context->name, &iface_context->relay_context);
+	}
+
+	platform_mutex_release(&interface_list_mutex);
 }
\ No newline at end of file
@@ -1,16 +1,82 @@
 #pragma once
 
 typedef void (*thread_start_function)(void* parameter);
-typedef void (*reconfigure_callback_function)(void);
 
+// Interface change events passed to the reconfigure callback
+#define PLATFORM_IFACE_ADDR_ADDED 1 // The address was added to a usable interface
+#define PLATFORM_IFACE_ADDR_REMOVED 2 // The address was removed
+#define PLATFORM_IFACE_CHANGED 3 // Something else changed, the address table must be requeried
+
+typedef void (*reconfigure_callback_function)(int event, unsigned int address);
+
+// One datagram of a batched send or receive. For receives, length is the
+// size of the buffer going in and the size of the datagram coming out, and
+// timestamp is when the kernel received it (wall clock microseconds) if the
+// socket has timestamps enabled, or 0. truncated is set if the datagram didn't
+// fit in the buffer and was cut short. Sends on a connected socket may leave
+// the address NULL.
+struct platform_datagram {
+	struct sockaddr_in *addr;
+	char *data;
+	unsigned int length;
+	unsigned long long timestamp;
+	int truncated;
+};
 
 int platform_init(void);
 void platform_cleanup(void);
 int platform_last_error(void);
-int platform_start_thread(thread_start_function thread_start, void* thread_parameter);
+int platform_error_is_transient(int error);
+
+// The thread handle is optional. Threads started without one can't be joined.
+int platform_start_thread(thread_start_function thread_start, void* thread_parameter, PLATFORM_THREAD *thread);
+void platform_join_thread(PLATFORM_THREAD thread);
+
 int platform_iface_ip_table(unsigned int *ip_table, unsigned int *ip_table_len);
 int platform_notify_iface_change(reconfigure_callback_function callback);
+unsigned long long platform_time_us(void);
+
+// Wall clock microseconds, comparable with capture and kernel receive timestamps
+unsigned long long platform_wall_time_us(void);
+void platform_sleep_ms(unsigned int ms);
+
+// Returns the number of datagrams sent before the first failure, or -1 if none were sent
+int platform_send_batch(SOCKET s, struct platform_datagram *datagrams, unsigned int count);
+
+// Blocks until at least one datagram arrives, then returns as many as are queued (up to count) or -1
+int platform_recv_batch(SOCKET s, struct platform_datagram *datagrams, unsigned int count);
+
+// Turns on segmentation offload for platform_send_segmented(), returning -1 if
+// the platform doesn't have it
+int platform_enable_segmentation(SOCKET s);
+
+// Sends a run of datagrams to the first one's address as a single super-packet
+// that's split back up by the kernel or NIC. Every datagram must be the first
+// one's length except the last, which may be shorter. Returns count, 0 if
+// datagrams this long can't be segmented on the socket's path (usually they
+// don't fit its MTU), or -1 on any other failure.
+int platform_send_segmented(SOCKET s, struct platform_datagram *datagrams, unsigned int count);
+
+// Marks everything sent on the socket with a DSCP value and, where the platform
+// has one, a priority for the host's own queues. Returns -1 if either was refused.
+int platform_set_traffic_class(SOCKET s, int dscp, int priority);
+
+// Has the kernel stamp each datagram received on the socket, returning -1 if it can't
+int platform_enable_timestamps(SOCKET s);
 
 void platform_mutex_init(PLATFORM_MUTEX *mutex);
 void platform_mutex_acquire(PLATFORM_MUTEX *mutex);
-void platform_mutex_release(PLATFORM_MUTEX *mutex);
\ No newline at end of file
+void platform_mutex_release(PLATFORM_MUTEX *mutex);
+
+// Wakes one waiter, or the next thread to wait if nobody is waiting yet. Extra
+// sets may cause spurious wakeups, but none are lost.
+void platform_event_init(PLATFORM_EVENT *event);
+void platform_event_destroy(PLATFORM_EVENT *event);
+void platform_event_set(PLATFORM_EVENT *event);
+void platform_event_wait(PLATFORM_EVENT *event);
+
+// Allocates memory that's already faulted in, from huge pages if asked for and the
+// system has them (the size must then be a multiple of the huge page size). Returns
+// NULL on failure.
+void *platform_alloc_pool(size_t size, int huge_pages);
+void platform_free_pool(void *pool, size_t size);
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include "shieldrelay.h"
+
+// Fields of the IPv4 header, by byte offset
+#define IPV4_TOTAL_LENGTH 2
+#define IPV4_ID 4
+#define IPV4_FLAGS_FRAGOFF 6
+#define IPV4_PROTOCOL 9
+#define IPV4_CHECKSUM 10
+#define IPV4_SRC_ADDR 12
+#define IPV4_DST_ADDR 16
+
+#define IPV4_MORE_FRAGMENTS 0x2000
+#define IPV4_FRAGMENT_OFFSET 0x1FFF
+
+static unsigned short read_u16(const unsigned char *field)
+{
+	return (unsigned short) ((field[0] << 8) | field[1]);
+}
+
+static unsigned int read_addr(const unsigned char *field)
+{
+	unsigned int addr;
+
+	memcpy(&addr, field, sizeof(addr));
+	return addr;
+}
+
+int reassembly_init(struct reassembly_table *table, unsigned int slot_count)
+{
+	unsigned int i;
+
+	memset(table, 0, sizeof(*table));
+	if (slot_count == 0)
+		return 0;
+
+	table->slots = (struct reassembly_slot *) calloc(slot_count, sizeof(*table->slots));
+	table->slab = (unsigned char *) malloc((size_t) slot_count * REASSEMBLY_MAX_DATAGRAM);
+	if (table->slots == NULL || table->slab == NULL)
+	{
+		printf("Failed to allocate fragment reassembly pool\n");
+		reassembly_destroy(table);
+		return -1;
+	}
+
+	for (i = 0; i < slot_count; i++)
+	{
+		table->slots[i].datagram = table->slab + (size_t) i * REASSEMBLY_MAX_DATAGRAM;
+	}
+
+	table->slot_count = slot_count;
+	return 0;
+}
+
+void reassembly_destroy(struct reassembly_table *table)
+{
+	free(table->slots);
+	free(table->slab);
+	table->slots = NULL;
+	table->slab = NULL;
+	table->slot_count = 0;
+}
+
+static void reset_slot(struct reassembly_slot *slot)
+{
+	slot->in_use = 0;
+	slot->complete = 0;
+	slot->payload_length = 0;
+	slot->received_units = 0;
+	slot->header_seen = 0;
+	memset(slot->units, 0, sizeof(slot->units));
+}
+
+// Finds the datagram a fragment belongs to, starting a new one if it's the first
+// we've seen. Stale datagrams are dropped along the way, and if the pool is full the
+// oldest one makes room.
+static struct reassembly_slot *find_slot(struct reassembly_table *table, const unsigned char *header,
+	unsigned long long now, unsigned long long timeout)
+{
+	struct reassembly_slot *slot, *match, *free_slot, *oldest;
+	unsigned int src_addr, dst_addr, i;
+	unsigned short id;
+
+	src_addr = read_addr(header + IPV4_SRC_ADDR);
+	dst_addr = read_addr(header + IPV4_DST_ADDR);
+	id = read_u16(header + IPV4_ID);
+
+	match = free_slot = oldest = NULL;
+	for (i = 0; i < table->slot_count; i++)
+	{
+		slot = &table->slots[i];
+
+		// Datagrams that were handed out are waiting for the relay to flush
+		if (slot->complete)
+			continue;
+
+		if (slot->in_use && now - slot->first_seen > timeout)
+		{
+			table->evictions++;
+			reset_slot(slot);
+		}
+
+		if (!slot->in_use)
+		{
+			if (free_slot == NULL)
+				free_slot = slot;
+			continue;
+		}
+
+		if (slot->src_addr == src_addr && slot->dst_addr == dst_addr &&
+			slot->id == id && slot->protocol == header[IPV4_PROTOCOL])
+		{
+			match = slot;
+		}
+		else if (oldest == NULL || slot->first_seen < oldest->first_seen)
+		{
+			oldest = slot;
+		}
+	}
+
+	if (match != NULL)
+		return match;
+
+	if (free_slot == NULL)
+	{
+		if (oldest == NULL)
+			return NULL;
+
+		table->evictions++;
+		reset_slot(oldest);
+		free_slot = oldest;
+	}
+
+	free_slot->in_use = 1;
+	free_slot->src_addr = src_addr;
+	free_slot->dst_addr = dst_addr;
+	free_slot->id = id;
+	free_slot->protocol = header[IPV4_PROTOCOL];
+	free_slot->first_seen = now;
+	return free_slot;
+}
+
+unsigned char *reassembly_add(struct reassembly_table *table, const unsigned char *header,
+	const unsigned char *payload, unsigned int payload_length, unsigned long long now,
+	unsigned long long timeout, unsigned int *length)
+{
+	struct reassembly_slot *slot;
+	unsigned int flags_fragoff, offset, unit, last_unit;
+	unsigned char *datagram;
+
+	table->fragments++;
+
+	flags_fragoff = read_u16(header + IPV4_FLAGS_FRAGOFF);
+	offset = (flags_fragoff & IPV4_FRAGMENT_OFFSET) * 8;
+
+	// Every fragment but the last must end on a unit, and none may run past the largest datagram
+	if (((flags_fragoff & IPV4_MORE_FRAGMENTS) && (payload_length % 8) != 0) ||
+		offset + payload_length > REASSEMBLY_MAX_DATAGRAM - REASSEMBLY_HEADER_SIZE)
+	{
+		return NULL;
+	}
+
+	slot = find_slot(table, header, now, timeout);
+	if (slot == NULL)
+		return NULL;
+
+	memcpy(slot->datagram + REASSEMBLY_HEADER_SIZE + offset, payload, payload_length);
+
+	last_unit = (offset + payload_length + 7) / 8;
+	for (unit = offset / 8; unit < last_unit; unit++)
+	{
+		if (!(slot->units[unit / 8] & (1 << (unit % 8))))
+		{
+			slot->units[unit / 8] |= (unsigned char) (1 << (unit % 8));
+			slot->received_units++;
+		}
+	}
+
+	if (offset == 0)
+	{
+		memcpy(slot->datagram, header, REASSEMBLY_HEADER_SIZE);
+		slot->header_seen = 1;
+	}
+
+	if (!(flags_fragoff & IPV4_MORE_FRAGMENTS))
+		slot->payload_length = offset + payload_length;
+
+	if (!slot->header_seen || slot->payload_length == 0 ||
+		slot->received_units != (slot->payload_length + 7) / 8)
+	{
+		return NULL;
+	}
+
+	// It's whole, so make the header describe the full datagram without options
+	datagram = slot->datagram;
+	*length = REASSEMBLY_HEADER_SIZE + slot->payload_length;
+	datagram[0] = 0x45;
+	datagram[IPV4_TOTAL_LENGTH] = (unsigned char) (*length >> 8);
+	datagram[IPV4_TOTAL_LENGTH + 1] = (unsigned char) *length;
+	datagram[IPV4_FLAGS_FRAGOFF] = datagram[IPV4_FLAGS_FRAGOFF + 1] = 0;
+	datagram[IPV4_CHECKSUM] = datagram[IPV4_CHECKSUM + 1] = 0;
+
+	slot->complete = 1;
+	table->completed++;
+	table->reassembled++;
+	return datagram;
+}
+
+void reassembly_release(struct reassembly_table *table)
+{
+	unsigned int i;
+
+	for (i = 0; i < table->slot_count && table->completed != 0; i++)
+	{
+		if (table->slots[i].complete)
+		{
+			reset_slot(&table->slots[i]);
+			table->completed--;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+
+// Largest IPv4 datagram, header included
+#define REASSEMBLY_MAX_DATAGRAM 65535
+
+// Reassembled datagrams get a plain 20 byte header, whatever options the first fragment had
+#define REASSEMBLY_HEADER_SIZE 20
+
+// Fragment offsets count 8 byte units, so that's what arrivals are tracked in
+#define REASSEMBLY_UNITS ((REASSEMBLY_MAX_DATAGRAM + 7) / 8)
+
+// A datagram being put back together in its own slab from the pool
+struct reassembly_slot {
+	int in_use;
+
+	// Handed back to the caller, so it stays put until reassembly_release()
+	int complete;
+
+	// Fragments belong together if all of these match
+	unsigned int src_addr;
+	unsigned int dst_addr;
+	unsigned short id;
+	unsigned char protocol;
+
+	unsigned long long first_seen;
+
+	// Known once the last fragment is in, otherwise 0
+	unsigned int payload_length;
+
+	// Which units have arrived, so overlapping fragments aren't counted twice
+	unsigned int received_units;
+	unsigned char units[(REASSEMBLY_UNITS + 7) / 8];
+	int header_seen;
+
+	unsigned char *datagram;
+};
+
+// Fragments seen by one capture thread. Memory is reserved up front and never grows,
+// so a flood of fragments can only evict other partial datagrams.
+struct reassembly_table {
+	unsigned int slot_count;
+	struct reassembly_slot *slots;
+	unsigned char *slab;
+
+	// Datagrams handed out since the last release
+	unsigned int completed;
+
+	unsigned long long fragments;
+	unsigned long long reassembled;
+	unsigned long long evictions;
+};
+
+int reassembly_init(struct reassembly_table *table, unsigned int slot_count);
+void reassembly_destroy(struct reassembly_table *table);
+
+// Adds a fragment, given its IPv4 header and payload. Once every fragment is in,
+// returns the whole datagram with an unfragmented header, otherwise NULL. The
+// datagram stays valid until reassembly_release().
+unsigned char *reassembly_add(struct reassembly_table *table, const unsigned char *header,
+	const unsigned char *payload, unsigned int payload_length, unsigned long long now,
+	unsigned long long timeout, unsigned int *length);
+
+// Returns the slabs of every datagram handed out so far to the pool
+void reassembly_release(struct reassembly_table *table);
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #if WIN32
 #include "win_plat.h"
+#elif defined(__linux__)
+#include "linux_plat.h"
 #else
 #error "Unsupported platform"
 #endif
@@ -13,15 +15,76 @@
 
 // Components of the relay
 #include "platform.h"
+#include "stats.h"
+#include "latency.h"
 #include "mdns.h"
+#include "mdnscache.h"
+#include "flowtable.h"
+#include "reassembly.h"
+#include "txring.h"
 #include "udprelay.h"
+#include "tcprelay.h"
+#include "config.h"
 
 // Compile-time relay config
 #define MDNS_RELAY_PORT 5354
 
+// Largest frame libpcap captures. This is libpcap's own default, which fits the largest
+// IPv4 datagram with its link headers, so jumbo frames and the PC's GSO super-packets
+// come through whole.
+#define CAPTURE_SNAPLEN 262144
+
+// libpcap capture buffer, doubled whenever the kernel drops packets until it reaches the max
+#define CAPTURE_BUFFER_SIZE (4 * 1024 * 1024)
+#define CAPTURE_BUFFER_MAX (64 * 1024 * 1024)
+
+// How often each capture's drop counters are read, and how often a capture that's
+// dropping is given a bigger buffer
+#define CAPTURE_DROP_CHECK_INTERVAL_US 1000000
+#define CAPTURE_MONITOR_INTERVAL_MS 1000
+
+// Longest capture filter expression we'll generate
+#define CAPTURE_FILTER_MAX 1024
+
+// Capture ring defaults, overridable at runtime
+#if defined(__linux__)
+#define CAPTURE_RING_DEFAULT 1
+#else
+#define CAPTURE_RING_DEFAULT 0
+#endif
+#define CAPTURE_RING_BLOCK_SIZE (256 * 1024)
+#define CAPTURE_RING_BLOCK_COUNT 64
+#define CAPTURE_RING_RETIRE_MS 1
+
+// Most worker threads the reactor engine runs
+#define ENGINE_MAX_WORKERS 16
+
+// How long a forwarded datagram may wait for its batch to fill
+#define UDPRELAY_BATCH_DEADLINE_US 250
+
+// Captured datagrams that can wait for each interface's send thread
+#define TXRING_SLOTS 1024
+
+// Fragmented datagrams that can be reassembled at once on each interface, each
+// reserving REASSEMBLY_MAX_DATAGRAM bytes, and how long one may wait for its fragments
+#define REASSEMBLY_SLOTS 16
+#define REASSEMBLY_TIMEOUT_MS 250
+
+// Seconds a Shield may go without sending to us before its flows are dropped
+#define UDPRELAY_FLOW_IDLE_TIMEOUT 60
+
+// How often idle flows are looked for
+#define UDPRELAY_FLOW_EXPIRY_INTERVAL_US 1000000
+
 // Version string
 #define VERSION_STR "v0.5"
 
 // PCAP code
 int pcap_init(void);
-int pcap_reconfigure(void);
\ No newline at end of file
+void pcap_deinit(void);
+int pcap_reconfigure(int event, unsigned int address);
+void pcap_write_stats(struct stats_buffer *buffer);
+
+// Socket proxy (Linux only)
+int sockproxy_init(void);
+void sockproxy_write_stats(struct stats_buffer *buffer);
\ No newline at end of file
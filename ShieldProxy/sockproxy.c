@@ -0,0 +1,505 @@
+#include "shieldrelay.h"
+
+// In socket proxy mode the Shield streams to this host, which owns the relayed
+// UDP ports. Each port has its unconnected relay socket, which the Shields send
+// to, and each Shield gets its own upstream socket connected to the streaming PC
+// from a port of its own. The PC answers whichever port a Shield's traffic came
+// from, so its replies arrive on that Shield's socket and go back to that Shield.
+// One thread per port waits on all of its sockets.
+
+#include <sys/epoll.h>
+
+// Shields streaming through one port at once
+#define SOCKPROXY_MAX_FLOWS 16
+
+// How often quiet Shields are looked for, even when nothing arrives
+#define SOCKPROXY_EXPIRY_INTERVAL_MS 1000
+
+// What goes between the Shields and the PC
+struct sockproxy_stats {
+	unsigned long long target_packets;
+	unsigned long long target_bytes;
+	unsigned long long target_send_errors;
+	unsigned long long flows_opened;
+	unsigned long long flows_closed;
+	unsigned long long truncated_packets;
+};
+
+static const struct stats_metric sockproxy_metrics[] = {
+	{ "shieldproxy_proxy_target_packets_total", "Datagrams from the Shields sent on to the target",
+		offsetof(struct sockproxy_stats, target_packets) },
+	{ "shieldproxy_proxy_target_bytes_total", "Bytes from the Shields sent on to the target",
+		offsetof(struct sockproxy_stats, target_bytes) },
+	{ "shieldproxy_proxy_target_send_errors_total", "Datagrams that failed to send to the target",
+		offsetof(struct sockproxy_stats, target_send_errors) },
+	{ "shieldproxy_proxy_flows_opened_total", "Upstream sockets opened for a Shield",
+		offsetof(struct sockproxy_stats, flows_opened) },
+	{ "shieldproxy_proxy_flows_closed_total", "Upstream sockets closed after their Shield went quiet or made way",
+		offsetof(struct sockproxy_stats, flows_closed) },
+	{ "shieldproxy_proxy_truncated_packets_total", "Datagrams too big for the receive buffers, which aren't relayed",
+		offsetof(struct sockproxy_stats, truncated_packets) },
+};
+
+// A Shield and the socket that carries its traffic to and from the PC
+struct sockproxy_flow {
+	SOCKET upstream;
+	unsigned int client_addr;
+	unsigned short client_port;
+	unsigned long long last_seen;
+};
+
+struct sockproxy_port {
+	struct udprelay_port_context *port_context;
+	int epoll_fd;
+
+	// Only the port's thread touches these
+	struct sockproxy_flow flows[SOCKPROXY_MAX_FLOWS];
+	unsigned int flow_count;
+	struct sockproxy_stats stats;
+};
+
+static struct udprelay_adapter_context relay_context;
+static struct sockproxy_port proxy_ports[UDPRELAY_MAX_PORTS];
+
+// Marks the relay socket in epoll events, the flows use their index
+#define SOCKPROXY_RELAY_EVENT SOCKPROXY_MAX_FLOWS
+
+static void prepare_receive(struct platform_datagram *datagrams, struct sockaddr_in *addrs, char *buffers)
+{
+	int i;
+
+	for (i = 0; i < UDPRELAY_BATCH_MAX; i++)
+	{
+		datagrams[i].addr = &addrs[i];
+		datagrams[i].data = buffers + (i * UDPRELAY_SLOT_SIZE);
+		datagrams[i].length = UDPRELAY_SLOT_SIZE;
+	}
+}
+
+// Opens a socket connected to the PC on the port's destination, from a port the kernel picks
+static SOCKET open_upstream(struct sockproxy_port *port)
+{
+	struct sockaddr_in addr;
+	SOCKET s;
+
+	// It doesn't block, so a wakeup meant for a flow that has since closed does no harm
+	s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (s == -1)
+	{
+		printf("Failed to create UDP upstream socket (%d)\n", platform_last_error());
+		return -1;
+	}
+
+	if (proxy_config.latency_timestamps && platform_enable_timestamps(s) != 0)
+	{
+		printf("Failed to enable receive timestamps (%d)\n", platform_last_error());
+		closesocket(s);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = port->port_context->dst_port;
+	addr.sin_addr.s_addr = proxy_config.target;
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+	{
+		printf("Failed to connect UDP upstream socket (%d)\n", platform_last_error());
+		closesocket(s);
+		return -1;
+	}
+
+	return s;
+}
+
+// Closes a flow's socket and moves the last flow into its slot
+static void close_flow(struct sockproxy_port *port, unsigned int index)
+{
+	struct sockproxy_flow *flow;
+	struct epoll_event event;
+	struct in_addr client;
+
+	flow = &port->flows[index];
+	client.s_addr = flow->client_addr;
+	printf("No longer proxying UDP %d for %s:%d\n", ntohs(port->port_context->dst_port),
+		inet_ntoa(client), ntohs(flow->client_port));
+
+	epoll_ctl(port->epoll_fd, EPOLL_CTL_DEL, flow->upstream, NULL);
+	closesocket(flow->upstream);
+	port->stats.flows_closed++;
+
+	port->flow_count--;
+	if (index != port->flow_count)
+	{
+		*flow = port->flows[port->flow_count];
+
+		// Events for the moved socket have to carry its new index
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.u32 = index;
+		epoll_ctl(port->epoll_fd, EPOLL_CTL_MOD, flow->upstream, &event);
+	}
+}
+
+// Finds the Shield's flow, opening one if it's new. Like the relay's flow table, a Shield
+// is known by its address and keeps its flow when it moves to a new source port.
+// Returns NULL if the flow can't be opened.
+static struct sockproxy_flow *find_flow(struct sockproxy_port *port, struct sockaddr_in *addr,
+	unsigned long long now)
+{
+	struct sockproxy_flow *flow;
+	struct epoll_event event;
+	unsigned int i, oldest;
+	SOCKET upstream;
+
+	for (i = 0; i < port->flow_count; i++)
+	{
+		flow = &port->flows[i];
+		if (flow->client_addr == addr->sin_addr.s_addr)
+		{
+			flow->client_port = addr->sin_port;
+			flow->last_seen = now;
+			return flow;
+		}
+	}
+
+	// When it's full, the Shield heard from longest ago makes way
+	if (port->flow_count == SOCKPROXY_MAX_FLOWS)
+	{
+		oldest = 0;
+		for (i = 1; i < port->flow_count; i++)
+		{
+			if (port->flows[i].last_seen < port->flows[oldest].last_seen)
+				oldest = i;
+		}
+
+		close_flow(port, oldest);
+	}
+
+	upstream = open_upstream(port);
+	if (upstream == -1)
+		return NULL;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = port->flow_count;
+	if (epoll_ctl(port->epoll_fd, EPOLL_CTL_ADD, upstream, &event) == -1)
+	{
+		printf("Failed to watch UDP upstream socket (%d)\n", errno);
+		closesocket(upstream);
+		return NULL;
+	}
+
+	flow = &port->flows[port->flow_count++];
+	flow->upstream = upstream;
+	flow->client_addr = addr->sin_addr.s_addr;
+	flow->client_port = addr->sin_port;
+	flow->last_seen = now;
+	port->stats.flows_opened++;
+
+	printf("Proxying UDP %d for %s:%d\n", ntohs(port->port_context->dst_port),
+		inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+	return flow;
+}
+
+static void expire_flows(struct sockproxy_port *port, unsigned long long now)
+{
+	unsigned long long timeout;
+	unsigned int i;
+
+	timeout = (unsigned long long) proxy_config.flow_idle_timeout * 1000000;
+	i = 0;
+	while (i < port->flow_count)
+	{
+		if (now - port->flows[i].last_seen >= timeout)
+			close_flow(port, i);
+		else
+			i++;
+	}
+}
+
+// Sends a run of datagrams to one flow's upstream socket, which is connected so no address is needed
+static void send_upstream(struct sockproxy_port *port, struct sockproxy_flow *flow,
+	struct platform_datagram *datagrams, unsigned int count)
+{
+	unsigned int sent, i;
+	int err;
+
+	for (i = 0; i < count; i++)
+	{
+		datagrams[i].addr = NULL;
+	}
+
+	sent = 0;
+	while (sent < count)
+	{
+		err = platform_send_batch(flow->upstream, &datagrams[sent], count - sent);
+		if (err < 0)
+		{
+			// Drop the datagram that failed and keep going with the rest
+			printf("Failed to send UDP packet (%d)\n", platform_last_error());
+			port->stats.target_send_errors++;
+			sent++;
+		}
+		else
+		{
+			for (i = sent; i < sent + err; i++)
+			{
+				port->stats.target_packets++;
+				port->stats.target_bytes += datagrams[i].length;
+			}
+			sent += err;
+		}
+	}
+}
+
+// Shield to PC. Returns -1 if the relay socket is unusable.
+static int proxy_downstream(struct sockproxy_port *port, struct platform_datagram *datagrams,
+	struct sockaddr_in *addrs, char *buffers)
+{
+	struct sockproxy_flow *flow, *run_flow;
+	unsigned long long now;
+	unsigned int run_start;
+	int count, err, i, j;
+
+	prepare_receive(datagrams, addrs, buffers);
+
+	count = platform_recv_batch(port->port_context->socket, datagrams, UDPRELAY_BATCH_MAX);
+	if (count < 0)
+	{
+		err = platform_last_error();
+		if (platform_error_is_transient(err))
+			return 0;
+
+		printf("Socket proxy receive failed (%d)\n", err);
+		return -1;
+	}
+
+	now = platform_time_us();
+
+	// Datagrams in a row from the same Shield go out in one batch
+	run_flow = NULL;
+	run_start = 0;
+	j = 0;
+	for (i = 0; i < count; i++)
+	{
+		// The PC only talks to us through the upstream sockets
+		if (addrs[i].sin_addr.s_addr == proxy_config.target)
+			continue;
+
+		// Relaying part of a datagram would only hand the PC garbage
+		if (datagrams[i].truncated)
+		{
+			port->stats.truncated_packets++;
+			continue;
+		}
+
+		udprelay_reconfigure(&relay_context, addrs[i].sin_addr.s_addr, addrs[i].sin_port,
+			port->port_context->dst_port, datagrams[i].length);
+
+		// A new Shield can close or move other flows, so the run so far goes out first
+		if (run_flow != NULL && run_flow->client_addr != addrs[i].sin_addr.s_addr)
+		{
+			send_upstream(port, run_flow, &datagrams[run_start], j - run_start);
+			run_flow = NULL;
+		}
+
+		flow = find_flow(port, &addrs[i], now);
+		if (flow == NULL)
+			continue;
+
+		if (run_flow == NULL)
+		{
+			run_flow = flow;
+			run_start = j;
+		}
+
+		datagrams[j++] = datagrams[i];
+	}
+
+	if (run_flow != NULL)
+		send_upstream(port, run_flow, &datagrams[run_start], j - run_start);
+
+	return 0;
+}
+
+// PC to the Shield that owns the flow. Returns -1 if the socket is unusable.
+static int proxy_upstream(struct sockproxy_port *port, struct sockproxy_flow *flow,
+	struct platform_datagram *datagrams, struct sockaddr_in *addrs, char *buffers)
+{
+	unsigned long long now;
+	int count, err, i;
+
+	prepare_receive(datagrams, addrs, buffers);
+
+	count = platform_recv_batch(flow->upstream, datagrams, UDPRELAY_BATCH_MAX);
+	if (count < 0)
+	{
+		err = platform_last_error();
+		if (platform_error_is_transient(err))
+			return 0;
+
+		printf("Socket proxy receive failed (%d)\n", err);
+		return -1;
+	}
+
+	// Without kernel timestamps the delay is measured from when we got the batch
+	now = platform_wall_time_us();
+
+	// The buffers stay put until the flush below, so the relay queues them without copying
+	for (i = 0; i < count; i++)
+	{
+		if (datagrams[i].truncated)
+		{
+			port->stats.truncated_packets++;
+			continue;
+		}
+
+		udprelay_forward(&relay_context, flow->client_addr, port->port_context->dst_port,
+			datagrams[i].data, datagrams[i].length,
+			datagrams[i].timestamp != 0 ? datagrams[i].timestamp : now);
+	}
+
+	udprelay_flush_port(port->port_context);
+	return 0;
+}
+
+static void sockproxy_port_thread(void *param)
+{
+	struct sockproxy_port *port = (struct sockproxy_port *) param;
+	struct platform_datagram datagrams[UDPRELAY_BATCH_MAX];
+	struct sockaddr_in addrs[UDPRELAY_BATCH_MAX];
+	struct epoll_event events[SOCKPROXY_MAX_FLOWS + 1];
+	unsigned long long next_expiry, now;
+	unsigned int index;
+	char *buffers;
+	int count, i;
+
+	buffers = (char *) malloc(UDPRELAY_BATCH_MAX * UDPRELAY_SLOT_SIZE);
+	if (buffers == NULL)
+	{
+		printf("Failed to allocate socket proxy buffers\n");
+		return;
+	}
+
+	next_expiry = 0;
+	for (;;)
+	{
+		count = epoll_wait(port->epoll_fd, events, SOCKPROXY_MAX_FLOWS + 1, SOCKPROXY_EXPIRY_INTERVAL_MS);
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			printf("Socket proxy wait failed (%d)\n", errno);
+			break;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			index = events[i].data.u32;
+			if (index == SOCKPROXY_RELAY_EVENT)
+			{
+				if (proxy_downstream(port, datagrams, addrs, buffers) != 0)
+					goto cleanup;
+			}
+			else if (index < port->flow_count)
+			{
+				// A flow that closed earlier in this batch may have another in its slot now,
+				// whose socket just comes up empty if it has nothing waiting
+				if (proxy_upstream(port, &port->flows[index], datagrams, addrs, buffers) != 0)
+					close_flow(port, index);
+			}
+		}
+
+		now = platform_time_us();
+		if (now >= next_expiry)
+		{
+			expire_flows(port, now);
+			udprelay_expire_port(port->port_context, now);
+			next_expiry = now + SOCKPROXY_EXPIRY_INTERVAL_MS * 1000ULL;
+		}
+	}
+
+cleanup:
+	free(buffers);
+}
+
+int sockproxy_init(void)
+{
+	struct epoll_event event;
+	struct in_addr any, target;
+	int err, i;
+
+	if (proxy_config.target == 0)
+	{
+		printf("The socket proxy needs a --target\n");
+		return -1;
+	}
+
+	// Forwarded datagrams always go out from here, and the receive buffers outlive each flush
+	relay_context.owns_ports = 1;
+	relay_context.stable_buffers = 1;
+
+	any.s_addr = htonl(INADDR_ANY);
+	err = udprelay_register(&relay_context, any);
+	if (err != 0)
+	{
+		return err;
+	}
+
+	for (i = 0; i < (int) udp_port_count; i++)
+	{
+		proxy_ports[i].port_context = &relay_context.ports[i];
+		proxy_ports[i].flow_count = 0;
+
+		proxy_ports[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (proxy_ports[i].epoll_fd == -1)
+		{
+			printf("Failed to create socket proxy epoll set (%d)\n", errno);
+			return -1;
+		}
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.u32 = SOCKPROXY_RELAY_EVENT;
+		if (epoll_ctl(proxy_ports[i].epoll_fd, EPOLL_CTL_ADD, relay_context.ports[i].socket, &event) == -1)
+		{
+			printf("Failed to watch UDP relay socket (%d)\n", errno);
+			return -1;
+		}
+
+		err = platform_start_thread(sockproxy_port_thread, &proxy_ports[i], NULL);
+		if (err != 0)
+		{
+			return err;
+		}
+	}
+
+	target.s_addr = proxy_config.target;
+	printf("Proxying %u UDP ports to %s\n", udp_port_count, inet_ntoa(target));
+	return 0;
+}
+
+void sockproxy_write_stats(struct stats_buffer *buffer)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < STATS_METRIC_COUNT(sockproxy_metrics); i++)
+	{
+		stats_write_header(buffer, &sockproxy_metrics[i]);
+		for (j = 0; j < udp_port_count; j++)
+		{
+			stats_write_sample(buffer, sockproxy_metrics[i].name, NULL, ntohs(udp_ports[j]),
+				STATS_COUNTER(&proxy_ports[j].stats, &sockproxy_metrics[i]));
+		}
+	}
+
+	for (i = 0; i < udprelay_metric_count; i++)
+	{
+		stats_write_header(buffer, &udprelay_metrics[i]);
+		udprelay_write_samples(buffer, &udprelay_metrics[i], "socket", &relay_context);
+	}
+
+	stats_write_summary_header(buffer, &udprelay_latency_metric);
+	udprelay_write_latency(buffer, "socket", &relay_context);
+}
\ No newline at end of file
@@ -0,0 +1,346 @@
+#include "shieldrelay.h"
+
+#include <stdarg.h>
+
+#if defined(__linux__)
+#include <sys/un.h>
+#endif
+
+// First allocation for the metrics text and the most it may grow to
+#define STATS_BUFFER_SIZE 16384
+#define STATS_BUFFER_MAX (16 * 1024 * 1024)
+
+// How long a client gets to send its request before we reply anyway
+#define STATS_REQUEST_TIMEOUT_MS 100
+
+#define STATS_RESPONSE_HEADER \
+	"HTTP/1.0 200 OK\r\n" \
+	"Content-Type: text/plain; version=0.0.4\r\n" \
+	"Connection: close\r\n" \
+	"\r\n"
+
+void stats_printf(struct stats_buffer *buffer, const char *format, ...)
+{
+	va_list args;
+	unsigned int remaining, capacity;
+	char *data;
+	int length;
+
+	if (buffer->failed)
+		return;
+
+	for (;;)
+	{
+		remaining = buffer->capacity - buffer->length;
+		if (remaining != 0)
+		{
+			va_start(args, format);
+			length = vsnprintf(buffer->data + buffer->length, remaining, format, args);
+			va_end(args);
+
+			// Older CRTs return -1 instead of the length when the text doesn't fit
+			if (length >= 0 && (unsigned int) length < remaining)
+			{
+				buffer->length += length;
+				return;
+			}
+		}
+
+		capacity = buffer->capacity != 0 ? buffer->capacity * 2 : STATS_BUFFER_SIZE;
+		data = capacity <= STATS_BUFFER_MAX ? (char *) realloc(buffer->data, capacity) : NULL;
+		if (data == NULL)
+		{
+			printf("Failed to allocate stats buffer\n");
+			buffer->failed = 1;
+			return;
+		}
+
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+}
+
+void stats_write_header(struct stats_buffer *buffer, const struct stats_metric *metric)
+{
+	stats_printf(buffer, "# HELP %s %s\n# TYPE %s counter\n", metric->name, metric->help, metric->name);
+}
+
+void stats_write_summary_header(struct stats_buffer *buffer, const struct stats_metric *metric)
+{
+	stats_printf(buffer, "# HELP %s %s\n# TYPE %s summary\n", metric->name, metric->help, metric->name);
+}
+
+// Writes the name and whichever labels are set
+static void write_name(struct stats_buffer *buffer, const char *name, const char *iface,
+	unsigned int port, const char *quantile)
+{
+	const char *separator, *c;
+
+	stats_printf(buffer, "%s", name);
+
+	separator = "{";
+	if (iface != NULL)
+	{
+		// Windows device names are full of backslashes, which must be escaped
+		stats_printf(buffer, "%sinterface=\"", separator);
+		for (c = iface; *c != 0; c++)
+		{
+			if (*c == '\\' || *c == '"')
+				stats_printf(buffer, "\\%c", *c);
+			else if (*c != '\n')
+				stats_printf(buffer, "%c", *c);
+		}
+		stats_printf(buffer, "\"");
+		separator = ",";
+	}
+
+	if (port != 0)
+	{
+		stats_printf(buffer, "%sport=\"%u\"", separator, port);
+		separator = ",";
+	}
+
+	if (quantile != NULL)
+	{
+		stats_printf(buffer, "%squantile=\"%s\"", separator, quantile);
+		separator = ",";
+	}
+
+	if (*separator == ',')
+		stats_printf(buffer, "}");
+}
+
+void stats_write_sample(struct stats_buffer *buffer, const char *name, const char *iface,
+	unsigned int port, unsigned long long value)
+{
+	write_name(buffer, name, iface, port, NULL);
+	stats_printf(buffer, " %llu\n", value);
+}
+
+void stats_write_quantile(struct stats_buffer *buffer, const char *name, const char *iface,
+	unsigned int port, const char *quantile, unsigned long long value)
+{
+	write_name(buffer, name, iface, port, quantile);
+	stats_printf(buffer, " %llu\n", value);
+}
+
+static void write_stats(struct stats_buffer *buffer)
+{
+	mdns_write_stats(buffer);
+
+#if defined(__linux__)
+	if (proxy_config.socket_proxy)
+	{
+		sockproxy_write_stats(buffer);
+		return;
+	}
+#endif
+
+	pcap_write_stats(buffer);
+}
+
+// We don't care what was asked for, but reading the request first keeps the
+// client from seeing a reset when we close with unread data
+static void read_request(SOCKET client)
+{
+	char request[STATS_REQUEST_MAX];
+	struct timeval timeout;
+	fd_set read_set;
+	int length, err;
+
+	length = 0;
+	while (length < (int) sizeof(request) - 1)
+	{
+		FD_ZERO(&read_set);
+		FD_SET(client, &read_set);
+		timeout.tv_sec = 0;
+		timeout.tv_usec = STATS_REQUEST_TIMEOUT_MS * 1000;
+		if (select((int) client + 1, &read_set, NULL, NULL, &timeout) <= 0)
+			break;
+
+		err = recv(client, request + length, sizeof(request) - 1 - length, 0);
+		if (err <= 0)
+			break;
+		length += err;
+
+		// The blank line ends the headers
+		request[length] = 0;
+		if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+			break;
+	}
+}
+
+static void serve_client(SOCKET client)
+{
+	struct stats_buffer buffer;
+	unsigned int sent;
+	int err;
+
+	read_request(client);
+
+	memset(&buffer, 0, sizeof(buffer));
+	stats_printf(&buffer, STATS_RESPONSE_HEADER);
+	write_stats(&buffer);
+
+	if (!buffer.failed)
+	{
+		sent = 0;
+		while (sent < buffer.length)
+		{
+			err = send(client, buffer.data + sent, buffer.length - sent, 0);
+			if (err <= 0)
+				break;
+			sent += err;
+		}
+	}
+
+	free(buffer.data);
+}
+
+static void stats_thread(void *param)
+{
+	SOCKET listener = (SOCKET) (size_t) param;
+	SOCKET client;
+	int err;
+
+	for (;;)
+	{
+		client = accept(listener, NULL, NULL);
+		if (client == -1)
+		{
+			err = platform_last_error();
+			if (platform_error_is_transient(err))
+				continue;
+
+			printf("Stats listener failed (%d)\n", err);
+			break;
+		}
+
+		// Scrapes are rare and quick, so one at a time is plenty
+		serve_client(client);
+		closesocket(client);
+	}
+
+	closesocket(listener);
+}
+
+// Takes ownership of the listening socket
+static int start_listener(SOCKET listener, struct sockaddr *addr, int addr_length)
+{
+	int err;
+
+	err = bind(listener, addr, addr_length);
+	if (err == -1)
+	{
+		printf("Failed to bind stats socket (%d)\n", platform_last_error());
+		closesocket(listener);
+		return -1;
+	}
+
+	err = listen(listener, 8);
+	if (err == -1)
+	{
+		printf("Failed to listen on stats socket (%d)\n", platform_last_error());
+		closesocket(listener);
+		return -1;
+	}
+
+	err = platform_start_thread(stats_thread, (void *) (size_t) listener, NULL);
+	if (err != 0)
+	{
+		printf("Failed to start stats thread\n");
+		closesocket(listener);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int start_tcp_listener(void)
+{
+	struct sockaddr_in addr;
+	SOCKET listener;
+	int opt;
+
+	listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener == -1)
+	{
+		printf("Failed to create stats socket (%d)\n", platform_last_error());
+		return -1;
+	}
+
+	// Restarts shouldn't have to wait out old connections
+	opt = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (char *) &opt, sizeof(opt));
+
+	// Only local scrapers get to see the stats
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short) proxy_config.stats_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (start_listener(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		return -1;
+
+	printf("Serving stats on http://127.0.0.1:%u/metrics\n", proxy_config.stats_port);
+	return 0;
+}
+
+#if defined(__linux__)
+static int start_unix_listener(void)
+{
+	struct sockaddr_un addr;
+	SOCKET listener;
+
+	if (strlen(proxy_config.stats_socket) >= sizeof(addr.sun_path))
+	{
+		printf("Stats socket path is too long\n");
+		return -1;
+	}
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == -1)
+	{
+		printf("Failed to create stats socket (%d)\n", platform_last_error());
+		return -1;
+	}
+
+	// A socket left behind by an earlier run would make the bind fail
+	unlink(proxy_config.stats_socket);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, proxy_config.stats_socket);
+
+	if (start_listener(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		return -1;
+
+	printf("Serving stats on %s\n", proxy_config.stats_socket);
+	return 0;
+}
+#endif
+
+int stats_init(void)
+{
+	int err;
+
+	if (proxy_config.stats_port != 0)
+	{
+		err = start_tcp_listener();
+		if (err != 0)
+			return err;
+	}
+
+	if (proxy_config.stats_socket != NULL)
+	{
+#if defined(__linux__)
+		err = start_unix_listener();
+		if (err != 0)
+			return err;
+#else
+		printf("The stats socket is only available on Linux\n");
+#endif
+	}
+
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+// Default stats listeners, overridable at runtime (0 or no path leaves them off)
+#define STATS_PORT 0
+
+// Longest request we read before replying
+#define STATS_REQUEST_MAX 1024
+
+// Metrics text is built up in one of these before it's sent
+struct stats_buffer {
+	char *data;
+	unsigned int length;
+	unsigned int capacity;
+	int failed;
+};
+
+// One counter, found at an offset into whatever struct holds it. Each counter
+// struct is only written by the thread that owns its interface, port or socket,
+// so counting needs no lock or atomic. Readers may see a slightly stale count.
+struct stats_metric {
+	const char *name;
+	const char *help;
+	size_t offset;
+};
+
+#define STATS_METRIC_COUNT(metrics) (sizeof(metrics) / sizeof((metrics)[0]))
+#define STATS_COUNTER(base, metric) (*(unsigned long long *)((char *)(base) + (metric)->offset))
+
+void stats_printf(struct stats_buffer *buffer, const char *format, ...);
+void stats_write_header(struct stats_buffer *buffer, const struct stats_metric *metric);
+void stats_write_summary_header(struct stats_buffer *buffer, const struct stats_metric *metric);
+
+// Writes name{interface="iface",port="port"} value, leaving out the interface if
+// it's NULL and the port if it's 0
+void stats_write_sample(struct stats_buffer *buffer, const char *name, const char *iface,
+	unsigned int port, unsigned long long value);
+
+// The same with a quantile label, for summaries
+void stats_write_quantile(struct stats_buffer *buffer, const char *name, const char *iface,
+	unsigned int port, const char *quantile, unsigned long long value);
+
+// Starts serving Prometheus text on the configured TCP port and Unix socket
+int stats_init(void);
\ No newline at end of file
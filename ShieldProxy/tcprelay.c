@@ -0,0 +1,441 @@
+#include "shieldrelay.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+
+struct tcprelay_connection;
+
+// What an epoll event points at. Listeners have no connection.
+struct tcprelay_endpoint {
+	int fd;
+	unsigned short port;
+	struct tcprelay_connection *conn;
+};
+
+// One direction of a connection. Data moves from the source socket into the
+// pipe and from the pipe into the destination socket without being copied to us.
+struct tcprelay_direction {
+	int pipe_fds[2];
+	unsigned int pending;
+	int eof;
+	int shut;
+	unsigned long long bytes;
+};
+
+// Index 0 is the Shield's side and index 1 is the target's side. Direction 0
+// carries data from the Shield to the target and direction 1 the reverse.
+struct tcprelay_connection {
+	struct tcprelay_connection *next;
+	struct tcprelay_endpoint ends[2];
+	struct tcprelay_direction dirs[2];
+	unsigned int pipe_size;
+	int connected;
+	struct in_addr client_addr;
+};
+
+static int epoll_fd = -1;
+static struct tcprelay_endpoint listeners[UDPRELAY_MAX_PORTS];
+static unsigned int listener_count;
+
+// Connections that were closed while handling the current batch of events
+static struct tcprelay_connection *closed_connections;
+
+static void set_socket_options(int fd)
+{
+	int opt;
+
+	if (proxy_config.tcp_nodelay)
+	{
+		opt = 1;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1)
+		{
+			printf("Failed to set TCP_NODELAY (%d)\n", errno);
+		}
+	}
+
+	if (proxy_config.tcp_buffer_size != 0)
+	{
+		opt = (int) proxy_config.tcp_buffer_size;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1 ||
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1)
+		{
+			printf("Failed to set TCP buffer size (%d)\n", errno);
+		}
+	}
+}
+
+static void close_connection(struct tcprelay_connection *conn)
+{
+	int i;
+
+	if (conn->ends[0].fd == -1)
+	{
+		// Already closed during this batch
+		return;
+	}
+
+	printf("TCP %d connection from %s closed (%llu bytes to the target, %llu bytes to the Shield)\n",
+		ntohs(conn->ends[0].port), inet_ntoa(conn->client_addr), conn->dirs[0].bytes, conn->dirs[1].bytes);
+
+	// Closing the sockets takes them out of the epoll set
+	for (i = 0; i < 2; i++)
+	{
+		if (conn->ends[i].fd != -1)
+		{
+			close(conn->ends[i].fd);
+			conn->ends[i].fd = -1;
+		}
+
+		if (conn->dirs[i].pipe_fds[0] != -1)
+		{
+			close(conn->dirs[i].pipe_fds[0]);
+			close(conn->dirs[i].pipe_fds[1]);
+			conn->dirs[i].pipe_fds[0] = -1;
+			conn->dirs[i].pipe_fds[1] = -1;
+		}
+	}
+
+	// Events later in this batch may still point at it
+	conn->next = closed_connections;
+	closed_connections = conn;
+}
+
+// Moves as much data as the sockets allow in one direction, returning -1 if the connection failed
+static int pump(struct tcprelay_connection *conn, int d)
+{
+	struct tcprelay_direction *dir = &conn->dirs[d];
+	int src = conn->ends[d].fd;
+	int dst = conn->ends[1 - d].fd;
+	ssize_t n;
+	int progress;
+
+	do
+	{
+		progress = 0;
+
+		// Don't ask for more than the pipe can hold so EAGAIN means the socket is drained
+		if (!dir->eof && dir->pending < conn->pipe_size)
+		{
+			n = splice(src, NULL, dir->pipe_fds[1], NULL, conn->pipe_size - dir->pending,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0)
+			{
+				dir->pending += (unsigned int) n;
+				progress = 1;
+			}
+			else if (n == 0)
+			{
+				dir->eof = 1;
+			}
+			else if (errno != EAGAIN && errno != EINTR)
+			{
+				return -1;
+			}
+		}
+
+		if (dir->pending != 0)
+		{
+			n = splice(dir->pipe_fds[0], NULL, dst, NULL, dir->pending,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0)
+			{
+				dir->pending -= (unsigned int) n;
+				dir->bytes += n;
+				progress = 1;
+			}
+			else if (n < 0 && errno != EAGAIN && errno != EINTR)
+			{
+				return -1;
+			}
+		}
+	} while (progress);
+
+	// Pass the half close along once everything before it was delivered
+	if (dir->eof && dir->pending == 0 && !dir->shut)
+	{
+		shutdown(dst, SHUT_WR);
+		dir->shut = 1;
+	}
+
+	return 0;
+}
+
+static void handle_connection_event(struct tcprelay_endpoint *endpoint)
+{
+	struct tcprelay_connection *conn = endpoint->conn;
+	socklen_t length;
+	int err;
+
+	if (conn->ends[0].fd == -1)
+	{
+		return;
+	}
+
+	if (!conn->connected)
+	{
+		// The Shield may send before the target answers, we'll pick that up once connected
+		if (endpoint != &conn->ends[1])
+			return;
+
+		length = sizeof(err);
+		if (getsockopt(endpoint->fd, SOL_SOCKET, SO_ERROR, &err, &length) == -1)
+			err = errno;
+		if (err == EINPROGRESS || err == EALREADY)
+			return;
+		if (err != 0)
+		{
+			printf("Failed to connect to TCP target (%d)\n", err);
+			close_connection(conn);
+			return;
+		}
+
+		conn->connected = 1;
+	}
+
+	if (pump(conn, 0) != 0 || pump(conn, 1) != 0)
+	{
+		close_connection(conn);
+		return;
+	}
+
+	if (conn->dirs[0].shut && conn->dirs[1].shut)
+	{
+		close_connection(conn);
+	}
+}
+
+static int watch(struct tcprelay_endpoint *endpoint, unsigned int events)
+{
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.ptr = endpoint;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, endpoint->fd, &event) == -1)
+	{
+		printf("Failed to watch TCP socket (%d)\n", errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int open_pipe(struct tcprelay_direction *dir, unsigned int *pipe_size)
+{
+	int size;
+
+	if (pipe2(dir->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1)
+	{
+		printf("Failed to create TCP relay pipe (%d)\n", errno);
+		dir->pipe_fds[0] = -1;
+		dir->pipe_fds[1] = -1;
+		return -1;
+	}
+
+	// Bigger pipes let more data move per splice(), but they're capped by /proc/sys/fs/pipe-max-size
+	if (proxy_config.tcp_pipe_size != 0 &&
+		fcntl(dir->pipe_fds[0], F_SETPIPE_SZ, (int) proxy_config.tcp_pipe_size) == -1)
+	{
+		printf("Failed to resize TCP relay pipe (%d)\n", errno);
+	}
+
+	size = fcntl(dir->pipe_fds[0], F_GETPIPE_SZ);
+	if (size > 0 && (*pipe_size == 0 || (unsigned int) size < *pipe_size))
+		*pipe_size = (unsigned int) size;
+
+	return 0;
+}
+
+static void accept_connections(struct tcprelay_endpoint *listener)
+{
+	struct tcprelay_connection *conn;
+	struct sockaddr_in addr;
+	socklen_t addr_length;
+	int fd, i;
+
+	for (;;)
+	{
+		addr_length = sizeof(addr);
+		fd = accept4(listener->fd, (struct sockaddr *) &addr, &addr_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1)
+		{
+			if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+				printf("Failed to accept TCP connection (%d)\n", errno);
+			return;
+		}
+
+		conn = (struct tcprelay_connection *) malloc(sizeof(*conn));
+		if (conn == NULL)
+		{
+			printf("Failed to allocate TCP connection\n");
+			close(fd);
+			continue;
+		}
+
+		memset(conn, 0, sizeof(*conn));
+		conn->client_addr = addr.sin_addr;
+		for (i = 0; i < 2; i++)
+		{
+			conn->ends[i].conn = conn;
+			conn->ends[i].port = listener->port;
+			conn->dirs[i].pipe_fds[0] = -1;
+			conn->dirs[i].pipe_fds[1] = -1;
+		}
+		conn->ends[0].fd = fd;
+
+		printf("TCP %d connection from %s\n", ntohs(listener->port), inet_ntoa(conn->client_addr));
+
+		conn->ends[1].fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+		if (conn->ends[1].fd == -1)
+		{
+			printf("Failed to create TCP socket (%d)\n", errno);
+			close_connection(conn);
+			continue;
+		}
+
+		if (open_pipe(&conn->dirs[0], &conn->pipe_size) != 0 ||
+			open_pipe(&conn->dirs[1], &conn->pipe_size) != 0)
+		{
+			close_connection(conn);
+			continue;
+		}
+
+		set_socket_options(conn->ends[0].fd);
+		set_socket_options(conn->ends[1].fd);
+
+		// Connect to the same port on the target
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = listener->port;
+		addr.sin_addr.s_addr = proxy_config.target;
+		if (connect(conn->ends[1].fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 && errno != EINPROGRESS)
+		{
+			printf("Failed to connect to TCP target (%d)\n", errno);
+			close_connection(conn);
+			continue;
+		}
+
+		// Edge triggered, so every wakeup must drain what it can
+		if (watch(&conn->ends[0], EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) != 0 ||
+			watch(&conn->ends[1], EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) != 0)
+		{
+			close_connection(conn);
+			continue;
+		}
+	}
+}
+
+static void tcprelay_thread(void *context)
+{
+	struct epoll_event events[TCPRELAY_EVENT_MAX];
+	struct tcprelay_endpoint *endpoint;
+	struct tcprelay_connection *conn;
+	int count, i;
+
+	for (;;)
+	{
+		count = epoll_wait(epoll_fd, events, TCPRELAY_EVENT_MAX, -1);
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			printf("TCP relay wait failed (%d)\n", errno);
+			return;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			endpoint = (struct tcprelay_endpoint *) events[i].data.ptr;
+			if (endpoint->conn == NULL)
+				accept_connections(endpoint);
+			else
+				handle_connection_event(endpoint);
+		}
+
+		// Nothing refers to these anymore
+		while (closed_connections != NULL)
+		{
+			conn = closed_connections;
+			closed_connections = conn->next;
+			free(conn);
+		}
+	}
+}
+
+static int open_listener(struct tcprelay_endpoint *listener, unsigned short port)
+{
+	struct sockaddr_in bindaddr;
+	int opt;
+
+	listener->conn = NULL;
+	listener->port = port;
+	listener->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (listener->fd == -1)
+	{
+		printf("Failed to create TCP listening socket (%d)\n", errno);
+		return -1;
+	}
+
+	opt = 1;
+	setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	memset(&bindaddr, 0, sizeof(bindaddr));
+	bindaddr.sin_family = AF_INET;
+	bindaddr.sin_port = port;
+	bindaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(listener->fd, (struct sockaddr *) &bindaddr, sizeof(bindaddr)) == -1)
+	{
+		printf("Failed to bind TCP %d (%d)\n", ntohs(port), errno);
+		close(listener->fd);
+		return -1;
+	}
+
+	if (listen(listener->fd, TCPRELAY_BACKLOG) == -1)
+	{
+		printf("Failed to listen on TCP %d (%d)\n", ntohs(port), errno);
+		close(listener->fd);
+		return -1;
+	}
+
+	return watch(listener, EPOLLIN);
+}
+
+int tcprelay_init(void)
+{
+	struct in_addr target;
+	unsigned int i, port;
+
+	if (proxy_config.target == 0)
+	{
+		return 0;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1)
+	{
+		printf("Failed to create TCP relay epoll (%d)\n", errno);
+		return -1;
+	}
+
+	for (i = 0; i < proxy_config.tcp_ports.count; i++)
+	{
+		port = proxy_config.tcp_ports.values[i] + proxy_config.port_offset;
+		if (port > 65535)
+		{
+			printf("TCP port %u is out of range\n", port);
+			return -1;
+		}
+
+		if (open_listener(&listeners[listener_count], htons((unsigned short) port)) != 0)
+		{
+			return -1;
+		}
+		listener_count++;
+	}
+
+	target.s_addr = proxy_config.target;
+	printf("Relaying %u TCP ports to %s\n", listener_count, inet_ntoa(target));
+
+	return platform_start_thread(tcprelay_thread, NULL, NULL);
+}
\ No newline at end of file
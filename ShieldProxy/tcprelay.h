@@ -0,0 +1,15 @@
+#pragma once
+
+// Default Shield TCP ports
+#define SHIELD_TCP_PORTS 5
+#define SHIELD_TCP_PORT_LIST 35043, 47989, 47991, 47995, 47996
+
+// Most epoll events handled per wakeup
+#define TCPRELAY_EVENT_MAX 64
+
+// Backlog for each listening socket
+#define TCPRELAY_BACKLOG 16
+
+// Listens on the TCP ports and relays connections to the configured target (Linux only).
+// Does nothing if no target was given.
+int tcprelay_init(void);
\ No newline at end of file
@@ -0,0 +1,240 @@
+#include "tpacket.h"
+
+#include <poll.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+// Only used by the kernel to size the frame count, TPACKET_V3 packs frames of any size
+#define TPACKET_FRAME_SIZE 2048
+
+// How often a blocked loop checks whether it was asked to stop
+#define TPACKET_POLL_TIMEOUT_MS 100
+
+int tpacket_set_filter(struct tpacket_ring *ring, struct bpf_program *filter)
+{
+	struct sock_fprog prog;
+
+	// The classic BPF instructions from pcap_compile() are laid out exactly like sock_filter
+	prog.len = (unsigned short) filter->bf_len;
+	prog.filter = (struct sock_filter *) filter->bf_insns;
+
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+	{
+		printf("Failed to attach capture filter (%d)\n", errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+int tpacket_open(struct tpacket_ring *ring, const char *ifname, unsigned int block_size,
+	unsigned int block_count, unsigned int retire_ms, struct bpf_program *filter)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll bindaddr;
+	struct ifreq ifr;
+	unsigned int page_size;
+	int version;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->map = MAP_FAILED;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name) - 1);
+
+	// Don't take any traffic until the filter is attached and we're bound to the interface
+	ring->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (ring->fd == -1)
+	{
+		printf("Failed to create packet socket (%d)\n", errno);
+		return -1;
+	}
+
+	// We only handle Ethernet framing
+	if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) == -1 || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+	{
+		tpacket_close(ring);
+		return 1;
+	}
+
+	if (ioctl(ring->fd, SIOCGIFINDEX, &ifr) == -1)
+	{
+		printf("Failed to get interface index (%d)\n", errno);
+		goto fail;
+	}
+
+	version = TPACKET_V3;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+	{
+		printf("TPACKET_V3 is not supported (%d)\n", errno);
+		goto fail;
+	}
+
+	// Blocks must be a power of two number of pages
+	page_size = (unsigned int) sysconf(_SC_PAGESIZE);
+	ring->block_size = page_size;
+	while (ring->block_size < block_size)
+		ring->block_size <<= 1;
+	ring->block_count = block_count;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = ring->block_size;
+	req.tp_block_nr = ring->block_count;
+	req.tp_frame_size = TPACKET_FRAME_SIZE;
+	req.tp_frame_nr = (ring->block_size / TPACKET_FRAME_SIZE) * ring->block_count;
+	req.tp_retire_blk_tov = retire_ms;
+	req.tp_feature_req_word = 0;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1)
+	{
+		printf("Failed to create capture ring (%d)\n", errno);
+		goto fail;
+	}
+
+	ring->map_length = ring->block_size * ring->block_count;
+	ring->map = (unsigned char *) mmap(NULL, ring->map_length, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_LOCKED | MAP_POPULATE, ring->fd, 0);
+	if (ring->map == MAP_FAILED)
+	{
+		// Locking can fail under RLIMIT_MEMLOCK, which is only an optimization
+		ring->map = (unsigned char *) mmap(NULL, ring->map_length, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+		if (ring->map == MAP_FAILED)
+		{
+			printf("Failed to map capture ring (%d)\n", errno);
+			goto fail;
+		}
+	}
+
+	if (tpacket_set_filter(ring, filter) != 0)
+	{
+		goto fail;
+	}
+
+	// Start receiving traffic from this interface
+	memset(&bindaddr, 0, sizeof(bindaddr));
+	bindaddr.sll_family = AF_PACKET;
+	bindaddr.sll_protocol = htons(ETH_P_ALL);
+	bindaddr.sll_ifindex = ifr.ifr_ifindex;
+	if (bind(ring->fd, (struct sockaddr *) &bindaddr, sizeof(bindaddr)) == -1)
+	{
+		printf("Failed to bind packet socket (%d)\n", errno);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tpacket_close(ring);
+	return -1;
+}
+
+// Walks every block that the kernel has retired to us, returning the number of frames handled
+int tpacket_dispatch(struct tpacket_ring *ring, pcap_handler handler, tpacket_block_function block_done, u_char *param)
+{
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *frame;
+	struct pcap_pkthdr header;
+	unsigned int i, count;
+
+	count = 0;
+	for (;;)
+	{
+		block = (struct tpacket_block_desc *)(ring->map + (ring->current_block * ring->block_size));
+
+		// Stop at the first block that's still owned by the kernel
+		if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+			break;
+
+		frame = (struct tpacket3_hdr *)((unsigned char *) block + block->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < block->hdr.bh1.num_pkts; i++)
+		{
+			header.ts.tv_sec = frame->tp_sec;
+			header.ts.tv_usec = frame->tp_nsec / 1000;
+			header.caplen = frame->tp_snaplen;
+			header.len = frame->tp_len;
+
+			// The handler works directly on the ring memory
+			handler(param, &header, (unsigned char *) frame + frame->tp_mac);
+
+			frame = (struct tpacket3_hdr *)((unsigned char *) frame + frame->tp_next_offset);
+		}
+
+		count += block->hdr.bh1.num_pkts;
+
+		if (block_done != NULL)
+			block_done(param);
+
+		// Give the block back to the kernel
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		ring->current_block = (ring->current_block + 1) % ring->block_count;
+
+		if (ring->break_loop)
+			break;
+	}
+
+	return count;
+}
+
+int tpacket_loop(struct tpacket_ring *ring, pcap_handler handler, tpacket_block_function block_done, u_char *param)
+{
+	struct pollfd pfd;
+	int err;
+
+	pfd.fd = ring->fd;
+	pfd.events = POLLIN | POLLERR;
+
+	while (!ring->break_loop)
+	{
+		tpacket_dispatch(ring, handler, block_done, param);
+
+		// Sleep until the kernel retires another block
+		pfd.revents = 0;
+		err = poll(&pfd, 1, TPACKET_POLL_TIMEOUT_MS);
+		if (err < 0 && errno != EINTR)
+		{
+			printf("Failed to poll capture ring (%d)\n", errno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void tpacket_breakloop(struct tpacket_ring *ring)
+{
+	ring->break_loop = 1;
+}
+
+int tpacket_drops(struct tpacket_ring *ring, unsigned int *drops)
+{
+	struct tpacket_stats_v3 stats;
+	socklen_t length;
+
+	// Reading the statistics resets them
+	length = sizeof(stats);
+	if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &length) == -1)
+		return -1;
+
+	*drops = stats.tp_drops;
+	return 0;
+}
+
+void tpacket_close(struct tpacket_ring *ring)
+{
+	if (ring->map != MAP_FAILED && ring->map != NULL)
+	{
+		munmap(ring->map, ring->map_length);
+		ring->map = MAP_FAILED;
+	}
+
+	if (ring->fd != -1)
+	{
+		close(ring->fd);
+		ring->fd = -1;
+	}
+}
\ No newline at end of file
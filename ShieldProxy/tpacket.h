@@ -0,0 +1,32 @@
+#pragma once
+
+#include "shieldrelay.h"
+
+#include "pcap.h"
+
+// A TPACKET_V3 receive ring on one interface. Frames are handed to the
+// packet handler in place while their block is still owned by userspace.
+struct tpacket_ring {
+	int fd;
+	unsigned char *map;
+	unsigned int map_length;
+	unsigned int block_size;
+	unsigned int block_count;
+	unsigned int current_block;
+	volatile int break_loop;
+};
+
+// Called after every frame of a block has been handled, before the block goes back to the kernel
+typedef void (*tpacket_block_function)(u_char *param);
+
+// Returns 1 if the interface isn't Ethernet and should be skipped
+int tpacket_open(struct tpacket_ring *ring, const char *ifname, unsigned int block_size,
+	unsigned int block_count, unsigned int retire_ms, struct bpf_program *filter);
+int tpacket_set_filter(struct tpacket_ring *ring, struct bpf_program *filter);
+int tpacket_dispatch(struct tpacket_ring *ring, pcap_handler handler, tpacket_block_function block_done, u_char *param);
+int tpacket_loop(struct tpacket_ring *ring, pcap_handler handler, tpacket_block_function block_done, u_char *param);
+void tpacket_breakloop(struct tpacket_ring *ring);
+
+// Returns how many packets the kernel dropped for a full ring since the last call, or -1
+int tpacket_drops(struct tpacket_ring *ring, unsigned int *drops);
+void tpacket_close(struct tpacket_ring *ring);
\ No newline at end of file
@@ -0,0 +1,152 @@
+#include "shieldrelay.h"
+
+int txring_init(struct txring *ring, unsigned int slot_count, int huge_pages)
+{
+	memset(ring, 0, sizeof(*ring));
+	if (slot_count == 0)
+		return 0;
+
+	if (slot_count < TXRING_MIN_SLOTS || slot_count > TXRING_MAX_SLOTS ||
+		(slot_count & (slot_count - 1)) != 0)
+	{
+		printf("The send ring must have a power of two slots from %d to %d\n",
+			TXRING_MIN_SLOTS, TXRING_MAX_SLOTS);
+		return -1;
+	}
+
+	ring->pool_size = slot_count * TXRING_SLOT_BYTES;
+	if (huge_pages && ring->pool_size < TXRING_HUGE_PAGE_SIZE)
+		ring->pool_size = TXRING_HUGE_PAGE_SIZE;
+
+	// Everything is faulted in now rather than on the first burst
+	ring->entries = (struct txring_entry *) calloc(slot_count, sizeof(*ring->entries));
+	ring->pool = (char *) platform_alloc_pool(ring->pool_size, huge_pages);
+	if (ring->entries == NULL || ring->pool == NULL)
+	{
+		printf("Failed to allocate send ring\n");
+		txring_destroy(ring);
+		return -1;
+	}
+
+	platform_event_init(&ring->wakeup);
+	ring->slot_count = slot_count;
+	return 0;
+}
+
+void txring_destroy(struct txring *ring)
+{
+	if (ring->slot_count != 0)
+		platform_event_destroy(&ring->wakeup);
+
+	free(ring->entries);
+	if (ring->pool != NULL)
+		platform_free_pool(ring->pool, ring->pool_size);
+
+	ring->entries = NULL;
+	ring->pool = NULL;
+	ring->slot_count = 0;
+}
+
+int txring_push(struct txring *ring, unsigned int dst_addr, unsigned short dst_port,
+	const char *data, unsigned int length, unsigned long long capture_time)
+{
+	struct txring_entry *entry;
+	unsigned int head, position, offset;
+
+	head = ring->head;
+	if (head - PLATFORM_ATOMIC_LOAD_UINT(&ring->tail) == ring->slot_count)
+		goto full;
+
+	// Data never wraps around the end of the pool, so skip the leftover space
+	position = ring->pool_head;
+	offset = position & (ring->pool_size - 1);
+	if (offset + length > ring->pool_size)
+	{
+		position += ring->pool_size - offset;
+		offset = 0;
+	}
+
+	if (position + length - PLATFORM_ATOMIC_LOAD_UINT(&ring->pool_tail) > ring->pool_size)
+		goto full;
+
+	memcpy(ring->pool + offset, data, length);
+
+	entry = &ring->entries[head & (ring->slot_count - 1)];
+	entry->dst_addr = dst_addr;
+	entry->dst_port = dst_port;
+	entry->length = length;
+	entry->offset = offset;
+	entry->pool_end = position + length;
+	entry->capture_time = capture_time;
+
+	ring->pool_head = position + length;
+	ring->queued++;
+
+	// The consumer may take it from here on
+	PLATFORM_ATOMIC_STORE_UINT(&ring->head, head + 1);
+	return 0;
+
+full:
+	// Newest datagrams are the ones dropped, and the consumer had better be running
+	ring->dropped++;
+	txring_wake(ring);
+	return -1;
+}
+
+void txring_wake(struct txring *ring)
+{
+	// Only the first waker after the consumer went to sleep pays for the system call
+	if (PLATFORM_ATOMIC_LOAD_UINT(&ring->sleeping) &&
+		PLATFORM_ATOMIC_EXCHANGE_UINT(&ring->sleeping, 0))
+	{
+		platform_event_set(&ring->wakeup);
+	}
+}
+
+void txring_stop(struct txring *ring)
+{
+	PLATFORM_ATOMIC_STORE_UINT(&ring->stopping, 1);
+	platform_event_set(&ring->wakeup);
+}
+
+unsigned int txring_wait(struct txring *ring)
+{
+	unsigned int ready;
+
+	for (;;)
+	{
+		ready = PLATFORM_ATOMIC_LOAD_UINT(&ring->head) - ring->tail;
+		if (ready != 0)
+			return ready < TXRING_DRAIN_MAX ? ready : TXRING_DRAIN_MAX;
+
+		if (PLATFORM_ATOMIC_LOAD_UINT(&ring->stopping))
+			return 0;
+
+		// Ask to be woken, then look again in case the producer published before it saw that
+		PLATFORM_ATOMIC_STORE_UINT(&ring->sleeping, 1);
+		if (PLATFORM_ATOMIC_LOAD_UINT(&ring->head) != ring->tail ||
+			PLATFORM_ATOMIC_LOAD_UINT(&ring->stopping))
+		{
+			PLATFORM_ATOMIC_STORE_UINT(&ring->sleeping, 0);
+			continue;
+		}
+
+		platform_event_wait(&ring->wakeup);
+	}
+}
+
+struct txring_entry *txring_entry(struct txring *ring, unsigned int index)
+{
+	return &ring->entries[(ring->tail + index) & (ring->slot_count - 1)];
+}
+
+void txring_release(struct txring *ring, unsigned int count)
+{
+	struct txring_entry *last;
+
+	last = txring_entry(ring, count - 1);
+
+	// The pool space goes back first, so the producer never sees a free slot without it
+	PLATFORM_ATOMIC_STORE_UINT(&ring->pool_tail, last->pool_end);
+	PLATFORM_ATOMIC_STORE_UINT(&ring->tail, ring->tail + count);
+}
\ No newline at end of file
@@ -0,0 +1,86 @@
+#pragma once
+
+// Captured datagrams waiting for an interface's send thread. The ring holds a
+// descriptor per datagram, and the data is copied into a pool that's handed out
+// in ring order, so the capture thread (the only producer) and the send thread
+// (the only consumer) never take a lock or allocate.
+
+// Pool bytes reserved for each slot, enough for a full size datagram on Ethernet
+#define TXRING_SLOT_BYTES 2048
+
+// The pool must hold at least one of the largest datagram
+#define TXRING_MIN_SLOTS 32
+#define TXRING_MAX_SLOTS 65536
+
+// The usual huge page size on x86, which huge page pools are rounded up to
+#define TXRING_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Most datagrams the send thread takes before releasing them back to the capture thread
+#define TXRING_DRAIN_MAX 64
+
+// Keeps the producer's and consumer's fields off each other's cache lines
+#define TXRING_CACHE_LINE 64
+
+struct txring_entry {
+	unsigned int dst_addr;
+	unsigned short dst_port;
+	unsigned int length;
+
+	// Where the data starts in the pool, and the pool position once it's released
+	unsigned int offset;
+	unsigned int pool_end;
+
+	unsigned long long capture_time;
+};
+
+struct txring {
+	// Both powers of two, or 0 if the ring isn't used
+	unsigned int slot_count;
+	unsigned int pool_size;
+
+	struct txring_entry *entries;
+	char *pool;
+
+	// Only written by the producer. Positions count up forever and wrap with the
+	// unsigned arithmetic, which works since the sizes are powers of two.
+	volatile unsigned int head;
+	unsigned int pool_head;
+	unsigned long long queued;
+	unsigned long long dropped;
+
+	char producer_padding[TXRING_CACHE_LINE];
+
+	// Only written by the consumer, apart from the producer clearing sleeping to wake it
+	volatile unsigned int tail;
+	volatile unsigned int pool_tail;
+	volatile unsigned int sleeping;
+	volatile unsigned int stopping;
+
+	PLATFORM_EVENT wakeup;
+};
+
+// A slot count of 0 leaves the ring unused
+int txring_init(struct txring *ring, unsigned int slot_count, int huge_pages);
+void txring_destroy(struct txring *ring);
+
+// Producer side. Copies a datagram in and publishes it, returning -1 and counting
+// a drop if the consumer has fallen too far behind.
+int txring_push(struct txring *ring, unsigned int dst_addr, unsigned short dst_port,
+	const char *data, unsigned int length, unsigned long long capture_time);
+
+// Wakes the consumer if it's waiting, best called once per batch of pushes
+void txring_wake(struct txring *ring);
+
+// Makes the consumer's txring_wait() return 0 once the ring is empty
+void txring_stop(struct txring *ring);
+
+// Consumer side. Blocks until datagrams are published, returning how many are ready
+// to be read with txring_entry() (at most TXRING_DRAIN_MAX), or 0 once stopped.
+unsigned int txring_wait(struct txring *ring);
+
+// The index counts from the oldest datagram that hasn't been released
+struct txring_entry *txring_entry(struct txring *ring, unsigned int index);
+#define TXRING_DATA(ring, entry) ((ring)->pool + (entry)->offset)
+
+// Hands the oldest datagrams and their pool space back to the producer
+void txring_release(struct txring *ring, unsigned int count);
\ No newline at end of file
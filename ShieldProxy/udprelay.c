@@ -1,7 +1,76 @@
 #include "shieldrelay.h"
 
-const unsigned short UDP_PORTS[SHIELD_UDP_PORTS] =
-{ HTONS(SHIELD_UDP_VIDEO_PORT), HTONS(SHIELD_UDP_CONTROL_PORT), HTONS(SHIELD_UDP_AUDIO_PORT) };
+unsigned short udp_ports[UDPRELAY_MAX_PORTS];
+unsigned int udp_port_count;
+unsigned char udp_port_map[65536];
+unsigned char udp_port_class[UDPRELAY_MAX_PORTS];
+
+const struct stats_metric udprelay_metrics[] = {
+	{ "shieldproxy_udp_received_packets_total", "Datagrams the Shields sent to a relayed port",
+		offsetof(struct udprelay_port_context, stats.received_packets) },
+	{ "shieldproxy_udp_received_bytes_total", "Bytes the Shields sent to a relayed port",
+		offsetof(struct udprelay_port_context, stats.received_bytes) },
+	{ "shieldproxy_udp_forwarded_packets_total", "Datagrams relayed to a Shield",
+		offsetof(struct udprelay_port_context, stats.forwarded_packets) },
+	{ "shieldproxy_udp_forwarded_bytes_total", "Bytes relayed to a Shield",
+		offsetof(struct udprelay_port_context, stats.forwarded_bytes) },
+	{ "shieldproxy_udp_direct_packets_total", "Datagrams to a Shield on the default port, left for the network to deliver",
+		offsetof(struct udprelay_port_context, stats.direct_packets) },
+	{ "shieldproxy_udp_unmatched_packets_total", "Datagrams to an address with no Shield flow, left for the network to deliver",
+		offsetof(struct udprelay_port_context, stats.unmatched_packets) },
+	{ "shieldproxy_udp_send_errors_total", "Datagrams that failed to send to a Shield",
+		offsetof(struct udprelay_port_context, stats.send_errors) },
+	{ "shieldproxy_udp_segmented_sends_total", "Runs of datagrams sent to a Shield as one segmentation offload super-packet",
+		offsetof(struct udprelay_port_context, stats.segmented_sends) },
+	{ "shieldproxy_udp_src_port_changes_total", "Times a Shield moved to a new source port",
+		offsetof(struct udprelay_port_context, flows.port_changes) },
+};
+
+const unsigned int udprelay_metric_count = STATS_METRIC_COUNT(udprelay_metrics);
+
+const struct stats_metric udprelay_latency_metric = {
+	"shieldproxy_udp_forward_latency_microseconds",
+	"Microseconds from capturing a datagram for a Shield until it's sent on",
+	offsetof(struct udprelay_port_context, latency)
+};
+
+// Builds the port table from the configured ports and offset
+int udprelay_init_ports(void)
+{
+	unsigned int i, j, port;
+
+	memset(udp_port_map, 0, sizeof(udp_port_map));
+	udp_port_count = 0;
+
+	for (i = 0; i < proxy_config.udp_ports.count; i++)
+	{
+		port = proxy_config.udp_ports.values[i] + proxy_config.port_offset;
+		if (port == 0 || port > 65535)
+		{
+			printf("UDP port %u is out of range\n", port);
+			return -1;
+		}
+
+		if (udp_port_map[htons((unsigned short) port)] != 0)
+		{
+			printf("UDP port %u is listed more than once\n", port);
+			return -1;
+		}
+
+		// Priority ports are listed before the offset, like the relayed ones
+		udp_port_class[udp_port_count] = UDPRELAY_CLASS_BULK;
+		for (j = 0; j < proxy_config.priority_ports.count; j++)
+		{
+			if (proxy_config.priority_ports.values[j] == proxy_config.udp_ports.values[i])
+				udp_port_class[udp_port_count] = UDPRELAY_CLASS_PRIORITY;
+		}
+
+		udp_ports[udp_port_count++] = htons((unsigned short) port);
+		udp_port_map[htons((unsigned short) port)] = (unsigned char) udp_port_count;
+	}
+
+	return 0;
+}
 
 // Destination is relative to the Shield
 struct udprelay_port_context*
@@ -9,13 +78,11 @@ udprelay_lookup_port_context_by_dst(struct udprelay_adapter_context *context, un
 {
 	int i;
 
-	for (i = 0; i < SHIELD_UDP_PORTS; i++)
-	{
-		if (context->ports[i].dst_port == dst_port)
-			return &context->ports[i];
-	}
+	i = UDPRELAY_PORT_INDEX(dst_port);
+	if (i < 0)
+		return NULL;
 
-	return NULL;
+	return &context->ports[i];
 }
 
 int udprelay_unregister(struct udprelay_adapter_context *context)
@@ -23,13 +90,18 @@ int udprelay_unregister(struct udprelay_adapter_context *context)
 	int i;
 
 	// Close the sockets for each port
-	for (i = 0; i < SHIELD_UDP_PORTS; i++)
+	for (i = 0; i < (int) udp_port_count; i++)
 	{
 		if (context->ports[i].socket != -1)
 		{
 			closesocket(context->ports[i].socket);
 			context->ports[i].socket = -1;
 		}
+
+		// Anything still queued is dropped
+		free(context->ports[i].batch.slots);
+		context->ports[i].batch.slots = NULL;
+		context->ports[i].batch.count = 0;
 	}
 
 	return 0;
@@ -41,17 +113,32 @@ int udprelay_register(struct udprelay_adapter_context *context, struct in_addr i
 	int err, opt, i;
 
 	// Initialize the sockets to -1 for proper cleanup
-	for (i = 0; i < SHIELD_UDP_PORTS; i++)
+	for (i = 0; i < (int) udp_port_count; i++)
 	{
 		context->ports[i].socket = -1;
+		context->ports[i].batch.slots = NULL;
+		context->ports[i].batch.count = 0;
+		context->ports[i].segment_max = 0;
+		memset(&context->ports[i].stats, 0, sizeof(context->ports[i].stats));
+		latency_init(&context->ports[i].latency);
+		memset(context->ports[i].batch.addrs, 0, sizeof(context->ports[i].batch.addrs));
+		flowtable_init(&context->ports[i].flows);
 	}
 
 	// Set the default ports
-	for (i = 0; i < SHIELD_UDP_PORTS; i++)
+	for (i = 0; i < (int) udp_port_count; i++)
 	{
 		// Assign the default ports
-		context->ports[i].dst_port = UDP_PORTS[i];
-		context->ports[i].src_port = UDP_PORTS[i];
+		context->ports[i].dst_port = udp_ports[i];
+		context->ports[i].traffic_class = udp_port_class[i];
+
+		// Allocate the slots that captured data is copied into while it waits in a batch
+		context->ports[i].batch.slots = (char *) malloc(UDPRELAY_BATCH_MAX * UDPRELAY_SLOT_SIZE);
+		if (context->ports[i].batch.slots == NULL)
+		{
+			printf("Failed to allocate UDP batch\n");
+			return -1;
+		}
 
 		// Create the socket we'll use to forward later on
 		context->ports[i].socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -85,14 +172,57 @@ int udprelay_register(struct udprelay_adapter_context *context, struct in_addr i
 			context->ports[i].socket = -1;
 			return -1;
 		}
+
+		// Let the host's queues and the network know which ports matter most. Some
+		// systems only honor this with extra privileges or policy, so it's not fatal.
+		if (proxy_config.dscp)
+		{
+			if (context->ports[i].traffic_class == UDPRELAY_CLASS_PRIORITY)
+				err = platform_set_traffic_class(context->ports[i].socket, UDPRELAY_PRIORITY_DSCP, UDPRELAY_PRIORITY_PRIORITY);
+			else
+				err = platform_set_traffic_class(context->ports[i].socket, UDPRELAY_BULK_DSCP, UDPRELAY_BULK_PRIORITY);
+			if (err != 0)
+				printf("Failed to mark UDP %d traffic (%d)\n", ntohs(udp_ports[i]), platform_last_error());
+		}
+
+		// Video bursts go out as one super-packet per run if the kernel can split them up
+		if (proxy_config.udp_gso && platform_enable_segmentation(context->ports[i].socket) == 0)
+			context->ports[i].segment_max = UDPRELAY_SLOT_SIZE;
 	}
 
 	return 0;
 }
 
-void udprelay_reconfigure(struct udprelay_adapter_context *context, unsigned short src_port, unsigned short dst_port)
+// Drops the port's flows from Shields that have gone quiet, at most once an interval.
+// Only from the thread that captures the port's traffic.
+void udprelay_expire_port(struct udprelay_port_context *port_context, unsigned long long now)
+{
+	if (now < port_context->flows.next_expiry)
+		return;
+
+	flowtable_expire(&port_context->flows, port_context->dst_port, now,
+		(unsigned long long) proxy_config.flow_idle_timeout * 1000000);
+	port_context->flows.next_expiry = now + UDPRELAY_FLOW_EXPIRY_INTERVAL_US;
+}
+
+// The PC keeps sending after a Shield goes quiet, so the capture path calls this after
+// every batch instead of waiting for the next Shield to send
+void udprelay_expire(struct udprelay_adapter_context *context)
+{
+	unsigned long long now;
+	int i;
+
+	now = platform_time_us();
+	for (i = 0; i < (int) udp_port_count; i++)
+		udprelay_expire_port(&context->ports[i], now);
+}
+
+void udprelay_reconfigure(struct udprelay_adapter_context *context, unsigned int src_addr,
+	unsigned short src_port, unsigned short dst_port, unsigned int length)
 {
 	struct udprelay_port_context *port_context;
+	struct udprelay_flow *flow;
+	unsigned long long now;
 
 	port_context = udprelay_lookup_port_context_by_dst(context, dst_port);
 	if (port_context == NULL)
@@ -101,21 +231,180 @@ void udprelay_reconfigure(struct udprelay_adapter_context *context, unsigned sho
 		return;
 	}
 
-	// Print a message to the console if this is a new port
-	if (port_context->src_port != src_port)
+	port_context->stats.received_packets++;
+	port_context->stats.received_bytes += length;
+
+	now = platform_time_us();
+
+	// Remember where this Shield is talking to us from
+	flow = flowtable_update(&port_context->flows, src_addr, src_port, dst_port, now);
+	if (flow == NULL)
+	{
+		printf("Too many Shields on UDP %d, ignoring another one\n", ntohs(dst_port));
+	}
+	else
+	{
+		flow->rx_packets++;
+		flow->rx_bytes += length;
+	}
+
+	udprelay_expire_port(port_context, now);
+}
+
+// Records how long each of the sent datagrams took to get out
+static void record_latency(struct udprelay_port_context *port_context, unsigned long long *capture_times,
+	unsigned int count)
+{
+	unsigned long long now;
+	unsigned int i;
+
+	now = platform_wall_time_us();
+	for (i = 0; i < count; i++)
+	{
+		// The wall clock can step backwards, which would make nonsense of the delay
+		if (capture_times[i] != 0 && capture_times[i] <= now)
+			latency_record(&port_context->latency, now - capture_times[i]);
+	}
+}
+
+// Sends queued datagrams one by one, in as few calls as the platform allows
+static void send_datagrams(struct udprelay_port_context *port_context, unsigned int first, unsigned int count)
+{
+	struct udprelay_batch *batch = &port_context->batch;
+	unsigned int sent;
+	int err;
+
+	sent = 0;
+	while (sent < count)
 	{
-		printf("Shield is communicating with us: UDP %d -> %d\n", ntohs(src_port), ntohs(dst_port));
-		port_context->src_port = src_port;
+		err = platform_send_batch(port_context->socket, &batch->datagrams[first + sent], count - sent);
+		if (err < 0)
+		{
+			// Drop the datagram that failed and keep going with the rest
+			printf("Failed to send UDP packet (%d)\n", platform_last_error());
+			port_context->stats.send_errors++;
+			sent++;
+		}
+		else
+		{
+			record_latency(port_context, &batch->capture_times[first + sent], err);
+			sent += err;
+		}
+	}
+}
+
+// Counts the datagrams from the start of the list that can go out as one segmented send
+static unsigned int segment_run(struct udprelay_port_context *port_context,
+	struct platform_datagram *datagrams, unsigned int count)
+{
+	unsigned int length, total, i;
+
+	length = datagrams[0].length;
+	if (length == 0 || length > port_context->segment_max)
+		return 1;
+
+	total = length;
+	for (i = 1; i < count; i++)
+	{
+		// Every segment goes to the same Shield and only the last may be shorter
+		if (datagrams[i].length == 0 || datagrams[i].length > length ||
+			total + datagrams[i].length > UDPRELAY_SEGMENTED_MAX ||
+			datagrams[i].addr->sin_addr.s_addr != datagrams[0].addr->sin_addr.s_addr ||
+			datagrams[i].addr->sin_port != datagrams[0].addr->sin_port)
+			break;
+
+		total += datagrams[i].length;
+		if (datagrams[i].length < length)
+			return i + 1;
+	}
+
+	return i;
+}
+
+// Returns 0 if the run was sent as one super-packet, or -1 if it still has to be sent
+static int send_segmented(struct udprelay_port_context *port_context, unsigned int first, unsigned int count)
+{
+	struct udprelay_batch *batch = &port_context->batch;
+	unsigned int length;
+	int err;
+
+	err = platform_send_segmented(port_context->socket, &batch->datagrams[first], count);
+	if (err == 0)
+	{
+		// Datagrams this long will never segment here, so stop trying
+		length = batch->datagrams[first].length;
+		printf("Can't segment %u byte datagrams on UDP %d, sending them one at a time\n",
+			length, ntohs(port_context->dst_port));
+		port_context->segment_max = length - 1;
+		return -1;
+	}
+	else if (err < 0)
+	{
+		return -1;
+	}
+
+	port_context->stats.segmented_sends++;
+	record_latency(port_context, &batch->capture_times[first], count);
+	return 0;
+}
+
+void udprelay_flush_port(struct udprelay_port_context *port_context)
+{
+	struct udprelay_batch *batch = &port_context->batch;
+	unsigned int first, i, run;
+
+	// Runs of equal-sized datagrams to one Shield become a single segmented send,
+	// and everything between them goes out as a normal batch
+	first = 0;
+	i = 0;
+	while (port_context->segment_max != 0 && i < batch->count)
+	{
+		run = segment_run(port_context, &batch->datagrams[i], batch->count - i);
+		if (run < 2)
+		{
+			i++;
+			continue;
+		}
+
+		send_datagrams(port_context, first, i - first);
+		if (send_segmented(port_context, i, run) != 0)
+			send_datagrams(port_context, i, run);
+
+		i += run;
+		first = i;
+	}
+
+	send_datagrams(port_context, first, batch->count - first);
+	batch->count = 0;
+}
+
+void udprelay_flush(struct udprelay_adapter_context *context)
+{
+	int traffic_class, i;
+
+	// Strict priority, so audio and control never wait behind a video batch
+	for (traffic_class = UDPRELAY_CLASS_PRIORITY; traffic_class >= UDPRELAY_CLASS_BULK; traffic_class--)
+	{
+		for (i = 0; i < (int) udp_port_count; i++)
+		{
+			if (context->ports[i].traffic_class == traffic_class && context->ports[i].batch.count != 0)
+				udprelay_flush_port(&context->ports[i]);
+		}
 	}
 }
 
 // The "destination" here is the Shield
 void udprelay_forward(struct udprelay_adapter_context *context, unsigned int dst_addr,
-	unsigned short dst_port, char *data, unsigned int length)
+	unsigned short dst_port, char *data, unsigned int length, unsigned long long capture_time)
 {
-	struct sockaddr_in destaddr;
-	int bytes_sent;
 	struct udprelay_port_context *port_context;
+	struct udprelay_batch *batch;
+	struct platform_datagram *datagram;
+	struct udprelay_flow *flow;
+	struct sockaddr_in *addr;
+	unsigned long long now;
+	unsigned short src_port;
+	int oversized;
 
 	// The outgoing port is the same as the Shield's incoming port
 	port_context = udprelay_lookup_port_context_by_dst(context, dst_port);
@@ -125,20 +414,108 @@ void udprelay_forward(struct udprelay_adapter_context *context, unsigned int dst
 		return;
 	}
 
-	// No work to do if it's already sending on the port required
-	if (port_context->src_port == port_context->dst_port)
+	// No work to do unless a Shield talks to us from some other port
+	flow = flowtable_lookup(&port_context->flows, dst_addr, &src_port);
+	if (flow == NULL)
 	{
+		port_context->stats.unmatched_packets++;
 		return;
 	}
 
-	memset(&destaddr, 0, sizeof(destaddr));
-	destaddr.sin_family = AF_INET;
-	destaddr.sin_addr.S_un.S_addr = dst_addr; // Send it to the Shield
-	destaddr.sin_port = port_context->src_port; // Send it on the port where the Shield last contacted us
+	if (src_port == port_context->dst_port && !context->owns_ports)
+	{
+		port_context->stats.direct_packets++;
+		return;
+	}
+
+	flow->tx_packets++;
+	flow->tx_bytes += length;
+	port_context->stats.forwarded_packets++;
+	port_context->stats.forwarded_bytes += length;
+
+	batch = &port_context->batch;
+
+	// Datagrams that we'd have to copy but don't fit in a slot go out on their own,
+	// straight from the caller's buffer
+	oversized = !context->stable_buffers && length > UDPRELAY_SLOT_SIZE;
+	if (oversized)
+	{
+		udprelay_flush_port(port_context);
+	}
+
+	// Send it to the Shield on the port where it last contacted us
+	addr = &batch->addrs[batch->count];
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = dst_addr;
+	addr->sin_port = src_port;
+
+	// Queue it in the next slot
+	datagram = &batch->datagrams[batch->count];
+	datagram->addr = addr;
+	datagram->length = length;
+	batch->capture_times[batch->count] = capture_time;
+	if (context->stable_buffers || oversized)
+	{
+		datagram->data = data;
+	}
+	else
+	{
+		datagram->data = batch->slots + (batch->count * UDPRELAY_SLOT_SIZE);
+		memcpy(datagram->data, data, length);
+	}
+	batch->count++;
+
+	if (oversized)
+	{
+		udprelay_flush_port(port_context);
+		return;
+	}
+
+	// Priority datagrams are few and far between, so waiting for company only adds latency
+	if (port_context->traffic_class == UDPRELAY_CLASS_PRIORITY)
+	{
+		udprelay_flush_port(port_context);
+		return;
+	}
+
+	// Send early if the batch is full or the oldest datagram has waited long enough
+	if (batch->count >= proxy_config.batch_size)
+	{
+		udprelay_flush_port(port_context);
+		return;
+	}
+
+	now = platform_time_us();
+	if (batch->count == 1)
+	{
+		batch->deadline = now + proxy_config.batch_deadline_us;
+	}
+	else if (now >= batch->deadline)
+	{
+		udprelay_flush_port(port_context);
+	}
+}
+
+void udprelay_write_samples(struct stats_buffer *buffer, const struct stats_metric *metric,
+	const char *iface, struct udprelay_adapter_context *context)
+{
+	unsigned int i;
+
+	for (i = 0; i < udp_port_count; i++)
+	{
+		stats_write_sample(buffer, metric->name, iface, ntohs(context->ports[i].dst_port),
+			STATS_COUNTER(&context->ports[i], metric));
+	}
+}
+
+void udprelay_write_latency(struct stats_buffer *buffer, const char *iface,
+	struct udprelay_adapter_context *context)
+{
+	unsigned int i;
 
-	bytes_sent = sendto(port_context->socket, data, length, 0, (struct sockaddr*)&destaddr, sizeof(destaddr));
-	if (bytes_sent < 0)
+	for (i = 0; i < udp_port_count; i++)
 	{
-		printf("Failed to send UDP packet (%d)\n", platform_last_error());
+		latency_write_samples(buffer, udprelay_latency_metric.name, iface,
+			ntohs(context->ports[i].dst_port), &context->ports[i].latency);
 	}
 }
\ No newline at end of file
@@ -2,29 +2,130 @@
 
 #include "shieldrelay.h"
 
-// Shield ports
+// Default Shield ports
 #define SHIELD_UDP_PORTS 3
 #define SHIELD_UDP_VIDEO_PORT 47998
 #define SHIELD_UDP_CONTROL_PORT 47999
 #define SHIELD_UDP_AUDIO_PORT 48000
 
+// Control and audio, which are sent ahead of video
+#define SHIELD_UDP_PRIORITY_PORTS 2
+
+// Most ports that can be relayed at once
+#define UDPRELAY_MAX_PORTS 16
+
 #define HTONS(x) ((unsigned short)(((unsigned short)(x) << 8) | ((unsigned short)(x) >> 8)))
 
-extern const unsigned short UDP_PORTS[SHIELD_UDP_PORTS];
+// The relayed ports in network byte order, loaded at startup
+extern unsigned short udp_ports[UDPRELAY_MAX_PORTS];
+extern unsigned int udp_port_count;
+
+// Indexed by a port in network byte order, holding its index in udp_ports plus one
+// or 0 if the port isn't relayed
+extern unsigned char udp_port_map[65536];
+
+#define UDPRELAY_PORT_INDEX(port) ((int) udp_port_map[(unsigned short)(port)] - 1)
+
+// Traffic classes. Priority ports (audio and control by default) are sent ahead of
+// bulk ones (video), so a video burst can't hold up the datagrams behind it.
+#define UDPRELAY_CLASS_BULK 0
+#define UDPRELAY_CLASS_PRIORITY 1
+
+// The class of each relayed port, in udp_ports order
+extern unsigned char udp_port_class[UDPRELAY_MAX_PORTS];
+
+// Only valid for relayed ports
+#define UDPRELAY_PORT_CLASS(port) (udp_port_class[UDPRELAY_PORT_INDEX(port)])
+
+// How each class is marked for the host's and network's queues: AF41 and best effort
+// for video, EF and the interactive band for audio and control
+#define UDPRELAY_BULK_DSCP 34
+#define UDPRELAY_BULK_PRIORITY 0
+#define UDPRELAY_PRIORITY_DSCP 46
+#define UDPRELAY_PRIORITY_PRIORITY 6
+
+// Most datagrams queued on a port before they're flushed
+#define UDPRELAY_BATCH_MAX 32
+
+// Largest datagram that fits in a batch slot when it must be copied
+#define UDPRELAY_SLOT_SIZE 2048
+
+// Largest super-packet a segmented send may build, all a UDP datagram over IPv4 can carry
+#define UDPRELAY_SEGMENTED_MAX 65507
+
+// Datagrams queued for a single sendmmsg() on a port's socket
+struct udprelay_batch {
+	unsigned int count;
+	unsigned long long deadline;
+	struct sockaddr_in addrs[UDPRELAY_BATCH_MAX];
+	struct platform_datagram datagrams[UDPRELAY_BATCH_MAX];
+	char *slots;
+
+	// When each datagram was captured or received, in wall clock microseconds (0 if unknown)
+	unsigned long long capture_times[UDPRELAY_BATCH_MAX];
+};
+
+// Traffic counters for a port. The capture path counts what the Shields send and
+// the forwarding path counts the rest, so each field has a single writer.
+struct udprelay_port_stats {
+	unsigned long long received_packets;
+	unsigned long long received_bytes;
+	unsigned long long forwarded_packets;
+	unsigned long long forwarded_bytes;
+	unsigned long long direct_packets;
+	unsigned long long unmatched_packets;
+	unsigned long long send_errors;
+	unsigned long long segmented_sends;
+};
 
 struct udprelay_port_context {
 	SOCKET socket;
 	unsigned short dst_port;
-	unsigned short src_port;
+	int traffic_class;
+	struct udprelay_batch batch;
+	struct udprelay_port_stats stats;
+
+	// Largest datagram sent in segmented runs, lowered when the kernel refuses a size
+	// and 0 when segmentation offload is off
+	unsigned int segment_max;
+
+	// Capture to send delay of forwarded datagrams, recorded by the forwarding path
+	struct latency_histogram latency;
+
+	// Every Shield talking to us on this port
+	struct udprelay_flow_table flows;
 };
 
 struct udprelay_adapter_context {
-	struct udprelay_port_context ports[SHIELD_UDP_PORTS];
+	struct udprelay_port_context ports[UDPRELAY_MAX_PORTS];
+
+	// Set when forwarded data stays valid until udprelay_flush(), so it doesn't need to be copied
+	int stable_buffers;
+
+	// Set when nothing else delivers the PC's datagrams, so they're forwarded even
+	// to a Shield that uses the default port
+	int owns_ports;
 };
 
+int udprelay_init_ports(void);
 int udprelay_unregister(struct udprelay_adapter_context *context);
 int udprelay_register(struct udprelay_adapter_context *context, struct in_addr iface_addr);
-void udprelay_reconfigure(struct udprelay_adapter_context *context, unsigned short src_port,
-	unsigned short dst_port);
+void udprelay_reconfigure(struct udprelay_adapter_context *context, unsigned int src_addr,
+	unsigned short src_port, unsigned short dst_port, unsigned int length);
 void udprelay_forward(struct udprelay_adapter_context *context, unsigned int dst_addr,
-	unsigned short src_port, char *data, unsigned int length);
\ No newline at end of file
+	unsigned short src_port, char *data, unsigned int length, unsigned long long capture_time);
+void udprelay_flush(struct udprelay_adapter_context *context);
+void udprelay_flush_port(struct udprelay_port_context *port_context);
+void udprelay_expire(struct udprelay_adapter_context *context);
+void udprelay_expire_port(struct udprelay_port_context *port_context, unsigned long long now);
+
+// Counters kept for each port, found relative to its udprelay_port_context
+extern const struct stats_metric udprelay_metrics[];
+extern const unsigned int udprelay_metric_count;
+extern const struct stats_metric udprelay_latency_metric;
+
+// Writes one metric's sample for every port of an adapter
+void udprelay_write_samples(struct stats_buffer *buffer, const struct stats_metric *metric,
+	const char *iface, struct udprelay_adapter_context *context);
+void udprelay_write_latency(struct stats_buffer *buffer, const char *iface,
+	struct udprelay_adapter_context *context);
\ No newline at end of file
@@ -40,6 +40,54 @@ void platform_mutex_release(PLATFORM_MUTEX *mutex)
 	LeaveCriticalSection(mutex);
 }
 
+void platform_event_init(PLATFORM_EVENT *event)
+{
+	*event = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+}
+
+void platform_event_destroy(PLATFORM_EVENT *event)
+{
+	CloseHandle(*event);
+}
+
+void platform_event_set(PLATFORM_EVENT *event)
+{
+	ReleaseSemaphore(*event, 1, NULL);
+}
+
+void platform_event_wait(PLATFORM_EVENT *event)
+{
+	WaitForSingleObject(*event, INFINITE);
+}
+
+void *platform_alloc_pool(size_t size, int huge_pages)
+{
+	void *pool;
+
+	if (huge_pages)
+	{
+		// Large pages are committed and locked up front, but only with SeLockMemoryPrivilege
+		pool = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (pool != NULL)
+			return pool;
+
+		printf("Large pages aren't available (%d), using normal pages\n", GetLastError());
+	}
+
+	pool = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (pool == NULL)
+		return NULL;
+
+	// Commit only promises the pages, so touch them now
+	memset(pool, 0, size);
+	return pool;
+}
+
+void platform_free_pool(void *pool, size_t size)
+{
+	VirtualFree(pool, 0, MEM_RELEASE);
+}
+
 void platform_cleanup(void)
 {
 	// Unregister a change notification if we have one
@@ -57,6 +105,155 @@ int platform_last_error(void)
 	return WSAGetLastError();
 }
 
+void platform_sleep_ms(unsigned int ms)
+{
+	Sleep(ms);
+}
+
+// Errors that only affect a single datagram, after which the socket is still usable
+int platform_error_is_transient(int error)
+{
+	switch (error)
+	{
+	case WSAEINTR:
+	case WSAEWOULDBLOCK:
+	case WSAENOBUFS:
+	case WSAEMSGSIZE:
+	case WSAECONNRESET: // ICMP port unreachable on a UDP socket
+	case WSAENETRESET:
+	case WSAEHOSTUNREACH:
+	case WSAENETUNREACH:
+	case WSAENETDOWN:
+	case WSAEADDRNOTAVAIL:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+unsigned long long platform_time_us(void)
+{
+	LARGE_INTEGER counter, frequency;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+
+	return (unsigned long long)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+		(unsigned long long)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+unsigned long long platform_wall_time_us(void)
+{
+	ULARGE_INTEGER time;
+	FILETIME file_time;
+
+	// FILETIME counts 100ns intervals from 1601
+	GetSystemTimeAsFileTime(&file_time);
+	time.LowPart = file_time.dwLowDateTime;
+	time.HighPart = file_time.dwHighDateTime;
+
+	return time.QuadPart / 10 - 11644473600000000ULL;
+}
+
+// WinSock only has receive timestamps on Windows 10, so the caller's clock is used instead
+int platform_enable_timestamps(SOCKET s)
+{
+	return -1;
+}
+
+int platform_set_traffic_class(SOCKET s, int dscp, int priority)
+{
+	DWORD tos;
+
+	// Windows drops this unless a QoS policy allows it, and has no socket priority
+	tos = dscp << 2;
+	return setsockopt(s, IPPROTO_IP, IP_TOS, (char *) &tos, sizeof(tos));
+}
+
+int platform_enable_segmentation(SOCKET s)
+{
+	// UDP_SEND_MSG_SIZE needs a newer SDK and Windows than we build for
+	return -1;
+}
+
+int platform_send_segmented(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	return 0;
+}
+
+int platform_recv_batch(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	unsigned int i;
+	u_long queued;
+	int addr_length, received;
+
+	for (i = 0; i < count; i++)
+	{
+		// Only block for the first datagram
+		if (i != 0 && (ioctlsocket(s, FIONREAD, &queued) != 0 || queued == 0))
+			break;
+
+		addr_length = sizeof(*datagrams[i].addr);
+		received = recvfrom(s, datagrams[i].data, datagrams[i].length, 0,
+			(struct sockaddr*) datagrams[i].addr, &addr_length);
+		datagrams[i].truncated = 0;
+		if (received < 0 && WSAGetLastError() == WSAEMSGSIZE)
+		{
+			// The buffer holds the start of a longer datagram
+			received = (int) datagrams[i].length;
+			datagrams[i].truncated = 1;
+		}
+		else if (received < 0)
+		{
+			// Return what we have if a later receive fails
+			return i > 0 ? (int) i : -1;
+		}
+
+		datagrams[i].length = received;
+		datagrams[i].timestamp = 0;
+	}
+
+	return (int) i;
+}
+
+int platform_send_batch(SOCKET s, struct platform_datagram *datagrams, unsigned int count)
+{
+	unsigned int i;
+
+	// WinSock has no batched send, so this only saves the caller the loop
+	for (i = 0; i < count; i++)
+	{
+		if (sendto(s, datagrams[i].data, datagrams[i].length, 0, (struct sockaddr*) datagrams[i].addr,
+			datagrams[i].addr != NULL ? sizeof(*datagrams[i].addr) : 0) < 0)
+		{
+			return i > 0 ? (int) i : -1;
+		}
+	}
+
+	return (int) count;
+}
+
+int iface_index_usable(NET_IFINDEX index)
+{
+	MIB_IFROW ifRow;
+
+	// We need the interface entry to check for operational status
+	ifRow.dwIndex = index;
+	if (GetIfEntry(&ifRow) != NO_ERROR)
+		return 0;
+
+	// Check that the interface is enabled
+	if (ifRow.dwAdminStatus != MIB_IF_ADMIN_STATUS_UP)
+		return 0;
+
+	// Check that the interface is up with a link
+	if (ifRow.dwOperStatus != IF_OPER_STATUS_OPERATIONAL &&
+		ifRow.dwOperStatus != IF_OPER_STATUS_CONNECTED)
+		return 0;
+
+	return 1;
+}
+
 VOID
 WINAPI
 addr_change_callback(
@@ -66,9 +263,31 @@ addr_change_callback(
 )
 {
 	reconfigure_callback_function reconfig_callback = (reconfigure_callback_function) CallerContext;
+	unsigned int address;
+
+	// Pass the changed address along so the table doesn't need to be requeried
+	if (Row != NULL && Row->Address.si_family == AF_INET)
+	{
+		address = Row->Address.Ipv4.sin_addr.s_addr;
+
+		if (NotificationType == MibAddInstance)
+		{
+			// Only report addresses on interfaces that we'd return in the IP table
+			if (iface_index_usable(Row->InterfaceIndex))
+			{
+				reconfig_callback(PLATFORM_IFACE_ADDR_ADDED, address);
+			}
+			return;
+		}
+		else if (NotificationType == MibDeleteInstance)
+		{
+			reconfig_callback(PLATFORM_IFACE_ADDR_REMOVED, address);
+			return;
+		}
+	}
 
 	// Call the reconfiguration callback
-	reconfig_callback();
+	reconfig_callback(PLATFORM_IFACE_CHANGED, 0);
 }
 
 DWORD
@@ -113,7 +332,6 @@ int platform_iface_ip_table(unsigned int *ip_table, unsigned int *ip_table_len)
 	ULONG addressListSize;
 	ULONG addressCount;
 	struct sockaddr_in *addr;
-	MIB_IFROW ifRow;
 
 	// Call to get the length first
 	addressListHead = NULL;
@@ -183,24 +401,13 @@ int platform_iface_ip_table(unsigned int *ip_table, unsigned int *ip_table_len)
 		if (currentAddress->IfType == IF_TYPE_SOFTWARE_LOOPBACK)
 			continue;
 
-		// We need the interface entry to check for operational status
-		ifRow.dwIndex = currentAddress->IfIndex;
-		err = GetIfEntry(&ifRow);
-		if (err != NO_ERROR)
-			continue;
-
-		// Check that the interface is enabled
-		if (ifRow.dwAdminStatus != MIB_IF_ADMIN_STATUS_UP)
-			continue;
-
-		// Check that the interface is up with a link
-		if (ifRow.dwOperStatus != IF_OPER_STATUS_OPERATIONAL &&
-			ifRow.dwOperStatus != IF_OPER_STATUS_CONNECTED)
+		// Skip interfaces that aren't operational
+		if (!iface_index_usable(currentAddress->IfIndex))
 			continue;
 
 		// Get the address
 		addr = (struct sockaddr_in *)currentAddress->FirstUnicastAddress->Address.lpSockaddr;
-		ip_table[addressCount++] = addr->sin_addr.S_un.S_addr;
+		ip_table[addressCount++] = addr->sin_addr.s_addr;
 	}
 
 	HeapFree(GetProcessHeap(), 0, addressListHead);
@@ -210,9 +417,9 @@ int platform_iface_ip_table(unsigned int *ip_table, unsigned int *ip_table_len)
 	return 0;
 }
 
-int platform_start_thread(thread_start_function thread_start, void* thread_parameter)
+int platform_start_thread(thread_start_function thread_start, void* thread_parameter, PLATFORM_THREAD *thread)
 {
-	HANDLE thread;
+	HANDLE handle;
 	struct thread_stub_tuple *tuple;
 
 	tuple = (struct thread_stub_tuple *) malloc(sizeof(*tuple));
@@ -225,19 +432,31 @@ int platform_start_thread(thread_start_function thread_start, void* thread_param
 	tuple->thread_start = thread_start;
 	tuple->thread_parameter = thread_parameter;
 
-	thread = CreateThread(
+	handle = CreateThread(
 		NULL,
 		0,
 		thread_stub,
 		tuple,
 		0,
 		NULL);
-	if (thread == INVALID_HANDLE_VALUE)
+	if (handle == NULL)
 	{
 		printf("Failed to create a new thread\n");
 		free(tuple);
 		return -1;
 	}
 
+	// Hand the handle to the caller if they want to join it later
+	if (thread != NULL)
+		*thread = handle;
+	else
+		CloseHandle(handle);
+
 	return 0;
+}
+
+void platform_join_thread(PLATFORM_THREAD thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
 }
\ No newline at end of file
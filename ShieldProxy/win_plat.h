@@ -5,4 +5,16 @@
 #include <WinSock2.h>
 #include <WS2tcpip.h>
 
-#define PLATFORM_MUTEX CRITICAL_SECTION
\ No newline at end of file
+#define PLATFORM_NAME "Windows"
+
+#define PLATFORM_MUTEX CRITICAL_SECTION
+#define PLATFORM_THREAD HANDLE
+#define PLATFORM_EVENT HANDLE
+
+// Sequentially consistent atomics. Loads rely on MSVC's acquire semantics for
+// volatile reads, and the Interlocked stores are full barriers.
+#define PLATFORM_ATOMIC_LOAD_PTR(ptr) (*(void * volatile *)(ptr))
+#define PLATFORM_ATOMIC_EXCHANGE_PTR(ptr, value) InterlockedExchangePointer((PVOID volatile *)(ptr), (PVOID)(value))
+#define PLATFORM_ATOMIC_LOAD_UINT(ptr) (*(volatile unsigned int *)(ptr))
+#define PLATFORM_ATOMIC_EXCHANGE_UINT(ptr, value) ((unsigned int) InterlockedExchange((volatile LONG *)(ptr), (LONG)(value)))
+#define PLATFORM_ATOMIC_STORE_UINT(ptr, value) InterlockedExchange((volatile LONG *)(ptr), (LONG)(value))
\ No newline at end of file